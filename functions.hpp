@@ -23,6 +23,8 @@
 {"mysql_field_seek", gsc_mysql_field_seek},
 {"mysql_fetch_field", gsc_mysql_fetch_field},
 {"mysql_fetch_row", gsc_mysql_fetch_row},
+{"mysql_fetch_row_assoc", gsc_mysql_fetch_row_assoc},
+{"mysql_fetch_rows_assoc", gsc_mysql_fetch_rows_assoc},
 {"mysql_free_result", gsc_mysql_free_result},
 {"mysql_real_escape_string", gsc_mysql_real_escape_string},
 {"mysql_async_create_query", gsc_mysql_async_create_query},
@@ -34,7 +36,15 @@
 {"mysql_setup_longquery", gsc_mysql_setup_longquery},
 {"mysql_free_longquery", gsc_mysql_free_longquery},
 {"mysql_append_longquery", gsc_mysql_append_longquery},
+{"mysql_append_longquery_escaped", gsc_mysql_append_longquery_escaped},
+{"mysql_append_longquery_number", gsc_mysql_append_longquery_number},
 {"mysql_async_execute_longquery", gsc_mysql_async_execute_longquery},
+{"mysql_register_template", gsc_mysql_register_template},
+{"mysql_async_execute_template", gsc_mysql_async_execute_template},
+{"mysql_async_execute_template_nosave", gsc_mysql_async_execute_template_nosave},
+{"mysql_use_fake_backend", gsc_mysql_use_fake_backend},
+{"mysql_async_benchmark", gsc_mysql_async_benchmark},
+{"mysql_async_contention_benchmark", gsc_mysql_async_contention_benchmark},
 {"updateplayervisibility", Gsc_Vis_UpdatePlayerVisibility},
 {"discord_connect", Gsc_Discord_Connect},
 {"discord_getevent", Gsc_Discord_GetEvent},
@@ -44,13 +54,31 @@
 {"getConfigStringByIndex", Gsc_Utils_VoidFunc},
 #endif
 {"clearAllDemos", Gsc_Demo_ClearAllDemos},
+{"setMaxNumberOfDemos", Gsc_Demo_SetMaxNumberOfDemos, 0},
+{"setDemoMemoryBudget", Gsc_Demo_SetMemoryBudget, 0},
 {"demoHasKeyFrames", Gsc_Demo_HasKeyFrames},
 {"numberOfDemoFrames", Gsc_Demo_NumberOfFrames},
 {"numberOfDemoKeyFrames", Gsc_Demo_NumberOfKeyFrames},
+{"numberOfDemoFinalPathFrames", Gsc_Demo_NumberOfFinalPathFrames, 0},
+{"demoFinalPathPosition", Gsc_Demo_FinalPathPosition, 0},
+{"demoKeyFrameRank", Gsc_Demo_KeyFrameRank, 0},
+{"demoKeyFrameByRank", Gsc_Demo_KeyFrameByRank, 0},
+{"demoNearestFrame", Gsc_Demo_NearestFrame, 0},
+{"demoFindEvents", Gsc_Demo_FindEvents, 0},
+{"demoCountEvents", Gsc_Demo_CountEvents, 0},
+{"demoMaxSpeed", Gsc_Demo_MaxSpeed, 0},
+{"demoFpsHistogram", Gsc_Demo_FpsHistogram, 0},
+{"demoSimplifiedRoute", Gsc_Demo_SimplifyRoute, 0},
 {"createDemo", Gsc_Demo_CreateDemo, 0},
 {"destroyDemo", Gsc_Demo_DestroyDemo, 0},
 {"completeDemo", Gsc_Demo_CompleteDemo, 0},
 {"addFrameToDemo", Gsc_Demo_AddFrame, 0},
+{"setDemoSparseRecording", Gsc_Demo_SetSparseRecording, 0},
+{"getPersistedDemos", Gsc_Demo_GetPersistedDemos, 0},
+{"saveDemo", Gsc_Demo_SaveDemo, 0},
+{"loadDemo", Gsc_Demo_LoadDemo, 0},
+{"demoBenchmark", Gsc_Demo_Benchmark, 0},
+{"advanceDemoPlayback", Gsc_Demo_AdvancePlayback, 0},
 {"setconfigstringbyindex", Gsc_Utils_setConfigStringByIndex, 0},
 {"sv_getconfigstring", Gsc_SV_GetConfigString, 0},
 {"constructMessage", Gsc_Utils_constructMessage, 0},
@@ -10,47 +10,511 @@
 
 #include <mysql/mysql.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
 
-#define SQL_MAX_QUERY_SIZE  (10 * 1024)
+#include <atomic>
+#include <cmath>
 
+// Initial buffer size of a long query, it grows as needed up to the max. size
+#define SQL_LONGQUERY_INITIAL_SIZE  (4 * 1024)
+#define SQL_LONGQUERY_MAX_SIZE      (1024 * 1024 * 1024)
+
+// Max. number of queries a single mysql_async_benchmark() run may issue, keeps the latency sample buffers bounded
+#define SQL_BENCHMARK_MAX_QUERIES   (1000 * 1000)
+// Max. number of threads mysql_async_contention_benchmark() may start
+#define SQL_BENCHMARK_MAX_THREADS   64
+
+// Max. number of distinct query templates, they live until their connection is closed
+#define SQL_MAX_TEMPLATES           256
+// Template ids are (generation << SQL_TEMPLATE_SLOT_BITS) | slot. A slot gets a new generation whenever it's (re)used,
+// so the id of a dropped template never refers to the template that took its slot
+#define SQL_TEMPLATE_SLOT_BITS      8
+#define SQL_TEMPLATE_MAX_GENERATION (0x7FFFFFFF >> SQL_TEMPLATE_SLOT_BITS)
+
+/*
+    A task is handed between threads without locks:
+    game thread --(submitted queue)--> handler thread --(connection)--> worker --(completed queue)--> game thread
+    prev/next link all tasks of the game thread (so ids can be looked up), queueNext is used by whichever queue the task is in.
+*/
 struct mysql_async_task
 {
     mysql_async_task *prev;
     mysql_async_task *next;
+    mysql_async_task *queueNext;
     int id;
-    MYSQL_RES *result;
-    bool done;
-    bool started;
+    MYSQL_RES *result;      // Written by the worker before the task is pushed to the completed queue
+    bool done;              // Game thread only, set once the task was taken from the completed queue
     bool save;
-    char query[SQL_MAX_QUERY_SIZE + 1];
+    bool failed;            // Written by the worker, whether the query returned an error
+    uint64_t createdUs;     // When the task was queued by the game thread
+    uint64_t dispatchedUs;  // When the handler thread handed the task to a connection
+    char *query;            // Owned by the task, freed together with it
+};
+
+// Growable query buffer, so large queries can be built without re-scanning or copying them
+struct mysql_longquery
+{
+    char *buf;
+    int length;     // Excluding terminator
+    int capacity;   // Including terminator
+};
+
+/*
+    Everything that talks to a database goes through a backend.
+    By default this is libmysql, but an in-process fake can be selected (before connecting) to
+    load-test the async pipeline without a database: mysql_use_fake_backend(...)
+*/
+struct mysql_backend
+{
+    const char *name;
+    MYSQL *(*init)();
+    MYSQL *(*real_connect)(MYSQL *mysql, const char *host, const char *user, const char *pass, const char *db, unsigned int port);
+    void (*close)(MYSQL *mysql);
+    int (*query)(MYSQL *mysql, const char *query);
+    unsigned int (*err_no)(MYSQL *mysql);
+    const char *(*error)(MYSQL *mysql);
+    unsigned long long (*affected_rows)(MYSQL *mysql);
+    MYSQL_RES *(*store_result)(MYSQL *mysql);
+    unsigned long long (*num_rows)(MYSQL_RES *result);
+    unsigned int (*num_fields)(MYSQL_RES *result);
+    unsigned int (*field_seek)(MYSQL_RES *result, unsigned int offset);
+    MYSQL_FIELD *(*fetch_field)(MYSQL_RES *result);
+    MYSQL_ROW (*fetch_row)(MYSQL_RES *result);
+    void (*free_result)(MYSQL_RES *result);
+    unsigned long (*escape_string)(MYSQL *mysql, char *to, const char *from, unsigned long length);
+};
+
+static uint64_t mysql_time_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+//==========================================================================
+// libmysql backend
+//==========================================================================
+
+static MYSQL *libmysql_init()
+{
+    return mysql_init(NULL);
+}
+
+static MYSQL *libmysql_real_connect(MYSQL *mysql, const char *host, const char *user, const char *pass, const char *db, unsigned int port)
+{
+    MYSQL *connection = mysql_real_connect(mysql, host, user, pass, db, port, NULL, 0);
+    bool reconnect = true;
+    mysql_options(connection, MYSQL_OPT_RECONNECT, &reconnect);
+    return connection;
+}
+
+static int libmysql_query(MYSQL *mysql, const char *query)
+{
+    return mysql_query(mysql, query);
+}
+
+static unsigned long long libmysql_affected_rows(MYSQL *mysql)
+{
+    return mysql_affected_rows(mysql);
+}
+
+static unsigned long long libmysql_num_rows(MYSQL_RES *result)
+{
+    return mysql_num_rows(result);
+}
+
+static unsigned int libmysql_field_seek(MYSQL_RES *result, unsigned int offset)
+{
+    return mysql_field_seek(result, offset);
+}
+
+static const mysql_backend libmysql_backend =
+{
+    "libmysql",
+    libmysql_init,
+    libmysql_real_connect,
+    mysql_close,
+    libmysql_query,
+    mysql_errno,
+    mysql_error,
+    libmysql_affected_rows,
+    mysql_store_result,
+    libmysql_num_rows,
+    mysql_num_fields,
+    libmysql_field_seek,
+    mysql_fetch_field,
+    mysql_fetch_row,
+    mysql_free_result,
+    mysql_real_escape_string,
+};
+
+//==========================================================================
+// Fake backend: in-process stand-in with configurable latency, errors and result shape
+//==========================================================================
+
+struct mysql_fake_config
+{
+    int latencyUs;      // Base time a query takes
+    int jitterUs;       // Random extra time on top of latencyUs
+    int errorPermille;  // Chance (out of 1000) that a query fails
+    int nrRows;         // Shape of the result of every successful query
+    int nrFields;
+    int valueLength;    // Length of every value in the result
+};
+
+struct mysql_fake_connection
+{
+    unsigned int lastErrno;
+    bool hasResult;
+};
+
+struct mysql_fake_result
+{
+    int nrRows;
+    int nrFields;
+    int currentRow;
+    int currentField;
+    MYSQL_FIELD *fields;
+    char **values;      // nrRows * nrFields pointers into valueData, handed out row by row as MYSQL_ROW
+    char *valueData;
+};
+
+static mysql_fake_config fake_config = {1000, 500, 0, 1, 4, 8};
+
+static MYSQL *fake_init()
+{
+    return (MYSQL *)calloc(1, sizeof(mysql_fake_connection));
+}
+
+static MYSQL *fake_real_connect(MYSQL *mysql, const char *host, const char *user, const char *pass, const char *db, unsigned int port)
+{
+    return mysql;
+}
+
+static void fake_close(MYSQL *mysql)
+{
+    free(mysql);
+}
+
+static int fake_query(MYSQL *mysql, const char *query)
+{
+    static __thread unsigned int seed = 0;
+    if (seed == 0)
+    {
+        seed = (unsigned int)mysql_time_us() ^ (unsigned int)(uintptr_t)&seed;
+    }
+
+    mysql_fake_connection *c = (mysql_fake_connection *)mysql;
+    int delayUs = fake_config.latencyUs;
+    if (fake_config.jitterUs > 0)
+    {
+        delayUs += rand_r(&seed) % fake_config.jitterUs;
+    }
+    if (delayUs > 0)
+    {
+        usleep(delayUs);
+    }
+
+    bool failed = (fake_config.errorPermille > 0) && ((rand_r(&seed) % 1000) < fake_config.errorPermille);
+    c->lastErrno = failed ? 2013 /* CR_SERVER_LOST */ : 0;
+    c->hasResult = !failed;
+    return failed ? 1 : 0;
+}
+
+static unsigned int fake_errno(MYSQL *mysql)
+{
+    return ((mysql_fake_connection *)mysql)->lastErrno;
+}
+
+static const char *fake_error(MYSQL *mysql)
+{
+    return (((mysql_fake_connection *)mysql)->lastErrno != 0) ? "Fake backend: simulated query failure" : "";
+}
+
+static unsigned long long fake_affected_rows(MYSQL *mysql)
+{
+    return ((mysql_fake_connection *)mysql)->hasResult ? fake_config.nrRows : 0;
+}
+
+static MYSQL_RES *fake_store_result(MYSQL *mysql)
+{
+    mysql_fake_connection *c = (mysql_fake_connection *)mysql;
+    if (!c->hasResult)
+    {
+        return NULL;
+    }
+    c->hasResult = false;
+
+    int nrRows = fake_config.nrRows;
+    int nrFields = fake_config.nrFields;
+    int valueLength = fake_config.valueLength;
+    mysql_fake_result *result = (mysql_fake_result *)calloc(1, sizeof(mysql_fake_result));
+    result->nrRows = nrRows;
+    result->nrFields = nrFields;
+    result->fields = (MYSQL_FIELD *)calloc(nrFields, sizeof(MYSQL_FIELD));
+    result->values = (char **)calloc((nrRows * nrFields) + 1, sizeof(char *));
+    result->valueData = (char *)calloc(nrFields * 16 + nrRows * nrFields * (valueLength + 1) + 1, 1);
+
+    char *pData = result->valueData;
+    for (int i = 0; i < nrFields; i++)
+    {
+        result->fields[i].name = pData;
+        pData += snprintf(pData, 16, "field%d", i) + 1;
+    }
+    for (int i = 0; i < (nrRows * nrFields); i++)
+    {
+        result->values[i] = pData;
+        memset(pData, 'a' + (i % 26), valueLength);
+        pData += valueLength + 1;
+    }
+
+    return (MYSQL_RES *)result;
+}
+
+static unsigned long long fake_num_rows(MYSQL_RES *result)
+{
+    return ((mysql_fake_result *)result)->nrRows;
+}
+
+static unsigned int fake_num_fields(MYSQL_RES *result)
+{
+    return ((mysql_fake_result *)result)->nrFields;
+}
+
+static unsigned int fake_field_seek(MYSQL_RES *result, unsigned int offset)
+{
+    mysql_fake_result *r = (mysql_fake_result *)result;
+    unsigned int prev = r->currentField;
+    r->currentField = offset;
+    return prev;
+}
+
+static MYSQL_FIELD *fake_fetch_field(MYSQL_RES *result)
+{
+    mysql_fake_result *r = (mysql_fake_result *)result;
+    if (r->currentField >= r->nrFields)
+    {
+        return NULL;
+    }
+    return &r->fields[r->currentField++];
+}
+
+static MYSQL_ROW fake_fetch_row(MYSQL_RES *result)
+{
+    mysql_fake_result *r = (mysql_fake_result *)result;
+    if (r->currentRow >= r->nrRows)
+    {
+        return NULL;
+    }
+    return &r->values[(r->currentRow++) * r->nrFields];
+}
+
+static void fake_free_result(MYSQL_RES *result)
+{
+    mysql_fake_result *r = (mysql_fake_result *)result;
+    free(r->fields);
+    free(r->values);
+    free(r->valueData);
+    free(r);
+}
+
+static unsigned long fake_escape_string(MYSQL *mysql, char *to, const char *from, unsigned long length)
+{
+    unsigned long len = 0;
+    for (unsigned long i = 0; i < length; i++)
+    {
+        if ((from[i] == '\'') || (from[i] == '"') || (from[i] == '\\'))
+        {
+            to[len++] = '\\';
+        }
+        to[len++] = from[i];
+    }
+    to[len] = '\0';
+    return len;
+}
+
+static const mysql_backend fake_backend =
+{
+    "fake",
+    fake_init,
+    fake_real_connect,
+    fake_close,
+    fake_query,
+    fake_errno,
+    fake_error,
+    fake_affected_rows,
+    fake_store_result,
+    fake_num_rows,
+    fake_num_fields,
+    fake_field_seek,
+    fake_fetch_field,
+    fake_fetch_row,
+    fake_free_result,
+    fake_escape_string,
+};
+
+static const mysql_backend *backend = &libmysql_backend;
+
+//==========================================================================
+// Field name table per result, so rows can be returned as keyed arrays without GSC building its own map
+//==========================================================================
+
+struct mysql_result_fields
+{
+    mysql_result_fields *next;
+    MYSQL_RES *result;
+    int nrFields;
+    unsigned int *names;    // Interned script strings, used as array keys
 };
 
+// Only touched from the game thread: results are handed to GSC before anyone reads them
+static mysql_result_fields *first_result_fields = NULL;
+
+#ifdef COD4
+static mysql_result_fields *mysql_get_result_fields(MYSQL_RES *result)
+{
+    for (mysql_result_fields *current = first_result_fields; current != NULL; current = current->next)
+    {
+        if (current->result == result)
+        {
+            return current;
+        }
+    }
+
+    // First keyed fetch for this result, intern the field names once
+    mysql_result_fields *fields = new mysql_result_fields;
+    fields->result = result;
+    fields->nrFields = backend->num_fields(result);
+    fields->names = new unsigned int[fields->nrFields];
+    unsigned int prevField = backend->field_seek(result, 0); // Script may be walking the fields with mysql_fetch_field()
+    for (int i = 0; i < fields->nrFields; i++)
+    {
+        MYSQL_FIELD *field = backend->fetch_field(result);
+        fields->names[i] = stackAllocString(field ? field->name : "");
+    }
+    backend->field_seek(result, prevField);
+    fields->next = first_result_fields;
+    first_result_fields = fields;
+    return fields;
+}
+
+static void mysql_push_row_assoc(const mysql_result_fields *fields, MYSQL_ROW row)
+{
+    stackMakeArray();
+    for (int i = 0; i < fields->nrFields; i++)
+    {
+        if (row[i] == NULL)
+        {
+            stackPushUndefined();
+        }
+        else
+        {
+            stackPushString(row[i]);
+        }
+        stackPushArrayKey(fields->names[i]);
+    }
+}
+#endif // COD4
+
+static void mysql_free_result_fields(MYSQL_RES *result)
+{
+    mysql_result_fields **ppCurrent = &first_result_fields;
+    while (*ppCurrent != NULL)
+    {
+        mysql_result_fields *current = *ppCurrent;
+        if (current->result == result)
+        {
+            *ppCurrent = current->next;
+#ifdef COD4
+            for (int i = 0; i < current->nrFields; i++)
+            {
+                stackFreeString(current->names[i]);
+            }
+#endif
+            delete[] current->names;
+            delete current;
+            return;
+        }
+        ppCurrent = &current->next;
+    }
+}
+
 struct mysql_async_connection
 {
     mysql_async_connection *prev;
     mysql_async_connection *next;
-    mysql_async_task* task;
+    std::atomic<mysql_async_task *> task;   // NULL when the connection is idle, only the handler thread sets it
     MYSQL *connection;
 };
 
 mysql_async_connection *first_async_connection = NULL;
-mysql_async_task *first_async_task = NULL;
+mysql_async_task *first_async_task = NULL; // Game thread only
+mysql_async_task *last_async_task = NULL; // Game thread only
 MYSQL *cod_mysql_connection = NULL;
-pthread_mutex_t lock_async_mysql;
+
+// Lock-free multi-producer / single-consumer queues, each points to the most recently pushed task
+static std::atomic<mysql_async_task *> async_submitted_tasks(NULL); // Consumed by the handler thread
+static std::atomic<mysql_async_task *> async_completed_tasks(NULL); // Consumed by the game thread
+
+// Wakes up the handler thread when a task is submitted or a connection becomes idle
+static sem_t async_handler_wakeup;
+
+static void mysql_task_queue_push(std::atomic<mysql_async_task *> *queue, mysql_async_task *task) // Any thread, never waits
+{
+    mysql_async_task *head = queue->load(std::memory_order_relaxed);
+    do
+    {
+        task->queueNext = head;
+    } while (!queue->compare_exchange_weak(head, task, std::memory_order_release, std::memory_order_relaxed));
+}
+
+static mysql_async_task *mysql_task_queue_take_all(std::atomic<mysql_async_task *> *queue) // Single consumer only, returns the tasks in push order
+{
+    mysql_async_task *task = queue->exchange(NULL, std::memory_order_acquire);
+
+    // Pushing made it newest first
+    mysql_async_task *oldest = NULL;
+    while (task != NULL)
+    {
+        mysql_async_task *next = task->queueNext;
+        task->queueNext = oldest;
+        oldest = task;
+        task = next;
+    }
+    return oldest;
+}
+
+static void mysql_async_collect_completed() // Game thread only
+{
+    mysql_async_task *task = mysql_task_queue_take_all(&async_completed_tasks);
+    while (task != NULL)
+    {
+        task->done = true;
+        task = task->queueNext;
+    }
+}
 
 void *mysql_async_execute_query(void *input_c) //cannot be called from gsc, is threaded.
 {
     mysql_async_connection *c = (mysql_async_connection *) input_c;
-    int res = mysql_query(c->connection, c->task->query);
-    if(!res && c->task->save)
-        c->task->result = mysql_store_result(c->connection);
+    mysql_async_task *task = c->task.load(std::memory_order_acquire);
+    int res = backend->query(c->connection, task->query);
+    task->failed = (res != 0);
+    if(!res && task->save)
+        task->result = backend->store_result(c->connection);
     else if(res)
     {
         //mysql show error here?
     }
-    c->task->done = true;
-    c->task = NULL;
+
+    // Hand the task to the game thread, then make the connection available again
+    mysql_task_queue_push(&async_completed_tasks, task);
+    c->task.store(NULL, std::memory_order_release);
+    sem_post(&async_handler_wakeup);
     return NULL;
 }
 
@@ -70,83 +534,170 @@ void *mysql_async_query_handler(void* input_nothing) //is threaded after initial
         started = false;
         return NULL;
     }
-    mysql_async_task *q = NULL;
+    // Submitted tasks that did not get a connection yet, oldest first. Handler thread only
+    mysql_async_task *first_waiting = NULL;
+    mysql_async_task *last_waiting = NULL;
     while(true)
     {
-        pthread_mutex_lock(&lock_async_mysql);
-        q = first_async_task;
-        c = first_async_connection;
-        while(q != NULL)
+        mysql_async_task *q = mysql_task_queue_take_all(&async_submitted_tasks);
+        if (q != NULL)
         {
-            if(!q->started)
+            if (last_waiting != NULL)
+                last_waiting->queueNext = q;
+            else
+                first_waiting = q;
+            while (q->queueNext != NULL)
             {
-                while(c != NULL && c->task != NULL)
-                {
-                    c = c->next;
-                }
+                q = q->queueNext;
+            }
+            last_waiting = q;
+        }
 
-                if(c == NULL)
-                {
-                    //out of free connections
-                    break;
-                }
-                q->started = true;
-                c->task = q;
-                pthread_t query_doer;
-                int error = pthread_create(&query_doer, NULL, mysql_async_execute_query, c);
-                if(error)
-                {
-					Shared_Printf("error: %i\n", error);
-                    Shared_Printf("Error detaching async handler thread\n");
-                    pthread_mutex_unlock(&lock_async_mysql);
-                    return NULL;
-                }
-                pthread_detach(query_doer);
-                c = c->next;
+        for (c = first_async_connection; (c != NULL) && (first_waiting != NULL); c = c->next)
+        {
+            if (c->task.load(std::memory_order_acquire) != NULL)
+            {
+                continue;
+            }
+
+            q = first_waiting;
+            first_waiting = q->queueNext;
+            if (first_waiting == NULL)
+                last_waiting = NULL;
+
+            q->dispatchedUs = mysql_time_us();
+            c->task.store(q, std::memory_order_relaxed);
+            pthread_t query_doer;
+            int error = pthread_create(&query_doer, NULL, mysql_async_execute_query, c);
+            if(error)
+            {
+                Shared_Printf("error: %i\n", error);
+                Shared_Printf("Error detaching async handler thread\n");
+                return NULL;
             }
-            q = q->next;
+            pthread_detach(query_doer);
         }
-        pthread_mutex_unlock(&lock_async_mysql);
-        usleep(10000);
+
+        // Sleep until a task is submitted or a connection becomes idle
+        while ((sem_wait(&async_handler_wakeup) != 0) && (errno == EINTR));
     }
     return NULL;
 }
 
-int mysql_async_query_initializer(char *sql, bool save) //cannot be called from gsc, helper function
+int mysql_async_queue_query(char *ownedSql, bool save) //cannot be called from gsc, game thread only, takes ownership of the (malloc'd) query
 {
     static int id = 0;
     id++;
 
-    pthread_mutex_lock(&lock_async_mysql);
-
-    mysql_async_task *current = first_async_task;
-    while((current != NULL) && (current->next != NULL))
-    {
-        current = current->next;
-    }
-
     mysql_async_task *newtask = new mysql_async_task;
     newtask->id = id;
-    strncpy(newtask->query, sql, SQL_MAX_QUERY_SIZE);
-    newtask->prev = current;
+    newtask->query = ownedSql;
+    newtask->prev = last_async_task;
     newtask->result = NULL;
     newtask->save = save;
+    newtask->failed = false;
     newtask->done = false;
     newtask->next = NULL;
-    newtask->started = false;
-    if(current != NULL)
+    newtask->queueNext = NULL;
+    newtask->createdUs = mysql_time_us();
+    newtask->dispatchedUs = 0;
+    if(last_async_task != NULL)
     {
-        current->next = newtask;
+        last_async_task->next = newtask;
     }
     else
     {
         first_async_task = newtask;
     }
+    last_async_task = newtask;
 
-    pthread_mutex_unlock(&lock_async_mysql);
+    mysql_task_queue_push(&async_submitted_tasks, newtask);
+    if (first_async_connection != NULL) // Otherwise the handler picks it up once it is started
+    {
+        sem_post(&async_handler_wakeup);
+    }
     return id;
 }
 
+int mysql_async_query_initializer(char *sql, bool save) //cannot be called from gsc, helper function, returns 0 if out of memory
+{
+    char *query = strdup(sql);
+    if (!query)
+    {
+        return 0;
+    }
+    return mysql_async_queue_query(query, save);
+}
+
+// Unlinks and frees a finished task. Returns -1 (not found), 0 (not done yet) or 1 (done, result set if it was saved)
+static int mysql_async_take_result(int id, MYSQL_RES **pResult, uint64_t *pCreatedUs, uint64_t *pDispatchedUs) //cannot be called from gsc, game thread only
+{
+    mysql_async_collect_completed();
+
+    mysql_async_task *c = first_async_task;
+    while((c != NULL) && (c->id != id))
+    {
+        c = c->next;
+    }
+    if (c == NULL)
+    {
+        return -1;
+    }
+    if(!c->done)
+    {
+        return 0;
+    }
+    if(c->next != NULL)
+        c->next->prev = c->prev;
+    else
+        last_async_task = c->prev;
+    if(c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        first_async_task = c->next;
+    *pResult = c->save ? c->result : NULL;
+    if (pCreatedUs != NULL)
+    {
+        *pCreatedUs = c->createdUs;
+    }
+    if (pDispatchedUs != NULL)
+    {
+        *pDispatchedUs = c->dispatchedUs;
+    }
+    free(c->query);
+    delete c;
+    return 1;
+}
+
+// For native callers that only need to know whether a query succeeded. Returns -1 (not found), 0 (not done yet), 1 (done) or 2 (done, but failed).
+// A done query is freed, like mysql_async_getresult_and_free() does
+int mysql_async_take_status(int id) //cannot be called from gsc, game thread only
+{
+    mysql_async_collect_completed();
+
+    mysql_async_task *c = first_async_task;
+    while((c != NULL) && (c->id != id))
+    {
+        c = c->next;
+    }
+    if (c == NULL)
+    {
+        return -1;
+    }
+    if(!c->done)
+    {
+        return 0;
+    }
+
+    bool failed = c->failed;
+    MYSQL_RES *result = NULL;
+    mysql_async_take_result(id, &result, NULL, NULL);
+    if (result != NULL)
+    {
+        backend->free_result(result);
+    }
+    return failed ? 2 : 1;
+}
 
 void gsc_mysql_async_create_query_nosave()
 {
@@ -158,6 +709,12 @@ void gsc_mysql_async_create_query_nosave()
 		return;
 	}
 	int id = mysql_async_query_initializer(query, false);
+	if (id == 0)
+	{
+		stackError("gsc_mysql_async_create_query_nosave() out of memory");
+		stackPushUndefined();
+		return;
+	}
 	stackPushInt(id);
 }
 
@@ -171,12 +728,19 @@ void gsc_mysql_async_create_query()
 		return;
 	}
 	int id = mysql_async_query_initializer(query, true);
+	if (id == 0)
+	{
+		stackError("gsc_mysql_async_create_query() out of memory");
+		stackPushUndefined();
+		return;
+	}
 	stackPushInt(id);
 }
 
 void gsc_mysql_async_getdone_list()
 {
-    pthread_mutex_lock(&lock_async_mysql);
+    // Only the game thread touches the task list, so workers are never blocked while the ids are pushed
+    mysql_async_collect_completed();
     mysql_async_task *current = first_async_task;
 
     stackMakeArray();
@@ -189,7 +753,6 @@ void gsc_mysql_async_getdone_list()
         }
         current = current->next;
     }
-    pthread_mutex_unlock(&lock_async_mysql);
 }
 
 void gsc_mysql_async_getresult_and_free() //same as above, but takes the id of a function instead and returns 0 (not done), undefined (not found) or the mem address of result
@@ -201,48 +764,20 @@ void gsc_mysql_async_getresult_and_free() //same as above, but takes the id of a
 		stackPushUndefined();
 		return;
 	}
-    pthread_mutex_lock(&lock_async_mysql);
-    mysql_async_task *c = first_async_task;
-    if (c != NULL)
+    MYSQL_RES *result = NULL;
+    int status = mysql_async_take_result(id, &result, NULL, NULL);
+    if (status < 0)
     {
-        while((c != NULL) && (c->id != id))
-        {
-            c = c->next;
-        }
+        Shared_Printf("mysql async query id not found\n");
+        stackPushUndefined();
     }
-    if (c != NULL)
+    else if (status == 0)
     {
-        if(!c->done)
-        {
-            stackPushUndefined(); //not done yet
-            pthread_mutex_unlock(&lock_async_mysql);
-            return;
-        }
-        if(c->next != NULL)
-            c->next->prev = c->prev;
-        if(c->prev != NULL)
-            c->prev->next = c->next;
-        else
-            first_async_task = c->next;
-        if (c->save)
-        {
-            int ret = (int)c->result;
-            stackPushInt(ret);
-        }
-        else
-        {
-            stackPushInt(0);
-        }
-        delete c;
-        pthread_mutex_unlock(&lock_async_mysql);
-        return;
+        stackPushUndefined(); //not done yet
     }
     else
     {
-        Shared_Printf("mysql async query id not found\n");
-        stackPushUndefined();
-        pthread_mutex_unlock(&lock_async_mysql);
-        return;
+        stackPushInt((int)result);
     }
 }
 
@@ -254,9 +789,9 @@ void gsc_mysql_async_initializer()//returns array with mysql connection handlers
         stackPushUndefined();
         return;
     }
-    if (pthread_mutex_init(&lock_async_mysql, NULL) != 0)
+    if (sem_init(&async_handler_wakeup, 0, 0) != 0)
     {
-		Shared_Printf("Async mutex initialization failed\n");
+		Shared_Printf("Async semaphore initialization failed\n");
         stackPushUndefined();
         return;
     }
@@ -282,11 +817,9 @@ void gsc_mysql_async_initializer()//returns array with mysql connection handlers
 	{
 		mysql_async_connection *newconnection = new mysql_async_connection;
 		newconnection->next = NULL;
-		newconnection->connection = mysql_init(NULL);
-		newconnection->connection = mysql_real_connect((MYSQL*)newconnection->connection, host, user, pass, db, port, NULL, 0);
-		bool reconnect = true;
-		mysql_options(newconnection->connection, MYSQL_OPT_RECONNECT, &reconnect);
-		newconnection->task = NULL;
+		newconnection->connection = backend->init();
+		newconnection->connection = backend->real_connect(newconnection->connection, host, user, pass, db, port);
+		newconnection->task.store(NULL);
 		if (current == NULL)
 		{
 			newconnection->prev = NULL;
@@ -318,7 +851,7 @@ void gsc_mysql_async_initializer()//returns array with mysql connection handlers
 
 void gsc_mysql_init()
 {
-    MYSQL *connection = mysql_init(NULL);
+    MYSQL *connection = backend->init();
     if(connection != NULL)
     {
         stackPushInt((int)connection);
@@ -354,9 +887,7 @@ void gsc_mysql_real_connect()
 		return;
 	}
 
-	MYSQL *mysql = mysql_real_connect((MYSQL *)iMysql, host, user, pass, db, port, NULL, 0);
-	bool reconnect = true;
-	mysql_options((MYSQL*)mysql, MYSQL_OPT_RECONNECT, &reconnect);
+	MYSQL *mysql = backend->real_connect((MYSQL *)iMysql, host, user, pass, db, port);
 	if(cod_mysql_connection == NULL)
     {
 		cod_mysql_connection = (MYSQL*)mysql;
@@ -383,7 +914,7 @@ void gsc_mysql_error()
 		return;
 	}
 
-	char *ret = (char *)mysql_error((MYSQL *)mysql);
+	char *ret = (char *)backend->error((MYSQL *)mysql);
 	stackPushString(ret);
 }
 
@@ -397,10 +928,12 @@ void gsc_mysql_errno()
 		return;
 	}
 
-	int ret = mysql_errno((MYSQL *)mysql);
+	int ret = backend->err_no((MYSQL *)mysql);
 	stackPushInt(ret);
 }
 
+static void mysql_drop_templates(MYSQL *mysql); // Defined with the query templates below
+
 void gsc_mysql_close()
 {
 	int mysql = 0;
@@ -411,7 +944,8 @@ void gsc_mysql_close()
 		return;
 	}
 
-	mysql_close((MYSQL *)mysql);
+	mysql_drop_templates((MYSQL *)mysql); // They escape with this connection
+	backend->close((MYSQL *)mysql);
 	stackPushInt(0);
 }
 
@@ -426,7 +960,7 @@ void gsc_mysql_query()
 		return;
 	}
 
-	int ret = mysql_query((MYSQL *)mysql, query);
+	int ret = backend->query((MYSQL *)mysql, query);
 	stackPushInt(ret);
 }
 
@@ -440,7 +974,7 @@ void gsc_mysql_affected_rows()
 		return;
 	}
 
-	int ret = mysql_affected_rows((MYSQL *)mysql);
+	int ret = backend->affected_rows((MYSQL *)mysql);
 	stackPushInt(ret);
 }
 
@@ -454,7 +988,7 @@ void gsc_mysql_store_result()
 		return;
 	}
 
-	MYSQL_RES *result = mysql_store_result((MYSQL *)mysql);
+	MYSQL_RES *result = backend->store_result((MYSQL *)mysql);
 	stackPushInt((int) result);
 }
 
@@ -468,7 +1002,7 @@ void gsc_mysql_num_rows()
 		return;
 	}
 
-	int ret = mysql_num_rows((MYSQL_RES *)result);
+	int ret = backend->num_rows((MYSQL_RES *)result);
 	stackPushInt(ret);
 }
 
@@ -482,7 +1016,7 @@ void gsc_mysql_num_fields()
 		return;
 	}
 
-	int ret = mysql_num_fields((MYSQL_RES *)result);
+	int ret = backend->num_fields((MYSQL_RES *)result);
 	stackPushInt(ret);
 }
 
@@ -496,7 +1030,7 @@ void gsc_mysql_field_seek()
 		return;
 	}
 
-	int ret = mysql_field_seek((MYSQL_RES *)result, offset);
+	int ret = backend->field_seek((MYSQL_RES *)result, offset);
 	stackPushInt(ret);
 }
 
@@ -510,7 +1044,7 @@ void gsc_mysql_fetch_field()
 		return;
 	}
 
-	MYSQL_FIELD *field = mysql_fetch_field((MYSQL_RES *)result);
+	MYSQL_FIELD *field = backend->fetch_field((MYSQL_RES *)result);
 	if (field == NULL)
 	{
 		stackPushUndefined();
@@ -531,7 +1065,7 @@ void gsc_mysql_fetch_row()
 		return;
 	}
 
-	MYSQL_ROW row = mysql_fetch_row((MYSQL_RES *)result);
+	MYSQL_ROW row = backend->fetch_row((MYSQL_RES *)result);
 	if (!row)
 	{
 		stackPushUndefined();                   
@@ -539,7 +1073,7 @@ void gsc_mysql_fetch_row()
 	}
 
 	stackMakeArray();
-	int numfields = mysql_num_fields((MYSQL_RES *)result);
+	int numfields = backend->num_fields((MYSQL_RES *)result);
 	for (int i = 0; i < numfields; i++)
 	{
 		if (row[i] == NULL)
@@ -555,6 +1089,68 @@ void gsc_mysql_fetch_row()
 	}
 }
 
+void gsc_mysql_fetch_row_assoc() // Same as mysql_fetch_row, but the array is keyed by field name
+{
+	int result = 0;
+	if (!stackGetParams("i", &result))
+	{
+		stackError("gsc_mysql_fetch_row_assoc() argument is undefined or has a wrong type");
+		stackPushUndefined();
+		return;
+	}
+
+#ifdef COD4
+	MYSQL_ROW row = backend->fetch_row((MYSQL_RES *)result);
+	if (!row)
+	{
+		stackPushUndefined();
+		return;
+	}
+
+	mysql_push_row_assoc(mysql_get_result_fields((MYSQL_RES *)result), row);
+#else
+	stackError("gsc_mysql_fetch_row_assoc() keyed arrays are not supported on this CoD version");
+	stackPushUndefined();
+#endif
+}
+
+void gsc_mysql_fetch_rows_assoc() // Returns an array of up to <count> keyed rows, empty if there are no more rows
+{
+	int result = 0, count = 0;
+	if (!stackGetParams("ii", &result, &count))
+	{
+		stackError("gsc_mysql_fetch_rows_assoc() one or more arguments is undefined or has a wrong type");
+		stackPushUndefined();
+		return;
+	}
+
+	if (count <= 0)
+	{
+		stackError("gsc_mysql_fetch_rows_assoc() count must be positive");
+		stackPushUndefined();
+		return;
+	}
+
+#ifdef COD4
+	const mysql_result_fields *fields = mysql_get_result_fields((MYSQL_RES *)result);
+	stackMakeArray();
+	for (int i = 0; i < count; i++)
+	{
+		MYSQL_ROW row = backend->fetch_row((MYSQL_RES *)result);
+		if (!row)
+		{
+			break;
+		}
+
+		mysql_push_row_assoc(fields, row);
+		stackPushArrayNext();
+	}
+#else
+	stackError("gsc_mysql_fetch_rows_assoc() keyed arrays are not supported on this CoD version");
+	stackPushUndefined();
+#endif
+}
+
 void gsc_mysql_free_result()
 {
                                                       
@@ -573,7 +1169,8 @@ void gsc_mysql_free_result()
 		return;
 	}
 
-	mysql_free_result((MYSQL_RES *)result);
+	mysql_free_result_fields((MYSQL_RES *)result);
+	backend->free_result((MYSQL_RES *)result);
 	stackPushUndefined();
 }
 
@@ -589,20 +1186,95 @@ void gsc_mysql_real_escape_string()
 	}
 
 	char *to = (char *)malloc(strlen(str) * 2 + 1);
-	mysql_real_escape_string((MYSQL *)mysql, to, str, strlen(str));
+	backend->escape_string((MYSQL *)mysql, to, str, strlen(str));
 	stackPushString(to);
 	free(to);
 }
 
+// Makes sure at least nrExtra more characters (+ terminator) fit
+static bool mysql_longquery_reserve(mysql_longquery *longQuery, long long nrExtra)
+{
+    long long required = longQuery->length + nrExtra + 1;
+    if (required <= longQuery->capacity)
+    {
+        return true;
+    }
+    if (required > SQL_LONGQUERY_MAX_SIZE) // Doubling the capacity any further would overflow
+    {
+        return false;
+    }
+
+    int newCapacity = longQuery->capacity;
+    while (newCapacity < required)
+    {
+        newCapacity = (newCapacity > (SQL_LONGQUERY_MAX_SIZE / 2)) ? SQL_LONGQUERY_MAX_SIZE : (newCapacity * 2);
+    }
+
+    char *newBuf = (char *)realloc(longQuery->buf, newCapacity);
+    if (!newBuf)
+    {
+        return false;
+    }
+
+    longQuery->buf = newBuf;
+    longQuery->capacity = newCapacity;
+    return true;
+}
+
+static bool mysql_longquery_append(mysql_longquery *longQuery, const char *str, int len)
+{
+    if (!mysql_longquery_reserve(longQuery, len))
+    {
+        return false;
+    }
+
+    memcpy(longQuery->buf + longQuery->length, str, len);
+    longQuery->length += len;
+    longQuery->buf[longQuery->length] = '\0';
+    return true;
+}
+
+static bool mysql_longquery_append_escaped(mysql_longquery *longQuery, MYSQL *mysql, const char *value, int len) // Appends 'value', quoted and escaped
+{
+    // Escaping can at most double the length, escape straight into the query buffer
+    if (!mysql_longquery_reserve(longQuery, ((long long)len * 2) + 2))
+    {
+        return false;
+    }
+
+    longQuery->buf[longQuery->length++] = '\'';
+    longQuery->length += backend->escape_string(mysql, longQuery->buf + longQuery->length, value, len);
+    longQuery->buf[longQuery->length++] = '\'';
+    longQuery->buf[longQuery->length] = '\0';
+    return true;
+}
+
+static mysql_longquery *mysql_longquery_from_param(const char *szFunction)
+{
+    int ptr = -1;
+    stackGetParamInt(0, &ptr);
+    if (ptr <= 0)
+    {
+        stackError("%s called with invalid handle!", szFunction);
+        return NULL;
+    }
+    return (mysql_longquery *)ptr;
+}
+
 void gsc_mysql_setup_longquery()
 {
-    char *longQuery = (char *)calloc(1, SQL_MAX_QUERY_SIZE);
-    if (longQuery)
+    mysql_longquery *longQuery = new mysql_longquery;
+    longQuery->buf = (char *)malloc(SQL_LONGQUERY_INITIAL_SIZE);
+    if (longQuery->buf)
     {
+        longQuery->buf[0] = '\0';
+        longQuery->length = 0;
+        longQuery->capacity = SQL_LONGQUERY_INITIAL_SIZE;
         stackPushInt((int)longQuery);
     }
     else
     {
+        delete longQuery;
         stackPushInt(-1);
     }
 }
@@ -616,17 +1288,15 @@ void gsc_mysql_free_longquery()
         return;
     }
 
-    int ptr = -1;
-    stackGetParamInt(0, &ptr);
-    if (ptr <= 0)
+    mysql_longquery *longQuery = mysql_longquery_from_param("FreeLongQuery");
+    if (!longQuery)
     {
-        stackError("FreeLongQuery called with invalid handle!");
         stackPushBool(false);
         return;
     }
-    char *longQuery = (char *)ptr;
 
-    free(longQuery);
+    free(longQuery->buf);
+    delete longQuery;
     stackPushBool(true);
 }
 
@@ -639,15 +1309,12 @@ void gsc_mysql_append_longquery()
         return;
     }
 
-    int ptr = -1;
-    stackGetParamInt(0, &ptr);
-    if (ptr <= 0)
+    mysql_longquery *longQuery = mysql_longquery_from_param("AppendLongQuery");
+    if (!longQuery)
     {
-        stackError("AppendLongQuery called with invalid handle!");
         stackPushBool(false);
         return;
     }
-    char *longQuery = (char *)ptr;
 
     char *toAppend = NULL;
     stackGetParamString(1, &toAppend);
@@ -666,14 +1333,91 @@ void gsc_mysql_append_longquery()
         return;
     }
 
-    if (((int)strlen(longQuery) + lenToAppend) >= SQL_MAX_QUERY_SIZE)
+    if (!mysql_longquery_append(longQuery, toAppend, lenToAppend))
+    {
+        stackError("Query out of memory...");
+        stackPushBool(false);
+        return;
+    }
+
+    stackPushBool(true);
+}
+
+void gsc_mysql_append_longquery_escaped() // Appends a string as quoted and escaped SQL value: 'value'
+{
+    if ((Scr_GetNumParam() != 3) || (stackGetParamType(1) != STACK_INT) || (stackGetParamType(2) != STACK_STRING))
+    {
+        stackError("AppendLongQueryEscaped expected 3 params: <HANDLE> <mysql> <string value>");
+        stackPushBool(false);
+        return;
+    }
+
+    mysql_longquery *longQuery = mysql_longquery_from_param("AppendLongQueryEscaped");
+    if (!longQuery)
+    {
+        stackPushBool(false);
+        return;
+    }
+
+    int mysql = 0;
+    stackGetParamInt(1, &mysql);
+    char *value = NULL;
+    stackGetParamString(2, &value);
+
+    if (!mysql_longquery_append_escaped(longQuery, (MYSQL *)mysql, value, strlen(value)))
+    {
+        stackError("Query out of memory...");
+        stackPushBool(false);
+        return;
+    }
+
+    stackPushBool(true);
+}
+
+void gsc_mysql_append_longquery_number() // Appends an int or float without going through a GSC string
+{
+    if (Scr_GetNumParam() != 2)
+    {
+        stackError("AppendLongQueryNumber expected 2 params: <HANDLE> <int or float>");
+        stackPushBool(false);
+        return;
+    }
+
+    mysql_longquery *longQuery = mysql_longquery_from_param("AppendLongQueryNumber");
+    if (!longQuery)
+    {
+        stackPushBool(false);
+        return;
+    }
+
+    char number[32];
+    int type = stackGetParamType(1);
+    if (type == STACK_INT)
+    {
+        int value = 0;
+        stackGetParamInt(1, &value);
+        snprintf(number, sizeof(number), "%d", value);
+    }
+    else if (type == STACK_FLOAT)
+    {
+        float value = 0.0f;
+        stackGetParamFloat(1, &value);
+        snprintf(number, sizeof(number), "%.9g", value);
+    }
+    else
+    {
+        stackError("AppendLongQueryNumber argument 2 is not an int or float");
+        stackPushBool(false);
+        return;
+    }
+
+    if (!mysql_longquery_append(longQuery, number, strlen(number)))
     {
         stackError("Query out of memory...");
         stackPushBool(false);
         return;
     }
 
-    strncat(longQuery, toAppend, lenToAppend);
     stackPushBool(true);
 }
 
@@ -687,11 +1431,9 @@ void gsc_mysql_async_execute_longquery()
         return;
     }
 
-    int ptr = -1;
-    stackGetParamInt(0, &ptr);
-    if (ptr <= 0)
+    mysql_longquery *longQuery = mysql_longquery_from_param("ExecuteLongQuery");
+    if (!longQuery)
     {
-        stackError("ExecuteLongQuery called with invalid handle!");
         stackPushBool(false);
         return;
     }
@@ -702,10 +1444,709 @@ void gsc_mysql_async_execute_longquery()
         stackGetParamInt(1, &save);
     }
 
-    char *longQuery = (char *)ptr;
-    //printf("Executing long query: %s\n", longQuery);
-    int queryId = mysql_async_query_initializer(longQuery, (save > 0) ? true : false);
-    free(longQuery);
+    //printf("Executing long query: %s\n", longQuery->buf);
+    // The buffer is handed to the task as-is, the handle is no longer valid after this
+    int queryId = mysql_async_queue_query(longQuery->buf, (save > 0) ? true : false);
+    delete longQuery;
 
     stackPushInt(queryId);
 }
+
+//==========================================================================
+// Query templates: SQL with typed placeholders, registered once and filled in natively
+//==========================================================================
+
+typedef enum
+{
+    SQL_PARAM_NONE = 0, // Trailing literal, no placeholder after it
+    SQL_PARAM_INT,      // ?i
+    SQL_PARAM_FLOAT,    // ?f
+    SQL_PARAM_STRING,   // ?s, quoted and escaped
+} mysql_template_param_type;
+
+struct mysql_template_part
+{
+    int literalOffset;  // Literal SQL before the placeholder, in mysql_template::text
+    int literalLength;
+    mysql_template_param_type paramType;
+};
+
+struct mysql_template
+{
+    MYSQL *mysql;       // Connection used for escaping (character set)
+    char *text;         // Template as registered
+    char *literals;     // Template with placeholders removed, parts point into this
+    int nrParts;
+    int nrParams;
+    mysql_template_part *parts;
+};
+
+static mysql_template *query_templates[SQL_MAX_TEMPLATES]; // NULL for slots whose connection was closed
+static int query_template_generations[SQL_MAX_TEMPLATES]; // Of the template in the slot, 0 until the slot is first used
+static int nr_query_templates = 0; // Slots in use or freed, freed slots are reused first
+
+static int mysql_get_template_id(int slot)
+{
+    return (query_template_generations[slot] << SQL_TEMPLATE_SLOT_BITS) | slot;
+}
+
+// Queries from templates are formatted here before they are queued, so the buffer is only grown, never freed
+static mysql_longquery template_buffer = {NULL, 0, 0};
+
+static void mysql_free_template(mysql_template *tmpl)
+{
+    free(tmpl->text);
+    free(tmpl->literals);
+    delete[] tmpl->parts;
+    delete tmpl;
+}
+
+static void mysql_drop_templates(MYSQL *mysql) // Called before the connection is closed, its template ids become invalid
+{
+    for (int i = 0; i < nr_query_templates; i++)
+    {
+        if ((query_templates[i] != NULL) && (query_templates[i]->mysql == mysql))
+        {
+            mysql_free_template(query_templates[i]);
+            query_templates[i] = NULL;
+        }
+    }
+}
+
+static mysql_template *mysql_parse_template(MYSQL *mysql, const char *text) // Returns NULL on syntax error
+{
+    int textLength = strlen(text);
+    mysql_template *tmpl = new mysql_template;
+    tmpl->mysql = mysql;
+    tmpl->text = strdup(text);
+    tmpl->literals = (char *)malloc(textLength + 1);
+    tmpl->parts = new mysql_template_part[textLength + 1]; // Upper bound, one part per placeholder + trailing literal
+    tmpl->nrParts = 0;
+    tmpl->nrParams = 0;
+
+    int literalsLength = 0;
+    int partStart = 0;
+    for (int i = 0; i <= textLength; i++)
+    {
+        mysql_template_param_type type = SQL_PARAM_NONE;
+        if (text[i] == '?')
+        {
+            switch (text[i + 1])
+            {
+                case '?': tmpl->literals[literalsLength++] = '?'; i++; continue; // Escaped question mark
+                case 'i': type = SQL_PARAM_INT; break;
+                case 'f': type = SQL_PARAM_FLOAT; break;
+                case 's': type = SQL_PARAM_STRING; break;
+                default:
+                {
+                    mysql_free_template(tmpl);
+                    return NULL;
+                }
+            }
+        }
+        else if (text[i] != '\0')
+        {
+            tmpl->literals[literalsLength++] = text[i];
+            continue;
+        }
+
+        mysql_template_part *part = &tmpl->parts[tmpl->nrParts++];
+        part->literalOffset = partStart;
+        part->literalLength = literalsLength - partStart;
+        part->paramType = type;
+        partStart = literalsLength;
+        if (type != SQL_PARAM_NONE)
+        {
+            tmpl->nrParams++;
+            i++; // Skip type character
+        }
+    }
+    tmpl->literals[literalsLength] = '\0';
+    return tmpl;
+}
+
+void gsc_mysql_register_template() // Returns a template id, registering the same template again returns the same id
+{
+    int mysql = 0;
+    char *text = NULL;
+    if (!stackGetParams("is", &mysql, &text))
+    {
+        stackError("gsc_mysql_register_template() one or more arguments is undefined or has a wrong type");
+        stackPushUndefined();
+        return;
+    }
+
+    // Scripts register their templates on every map start
+    int freeSlot = -1;
+    for (int i = 0; i < nr_query_templates; i++)
+    {
+        if (query_templates[i] == NULL)
+        {
+            if (freeSlot < 0)
+            {
+                freeSlot = i;
+            }
+        }
+        else if ((query_templates[i]->mysql == (MYSQL *)mysql) && (strcmp(query_templates[i]->text, text) == 0))
+        {
+            stackPushInt(mysql_get_template_id(i));
+            return;
+        }
+    }
+
+    if ((freeSlot < 0) && (nr_query_templates >= SQL_MAX_TEMPLATES))
+    {
+        stackError("gsc_mysql_register_template() too many templates (max %d)", SQL_MAX_TEMPLATES);
+        stackPushUndefined();
+        return;
+    }
+
+    mysql_template *tmpl = mysql_parse_template((MYSQL *)mysql, text);
+    if (!tmpl)
+    {
+        stackError("gsc_mysql_register_template() invalid placeholder in '%s', use ?i, ?f, ?s or ?? for a literal ?", text);
+        stackPushUndefined();
+        return;
+    }
+
+    if (freeSlot < 0)
+    {
+        freeSlot = nr_query_templates++;
+    }
+    int generation = query_template_generations[freeSlot];
+    query_template_generations[freeSlot] = (generation >= SQL_TEMPLATE_MAX_GENERATION) ? 1 : (generation + 1);
+    query_templates[freeSlot] = tmpl;
+    stackPushInt(mysql_get_template_id(freeSlot));
+}
+
+// Formats the template with script arguments (starting at firstArg) into template_buffer. Raises a script error on failure
+static bool mysql_format_template(const mysql_template *tmpl, int firstArg, const char *szFunction)
+{
+    if (!template_buffer.buf)
+    {
+        template_buffer.buf = (char *)malloc(SQL_LONGQUERY_INITIAL_SIZE);
+        if (!template_buffer.buf)
+        {
+            stackError("%s out of memory", szFunction);
+            return false;
+        }
+        template_buffer.capacity = SQL_LONGQUERY_INITIAL_SIZE;
+    }
+    template_buffer.length = 0;
+    template_buffer.buf[0] = '\0';
+
+    int arg = firstArg;
+    for (int i = 0; i < tmpl->nrParts; i++)
+    {
+        const mysql_template_part *part = &tmpl->parts[i];
+        bool ok = mysql_longquery_append(&template_buffer, tmpl->literals + part->literalOffset, part->literalLength);
+        if (ok && (part->paramType != SQL_PARAM_NONE))
+        {
+            int type = stackGetParamType(arg);
+            char number[32];
+            if (type == STACK_UNDEFINED)
+            {
+                ok = mysql_longquery_append(&template_buffer, "NULL", 4);
+            }
+            else if ((part->paramType == SQL_PARAM_INT) && (type == STACK_INT))
+            {
+                int value = 0;
+                stackGetParamInt(arg, &value);
+                ok = mysql_longquery_append(&template_buffer, number, snprintf(number, sizeof(number), "%d", value));
+            }
+            else if ((part->paramType == SQL_PARAM_FLOAT) && ((type == STACK_FLOAT) || (type == STACK_INT)))
+            {
+                float value = 0.0f;
+                stackGetParamFloat(arg, &value);
+                if (!std::isfinite(value)) // %g would print inf or nan, which isn't valid SQL
+                {
+                    stackError("%s argument %d is not a finite number", szFunction, arg + 1);
+                    return false;
+                }
+                ok = mysql_longquery_append(&template_buffer, number, snprintf(number, sizeof(number), "%.9g", value));
+            }
+            else if ((part->paramType == SQL_PARAM_STRING) && ((type == STACK_STRING) || (type == STACK_ISTRING)))
+            {
+                char *value = NULL;
+                stackGetParamString(arg, &value);
+                ok = mysql_longquery_append_escaped(&template_buffer, tmpl->mysql, value, strlen(value));
+            }
+            else
+            {
+                stackError("%s argument %d has the wrong type for placeholder %d", szFunction, arg + 1, arg - firstArg + 1);
+                return false;
+            }
+            arg++;
+        }
+
+        if (!ok)
+        {
+            stackError("%s out of memory", szFunction);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void mysql_async_execute_template(bool save, const char *szFunction)
+{
+    int numParams = Scr_GetNumParam();
+    if ((numParams < 1) || (stackGetParamType(0) != STACK_INT))
+    {
+        stackError("%s expects a template id followed by the template arguments", szFunction);
+        stackPushUndefined();
+        return;
+    }
+
+    int templateId = 0;
+    stackGetParamInt(0, &templateId);
+    int slot = templateId & ((1 << SQL_TEMPLATE_SLOT_BITS) - 1);
+    if ((templateId <= 0) || (slot >= nr_query_templates) || ((templateId >> SQL_TEMPLATE_SLOT_BITS) == 0))
+    {
+        stackError("%s called with invalid template id %d", szFunction, templateId);
+        stackPushUndefined();
+        return;
+    }
+
+    const mysql_template *tmpl = query_templates[slot];
+    if (!tmpl || (mysql_get_template_id(slot) != templateId))
+    {
+        stackError("%s template %d was dropped when its connection was closed", szFunction, templateId);
+        stackPushUndefined();
+        return;
+    }
+
+    if ((numParams - 1) != tmpl->nrParams)
+    {
+        stackError("%s template %d expects %d arguments, got %d", szFunction, templateId, tmpl->nrParams, numParams - 1);
+        stackPushUndefined();
+        return;
+    }
+
+    if (!mysql_format_template(tmpl, 1, szFunction))
+    {
+        stackPushUndefined();
+        return;
+    }
+
+    // Exactly sized copy for the task, the format buffer is kept for the next query
+    char *query = (char *)malloc(template_buffer.length + 1);
+    if (!query)
+    {
+        stackError("%s out of memory", szFunction);
+        stackPushUndefined();
+        return;
+    }
+    memcpy(query, template_buffer.buf, template_buffer.length + 1);
+    stackPushInt(mysql_async_queue_query(query, save));
+}
+
+void gsc_mysql_async_execute_template()
+{
+    mysql_async_execute_template(true, "gsc_mysql_async_execute_template()");
+}
+
+void gsc_mysql_async_execute_template_nosave()
+{
+    mysql_async_execute_template(false, "gsc_mysql_async_execute_template_nosave()");
+}
+
+void gsc_mysql_use_fake_backend()
+{
+    int latencyUs = 0, jitterUs = 0, errorPermille = 0, nrRows = 0, nrFields = 0, valueLength = 0;
+    if (!stackGetParams("iiiiii", &latencyUs, &jitterUs, &errorPermille, &nrRows, &nrFields, &valueLength))
+    {
+        stackError("gsc_mysql_use_fake_backend() expects 6 int arguments: latencyUs, jitterUs, errorPermille, rows, fields, valueLength");
+        stackPushBool(false);
+        return;
+    }
+
+    if ((first_async_connection != NULL) || (cod_mysql_connection != NULL))
+    {
+        stackError("gsc_mysql_use_fake_backend() must be called before any connection is made");
+        stackPushBool(false);
+        return;
+    }
+
+    if ((latencyUs < 0) || (jitterUs < 0) || (errorPermille < 0) || (nrRows < 0) || (nrFields < 0) || (valueLength < 0))
+    {
+        stackError("gsc_mysql_use_fake_backend() arguments can't be negative");
+        stackPushBool(false);
+        return;
+    }
+
+    fake_config.latencyUs = latencyUs;
+    fake_config.jitterUs = jitterUs;
+    fake_config.errorPermille = errorPermille;
+    fake_config.nrRows = nrRows;
+    fake_config.nrFields = nrFields;
+    fake_config.valueLength = valueLength;
+    backend = &fake_backend;
+
+    Shared_Printf("MySQL backend is now '%s'\n", backend->name);
+    stackPushBool(true);
+}
+
+static int mysql_compare_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t mysql_percentile(uint32_t *samples, int nrSamples, int percentile) // samples must be sorted
+{
+    if (nrSamples <= 0)
+    {
+        return 0;
+    }
+    int idx = (int)(((long long)(nrSamples - 1) * percentile) / 100);
+    return samples[idx];
+}
+
+/*
+    Drives queries through the same path GSC uses (create query -> done list -> get result and free) and reports
+    throughput and dispatch / completion latency. Blocks the calling (game) thread until all queries are done,
+    so only run this on a test server, preferably with mysql_use_fake_backend().
+*/
+void gsc_mysql_async_benchmark()
+{
+    int numParams = Scr_GetNumParam();
+    if ((numParams < 2) || (numParams > 3))
+    {
+        stackError("AsyncBenchmark expects between 2 and 3 arguments: <nrQueries> <queriesPerSecond> [pollIntervalMs]");
+        stackPushUndefined();
+        return;
+    }
+
+    if ((stackGetParamType(0) != STACK_INT) || (stackGetParamType(1) != STACK_INT) || ((numParams > 2) && (stackGetParamType(2) != STACK_INT)))
+    {
+        stackError("AsyncBenchmark arguments should be ints");
+        stackPushUndefined();
+        return;
+    }
+
+    int nrQueries = 0, queriesPerSecond = 0, pollIntervalMs = 1;
+    stackGetParamInt(0, &nrQueries);
+    stackGetParamInt(1, &queriesPerSecond);
+    if (numParams > 2)
+    {
+        stackGetParamInt(2, &pollIntervalMs);
+    }
+
+    if ((nrQueries <= 0) || (nrQueries > SQL_BENCHMARK_MAX_QUERIES) || (queriesPerSecond <= 0) || (pollIntervalMs < 0))
+    {
+        stackError("AsyncBenchmark called with out of range arguments (max %d queries)", SQL_BENCHMARK_MAX_QUERIES);
+        stackPushUndefined();
+        return;
+    }
+
+    if (first_async_connection == NULL)
+    {
+        stackError("AsyncBenchmark requires mysql_async_initializer() to be called first");
+        stackPushUndefined();
+        return;
+    }
+
+    uint32_t *dispatchUs = (uint32_t *)malloc(nrQueries * sizeof(uint32_t));
+    uint32_t *completionUs = (uint32_t *)malloc(nrQueries * sizeof(uint32_t));
+    int *queryIds = (int *)malloc(nrQueries * sizeof(int));   // Of the queued queries, set to 0 once the result is taken
+    int *doneIds = (int *)malloc(nrQueries * sizeof(int));
+    if (!dispatchUs || !completionUs || !queryIds || !doneIds)
+    {
+        free(dispatchUs);
+        free(completionUs);
+        free(queryIds);
+        free(doneIds);
+        stackError("AsyncBenchmark out of memory");
+        stackPushUndefined();
+        return;
+    }
+
+    char query[64];
+    int nrCreated = 0, nrQueued = 0, nrCompleted = 0, nrFailed = 0;
+    int firstId = 0;
+    uint64_t startUs = mysql_time_us();
+    while (nrCompleted < nrQueries)
+    {
+        // Create as many queries as the requested rate allows by now
+        uint64_t nowUs = mysql_time_us();
+        int nrDue = (int)(((nowUs - startUs) * queriesPerSecond) / 1000000) + 1;
+        while ((nrCreated < nrQueries) && (nrCreated < nrDue))
+        {
+            snprintf(query, sizeof(query), "SELECT %d", nrCreated);
+            int id = mysql_async_query_initializer(query, true);
+            if (id == 0) // Out of memory, counts as a failed query
+            {
+                dispatchUs[nrCompleted] = 0;
+                completionUs[nrCompleted] = 0;
+                nrCompleted++;
+                nrFailed++;
+            }
+            else
+            {
+                queryIds[nrQueued] = id;
+                firstId = (nrQueued == 0) ? id : firstId;
+                nrQueued++;
+            }
+            nrCreated++;
+        }
+
+        // Equivalent of mysql_async_getdone_list(), but only for the benchmark queries. Queries of script are left for script to take.
+        // The game thread is blocked, so the benchmark queries got consecutive ids
+        int nrDone = 0;
+        mysql_async_collect_completed();
+        for (mysql_async_task *current = first_async_task; (current != NULL) && (nrDone < nrQueries); current = current->next)
+        {
+            int idx = current->id - firstId;
+            if (current->done && (idx >= 0) && (idx < nrQueued) && (queryIds[idx] == current->id))
+            {
+                doneIds[nrDone++] = current->id;
+                queryIds[idx] = 0;
+            }
+        }
+
+        // Equivalent of mysql_async_getresult_and_free() + mysql_free_result() for every done query
+        for (int i = 0; i < nrDone; i++)
+        {
+            MYSQL_RES *result = NULL;
+            uint64_t createdUs = 0, dispatchedUs = 0;
+            if ((nrCompleted >= nrQueries) || (mysql_async_take_result(doneIds[i], &result, &createdUs, &dispatchedUs) != 1))
+            {
+                continue;
+            }
+
+            uint64_t completedUs = mysql_time_us();
+            if (result != NULL)
+            {
+                backend->free_result(result);
+            }
+            else
+            {
+                nrFailed++;
+            }
+            dispatchUs[nrCompleted] = (uint32_t)(dispatchedUs - createdUs);
+            completionUs[nrCompleted] = (uint32_t)(completedUs - createdUs);
+            nrCompleted++;
+        }
+
+        if (pollIntervalMs > 0)
+        {
+            usleep(pollIntervalMs * 1000);
+        }
+    }
+    uint64_t durationUs = mysql_time_us() - startUs;
+
+    qsort(dispatchUs, nrCompleted, sizeof(uint32_t), mysql_compare_uint32);
+    qsort(completionUs, nrCompleted, sizeof(uint32_t), mysql_compare_uint32);
+
+    float throughput = (durationUs > 0) ? (float)((double)nrCompleted * 1000000.0 / (double)durationUs) : 0.0f;
+    Shared_Printf("MySQL async benchmark (%s backend): %d queries in %.3f s -> %.1f queries/s, %d failed\n", backend->name, nrCompleted, (double)durationUs / 1000000.0, throughput, nrFailed);
+    Shared_Printf("  dispatch   latency: p50 %u us, p99 %u us, max %u us\n", mysql_percentile(dispatchUs, nrCompleted, 50), mysql_percentile(dispatchUs, nrCompleted, 99), dispatchUs[nrCompleted - 1]);
+    Shared_Printf("  completion latency: p50 %u us, p99 %u us, max %u us\n", mysql_percentile(completionUs, nrCompleted, 50), mysql_percentile(completionUs, nrCompleted, 99), completionUs[nrCompleted - 1]);
+
+    // Results are also returned so a script can compare runs: [queriesPerSecond, p50 dispatch, p99 dispatch, p50 completion, p99 completion]
+    stackMakeArray();
+    stackPushFloat(throughput);
+    stackPushArrayNext();
+    stackPushInt(mysql_percentile(dispatchUs, nrCompleted, 50));
+    stackPushArrayNext();
+    stackPushInt(mysql_percentile(dispatchUs, nrCompleted, 99));
+    stackPushArrayNext();
+    stackPushInt(mysql_percentile(completionUs, nrCompleted, 50));
+    stackPushArrayNext();
+    stackPushInt(mysql_percentile(completionUs, nrCompleted, 99));
+    stackPushArrayNext();
+
+    free(dispatchUs);
+    free(completionUs);
+    free(queryIds);
+    free(doneIds);
+}
+
+struct mysql_contention_producer
+{
+    pthread_t thread;
+    bool useLockFree;
+    int nrItems;
+    mysql_async_task *pItems;
+    uint64_t totalNs;   // Time spent handing over items
+    uint64_t maxNs;     // Worst single hand-over
+};
+
+// Completion queue of the contention benchmark, the mutex variant mirrors the old locked task list
+static std::atomic<mysql_async_task *> contention_queue(NULL);
+static pthread_mutex_t contention_lock = PTHREAD_MUTEX_INITIALIZER;
+static mysql_async_task *contention_first = NULL;
+
+static uint64_t mysql_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void *mysql_contention_produce(void *input_producer) //cannot be called from gsc, is threaded.
+{
+    mysql_contention_producer *p = (mysql_contention_producer *)input_producer;
+    for (int i = 0; i < p->nrItems; i++)
+    {
+        mysql_async_task *item = &p->pItems[i];
+        uint64_t startNs = mysql_time_ns();
+        if (p->useLockFree)
+        {
+            mysql_task_queue_push(&contention_queue, item);
+        }
+        else
+        {
+            pthread_mutex_lock(&contention_lock);
+            item->next = contention_first;
+            contention_first = item;
+            pthread_mutex_unlock(&contention_lock);
+        }
+        uint64_t durationNs = mysql_time_ns() - startNs;
+        p->totalNs += durationNs;
+        if (durationNs > p->maxNs)
+        {
+            p->maxNs = durationNs;
+        }
+    }
+    return NULL;
+}
+
+static void mysql_contention_consume_item(mysql_async_task *item) // Stand-in for pushing an id onto the GSC stack
+{
+    volatile int sink = 0;
+    for (int i = 0; i < 32; i++)
+    {
+        sink += item->id;
+    }
+    (void)sink;
+}
+
+// Runs one round of the contention benchmark. Returns false if threads could not be started
+static bool mysql_contention_run(bool useLockFree, int nrProducers, int nrItemsPerProducer, uint64_t *pAvgNs, uint64_t *pMaxNs, uint64_t *pMaxConsumerNs)
+{
+    mysql_contention_producer producers[SQL_BENCHMARK_MAX_THREADS];
+    mysql_async_task *items = new mysql_async_task[nrProducers * nrItemsPerProducer];
+    for (int i = 0; i < (nrProducers * nrItemsPerProducer); i++)
+    {
+        items[i].id = i;
+    }
+
+    int nrStarted = 0;
+    for (int i = 0; i < nrProducers; i++)
+    {
+        producers[i].useLockFree = useLockFree;
+        producers[i].nrItems = nrItemsPerProducer;
+        producers[i].pItems = &items[i * nrItemsPerProducer];
+        producers[i].totalNs = 0;
+        producers[i].maxNs = 0;
+        if (pthread_create(&producers[i].thread, NULL, mysql_contention_produce, &producers[i]) != 0)
+        {
+            break;
+        }
+        nrStarted++;
+    }
+
+    // Consume on this thread, like the game thread would
+    int nrConsumed = 0;
+    uint64_t maxConsumerNs = 0;
+    while (nrConsumed < (nrStarted * nrItemsPerProducer))
+    {
+        uint64_t startNs = mysql_time_ns();
+        if (useLockFree)
+        {
+            for (mysql_async_task *item = mysql_task_queue_take_all(&contention_queue); item != NULL; item = item->queueNext)
+            {
+                mysql_contention_consume_item(item);
+                nrConsumed++;
+            }
+        }
+        else
+        {
+            pthread_mutex_lock(&contention_lock);
+            for (mysql_async_task *item = contention_first; item != NULL; item = item->next)
+            {
+                mysql_contention_consume_item(item);
+                nrConsumed++;
+            }
+            contention_first = NULL;
+            pthread_mutex_unlock(&contention_lock);
+        }
+        uint64_t durationNs = mysql_time_ns() - startNs;
+        if (durationNs > maxConsumerNs)
+        {
+            maxConsumerNs = durationNs;
+        }
+    }
+
+    uint64_t totalNs = 0, maxNs = 0;
+    for (int i = 0; i < nrStarted; i++)
+    {
+        pthread_join(producers[i].thread, NULL);
+        totalNs += producers[i].totalNs;
+        if (producers[i].maxNs > maxNs)
+        {
+            maxNs = producers[i].maxNs;
+        }
+    }
+    delete[] items;
+
+    *pAvgNs = (nrStarted > 0) ? (totalNs / (nrStarted * nrItemsPerProducer)) : 0;
+    *pMaxNs = maxNs;
+    *pMaxConsumerNs = maxConsumerNs;
+    return (nrStarted == nrProducers);
+}
+
+/*
+    Compares handing completed tasks to the game thread through a mutex protected list (the old way) against the
+    lock-free completion queue, with <nrThreads> workers completing <nrItemsPerThread> tasks each as fast as possible.
+*/
+void gsc_mysql_async_contention_benchmark()
+{
+    int nrThreads = 0, nrItemsPerThread = 0;
+    if (!stackGetParams("ii", &nrThreads, &nrItemsPerThread))
+    {
+        stackError("gsc_mysql_async_contention_benchmark() expects 2 int arguments: nrThreads, nrItemsPerThread");
+        stackPushUndefined();
+        return;
+    }
+
+    if ((nrThreads <= 0) || (nrThreads > SQL_BENCHMARK_MAX_THREADS) || (nrItemsPerThread <= 0) || ((long long)nrThreads * nrItemsPerThread > SQL_BENCHMARK_MAX_QUERIES))
+    {
+        stackError("gsc_mysql_async_contention_benchmark() arguments out of range (max %d threads, %d items in total)", SQL_BENCHMARK_MAX_THREADS, SQL_BENCHMARK_MAX_QUERIES);
+        stackPushUndefined();
+        return;
+    }
+
+    uint64_t mutexAvgNs = 0, mutexMaxNs = 0, mutexMaxConsumerNs = 0;
+    uint64_t lockFreeAvgNs = 0, lockFreeMaxNs = 0, lockFreeMaxConsumerNs = 0;
+    if (!mysql_contention_run(false, nrThreads, nrItemsPerThread, &mutexAvgNs, &mutexMaxNs, &mutexMaxConsumerNs) ||
+        !mysql_contention_run(true, nrThreads, nrItemsPerThread, &lockFreeAvgNs, &lockFreeMaxNs, &lockFreeMaxConsumerNs))
+    {
+        stackError("gsc_mysql_async_contention_benchmark() could not start all threads");
+        stackPushUndefined();
+        return;
+    }
+
+    Shared_Printf("MySQL completion contention benchmark: %d threads x %d completions\n", nrThreads, nrItemsPerThread);
+    Shared_Printf("  mutex list : worker avg %llu ns, worker max %llu ns, game thread max %llu ns\n", (unsigned long long)mutexAvgNs, (unsigned long long)mutexMaxNs, (unsigned long long)mutexMaxConsumerNs);
+    Shared_Printf("  lock-free  : worker avg %llu ns, worker max %llu ns, game thread max %llu ns\n", (unsigned long long)lockFreeAvgNs, (unsigned long long)lockFreeMaxNs, (unsigned long long)lockFreeMaxConsumerNs);
+
+    // [mutex avg, mutex max, lock-free avg, lock-free max] worker hand-over times, then [mutex, lock-free] game thread max stall, all in ns
+    stackMakeArray();
+    stackPushInt((int)mutexAvgNs);
+    stackPushArrayNext();
+    stackPushInt((int)mutexMaxNs);
+    stackPushArrayNext();
+    stackPushInt((int)lockFreeAvgNs);
+    stackPushArrayNext();
+    stackPushInt((int)lockFreeMaxNs);
+    stackPushArrayNext();
+    stackPushInt((int)mutexMaxConsumerNs);
+    stackPushArrayNext();
+    stackPushInt((int)lockFreeMaxConsumerNs);
+    stackPushArrayNext();
+}
@@ -10,6 +10,8 @@
 #include <stddef.h>
 
 int mysql_async_query_initializer(char* sql, bool save);
+int mysql_async_queue_query(char *ownedSql, bool save);
+int mysql_async_take_status(int id);
 
 void gsc_mysql_init();
 void gsc_mysql_real_connect();
@@ -24,6 +26,8 @@ void gsc_mysql_num_fields();
 void gsc_mysql_field_seek();
 void gsc_mysql_fetch_field();
 void gsc_mysql_fetch_row();
+void gsc_mysql_fetch_row_assoc();
+void gsc_mysql_fetch_rows_assoc();
 void gsc_mysql_free_result();
 void gsc_mysql_real_escape_string();
 void gsc_mysql_async_create_query();
@@ -35,7 +39,15 @@ void gsc_mysql_reuse_connection();
 void gsc_mysql_setup_longquery();
 void gsc_mysql_free_longquery();
 void gsc_mysql_append_longquery();
+void gsc_mysql_append_longquery_escaped();
+void gsc_mysql_append_longquery_number();
 void gsc_mysql_async_execute_longquery();
+void gsc_mysql_register_template();
+void gsc_mysql_async_execute_template();
+void gsc_mysql_async_execute_template_nosave();
+void gsc_mysql_use_fake_backend();
+void gsc_mysql_async_benchmark();
+void gsc_mysql_async_contention_benchmark();
 
 
 #endif // _GSC_CUSTOM_MYSQL_H
\ No newline at end of file
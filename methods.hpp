@@ -57,12 +57,28 @@
 {"readPlaybackFrame_rpgnow", Gsc_Demo_ReadFrame_RPGNow, 0},
 {"readPlaybackFrame_flags", Gsc_Demo_ReadFrame_Flags, 0},
 {"readPlaybackFrame_FPS", Gsc_Demo_ReadFrame_FPS, 0},
+{"readPlaybackFrame", Gsc_Demo_ReadFrame, 0},
+{"seekPlaybackTime", Gsc_Demo_SeekPlaybackTime, 0},
+{"getPlaybackTime", Gsc_Demo_GetPlaybackTime, 0},
+{"getPlaybackDuration", Gsc_Demo_GetPlaybackDuration, 0},
+{"readInterpolatedPlaybackFrame", Gsc_Demo_ReadInterpolatedFrame, 0},
+{"bindPlaybackEntity", Gsc_Demo_BindPlaybackEntity, 0},
+{"unbindPlaybackEntity", Gsc_Demo_UnbindPlaybackEntity, 0},
+{"setPlaybackSpeed", Gsc_Demo_SetPlaybackSpeed, 0},
+{"setPlaybackPaused", Gsc_Demo_SetPlaybackPaused, 0},
+{"startDemoComparison", Gsc_Demo_StartComparison, 0},
+{"stopDemoComparison", Gsc_Demo_StopComparison, 0},
+{"getDemoComparisonDelta", Gsc_Demo_GetComparisonDelta, 0},
+{"getDemoComparisonSplits", Gsc_Demo_GetComparisonSplits, 0},
 {"skipPlaybackFrames", Gsc_Demo_SkipFrame, 0},
 {"skipPlaybackKeyFrames", Gsc_Demo_SkipKeyFrame, 0},
 {"nextPlaybackFrame", Gsc_Demo_NextFrame, 0},
 {"prevPlaybackFrame", Gsc_Demo_PrevFrame, 0},
 {"nextPlaybackKeyFrame", Gsc_Demo_ReadFrame_NextKeyFrame, 0},
 {"prevPlaybackKeyFrame", Gsc_Demo_ReadFrame_PrevKeyFrame, 0},
+{"startDemoRecording", Gsc_Demo_StartRecording, 0},
+{"stopDemoRecording", Gsc_Demo_StopRecording, 0},
+{"demoRecordEvent", Gsc_Demo_RecordEvent, 0},
 
 
 
@@ -7,9 +7,34 @@
  **************************************************************************/
 
 #include "shared.hpp"
+#include "gsc_custom_mysql.hpp"
+#include "opencj_demo.hpp"
+#include "opencj_fps.hpp"
 
+#include <algorithm>
+#include <climits>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
-#include <map>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 /**************************************************************************
  * Defines                                                                *
@@ -22,22 +47,84 @@
 
 // We can hard define this because no other value may be used for CJ
 #define SERVER_FRAMES_PER_SECOND        20
+// Time between frames when no time is given for a frame, and for demo files that don't contain frame times
+#define DEMO_DEFAULT_FRAME_TIME         (1000 / SERVER_FRAMES_PER_SECOND)
+
+// Demo frames are stored in fixed-size blocks that are handed out on demand from a pool shared by all demos,
+// so memory follows the actual length of a demo and there is no upper bound on the length of a run
+#define DEMO_FRAMES_PER_BLOCK_SHIFT     10
+#define DEMO_FRAMES_PER_BLOCK           (1 << DEMO_FRAMES_PER_BLOCK_SHIFT) // 1024 frames, ~51 seconds
+#define DEMO_FRAME_BLOCK_MASK           (DEMO_FRAMES_PER_BLOCK - 1)
+// Released blocks are kept for re-use by other demos, up to this many. Anything above that is returned to the system
+#define MAX_NR_POOLED_FRAME_BLOCKS      (int)(((10 * MINUTE) * SERVER_FRAMES_PER_SECOND) / DEMO_FRAMES_PER_BLOCK)
+// Initial size of the block table of a demo, it doubles when needed
+#define INITIAL_NR_DEMO_BLOCK_SLOTS     8
+// Initial size of the key frame index of a demo, it doubles when needed
+#define INITIAL_NR_KEY_FRAME_SLOTS      256
+// Initial size of the segment and save frame lists of a demo, they double when needed
+#define INITIAL_NR_SEGMENT_SLOTS        16
+// Initial size of the repeat run list of a sparse demo, it doubles when needed
+#define INITIAL_NR_REPEAT_RUN_SLOTS     16
+// Initial size of the spatial index of a demo while it is built, it doubles when needed
+#define INITIAL_NR_INDEX_NODE_SLOTS     1024
+
+// Completed demos are stored in a compact encoding. Every DEMO_FRAMES_PER_ANCHOR frames there is an anchor frame that
+// can be decoded on its own, the frames after it are stored as the difference with their previous frame
+#define DEMO_FRAMES_PER_ANCHOR_SHIFT    6
+#define DEMO_FRAMES_PER_ANCHOR          (1 << DEMO_FRAMES_PER_ANCHOR_SHIFT) // Must match the number of bits in the keyframe mask
+#define DEMO_ORIGIN_SCALE               8.0f                // Origins are stored with a precision of 1/8th unit
+#define DEMO_ANGLE_SCALE                (65536.0f / 360.0f) // Angles are stored with a precision of 1/65536th of a circle
+#define DEMO_MAX_ENCODED_FRAME_SIZE     (2 + (6 * 5) + (2 * 3)) // Header + misc byte, 6 values of max 5 bytes, flags & fps of max 3 bytes
+#define DEMO_MAX_ENCODED_REPEAT_SIZE    (1 + 5)                 // Header + repeat count
+
+// Demo files contain the compact encoding as-is, so they can be memory mapped and played back without decoding them first.
+// Layout: header, anchors, segments, time ranges, encoded stream. All values are little endian
+#define DEMO_FILE_MAGIC                 (uint32_t)0x444a434f // "OCJD"
+#define DEMO_FILE_VERSION               5
+// Version 3 files have no time ranges and a smaller header, they are played back at DEMO_DEFAULT_FRAME_TIME.
+// Version 4 files have no repeat entries, which doesn't matter for decoding them
+#define DEMO_FILE_MIN_VERSION           3
+#define DEMO_FILE_V3_HEADER_SIZE        48
 
-// In seconds. Initially, a player is allocated this amount of time worth of demo frames.
-// This is re-allocated upon more than half being used
-#define INITIAL_DEMO_TIME_ALLOCATION    (1 * HOUR)
-// Calculate the number of initial demos frames to be allocated based on the above specified duration and server fps
-#define INITIAL_DEMO_FRAME_ALLOCATION   (INITIAL_DEMO_TIME_ALLOCATION * SERVER_FRAMES_PER_SECOND)
-// How many extra frames a demo should get on re-allocation
-// Example: initially a demo gets to be up to 1 hour, but if more than half of that is used, then it is extended by 1 hour up to 2 hours
-//#define BLOCK_DEMO_FRAME_ALLOCATION     INITIAL_DEMO_FRAME_ALLOCATION
+// Demos that are persisted to MySQL are stored as the demo file, split in chunks of this size (1 row per chunk)
+#define DEMO_PERSIST_MYSQL_CHUNK_SIZE   (64 * 1024)
+#define DEMO_PERSIST_MAX_DESTINATION    256
+
+// Bits of the header byte of an encoded frame, a set bit means the value is different from the previous frame
+#define DEMO_ENC_ORIGIN_X               (1 << 0)
+#define DEMO_ENC_ORIGIN_Y               (1 << 1)
+#define DEMO_ENC_ORIGIN_Z               (1 << 2)
+#define DEMO_ENC_ANGLE_PITCH            (1 << 3)
+#define DEMO_ENC_ANGLE_YAW              (1 << 4)
+#define DEMO_ENC_ANGLE_ROLL             (1 << 5)
+#define DEMO_ENC_REPEAT                 (1 << 6)    // Only bit set: a varint follows with the number of times the frame repeats after this one
+#define DEMO_ENC_MISC                   (1 << 7)    // A misc byte follows the header
+// Bits of the misc byte
+#define DEMO_ENC_MISC_SAVE              (1 << 0)
+#define DEMO_ENC_MISC_LOAD              (1 << 1)
+#define DEMO_ENC_MISC_RPG               (1 << 2)
+#define DEMO_ENC_MISC_FLAGS             (1 << 3)
+#define DEMO_ENC_MISC_FPS               (1 << 4)
 
 // Max demos a player can record during a session. For example different runs in the same session.
-// Keep this semi-low, because each demo gets a decent chunk of allocated memory based on constants above
 //#define MAX_NR_DEMOS_PER_PLAYER         10
 
-// Max number of demos per map that are available for playback
-#define MAX_NR_DEMOS_PER_MAP            128
+// Live comparisons look for the player's position on the reference path this many path positions ahead of (and behind) the last match.
+// If nothing in the window is close, the player took another route (or teleported) and the whole path is searched
+#define DEMO_COMPARE_WINDOW_AHEAD       64
+#define DEMO_COMPARE_WINDOW_BEHIND      8
+#define DEMO_COMPARE_RESYNC_DISTANCE    128.0f
+
+// Benchmark demos use ids far above any run id, so they don't collide with demos of players
+#define DEMO_BENCHMARK_FIRST_ID         2000000000
+#define DEMO_BENCHMARK_MAX_FRAMES       (int)(2 * HOUR * SERVER_FRAMES_PER_SECOND)
+#define DEMO_BENCHMARK_MAX_SAMPLES      (1 << 22)   // Per measured call, beyond this only every n-th call is sampled
+#define DEMO_BENCHMARK_SAVE_INTERVAL    (5 * SERVER_FRAMES_PER_SECOND)
+#define DEMO_BENCHMARK_MAX_SKIP         64
+
+// Max number of demos per map that are available for playback, can be changed by script while no demos exist
+#define DEFAULT_MAX_NR_DEMOS_PER_MAP    128
+#define MAX_MAX_NR_DEMOS_PER_MAP        65536
 
 // Magic number to know if a demo is initialized / used for validity checking
 #define DEMO_MAGIC_NUMBER               (uint32_t)0x7fd126ea
@@ -57,12 +144,135 @@ typedef struct
     bool rpgNow;		// if this was a frame on which the player rpg'd
     bool isKeyFrame;    // Is this frame a 'key' frame, i.e. did the player's complete run contain this frame?
                         // This may change during the demo, if the player loads back to before this frame
-    int prevKeyFrame;   // When skipping backwards through demos
-    int nextKeyFrame;   // When skipping forwards through demos
+    int keyFrameRank;   // Number of key frames before this frame, i.e. index in the demo's key frame index of the next key frame
+                        // (not available for frames decoded from a compact demo)
 
     // More fields after PoC
 } sDemoFrame_t;
 
+typedef union sDemoFrameBlock_t
+{
+    union sDemoFrameBlock_t *pNextFree;             // While in the pool
+    sDemoFrame_t frames[DEMO_FRAMES_PER_BLOCK];     // While in use by a demo
+} sDemoFrameBlock_t;
+
+typedef struct
+{
+    uint64_t keyFrameMask;      // Bit x is set if frame ((anchorIdx << DEMO_FRAMES_PER_ANCHOR_SHIFT) + x) is a key frame
+    int32_t offset;             // Offset of the anchor frame in the encoded stream (layout is the same for 32 and 64 bit, anchors are mapped straight from demo files)
+    int32_t keyFrameRank;       // Number of key frames before the anchor frame
+} sDemoAnchor_t;
+static_assert(sizeof(sDemoAnchor_t) == 16, "sDemoAnchor_t is part of the demo file format");
+
+typedef struct
+{
+    uint32_t magic;             // DEMO_FILE_MAGIC
+    uint16_t version;           // DEMO_FILE_VERSION
+    uint16_t headerSize;        // Size of this header, newer versions may add fields at the end
+    int32_t demoId;             // Id of the demo when it was saved
+    int32_t nrFrames;
+    int32_t lastKeyFrame;
+    int32_t nrAnchors;
+    uint32_t anchorsOffset;     // Offset of the anchors from the start of the file, 8 byte aligned
+    uint32_t encodedOffset;     // Offset of the encoded stream from the start of the file
+    uint32_t encodedSize;
+    int32_t nrSegments;
+    uint32_t segmentsOffset;    // Offset of the segments from the start of the file
+    int32_t nrTimeRanges;       // Version 4 and up
+    uint32_t timeRangesOffset;  // Offset of the time ranges from the start of the file, 4 byte aligned
+    uint32_t reserved;
+} sDemoFileHeader_t;
+static_assert(sizeof(sDemoFileHeader_t) == 56, "sDemoFileHeader_t is part of the demo file format");
+
+// Every time a player loads, the frames after it are a new segment which branches off the frame where the loaded position was saved
+typedef struct
+{
+    int32_t startFrame;         // First frame of the segment
+    int32_t endFrame;           // One past the last frame of the segment
+    int32_t parent;             // Segment that this segment branches off, -1 for the first segment
+    int32_t branchFrame;        // Last frame of the parent segment before this segment continues, -1 for the first segment
+} sDemoSegment_t;
+static_assert(sizeof(sDemoSegment_t) == 16, "sDemoSegment_t is part of the demo file format");
+
+// Frames of a range are frameTime apart, a new range starts whenever that changes. Usually a demo has only 1 range
+typedef struct
+{
+    int32_t startFrame;         // First frame of the range
+    int32_t startTime;          // Time of startFrame in ms, relative to the first frame of the demo
+    int32_t frameTime;          // Time between the frames of this range in ms
+} sDemoTimeRange_t;
+static_assert(sizeof(sDemoTimeRange_t) == 12, "sDemoTimeRange_t is part of the demo file format");
+
+// Part of the final path, i.e. the frames the player's completed run consists of
+typedef struct
+{
+    int startFrame;
+    int nrFrames;
+    int pathStart;              // Position of startFrame on the final path
+    int pathTime;               // Time of startFrame on the final path, which leaves out the time spent in abandoned segments
+} sDemoPathRange_t;
+
+// Node of the spatial index of a demo: a k-d tree over the frame origins, stored as a sorted array.
+// The node of the nodes [low, high) is at (low + high) / 2, the nodes before it are its left subtree
+typedef struct
+{
+    float origin[3];
+    int startFrame;             // Consecutive frames at the same origin share a node
+    int nrFrames;
+    int minFrame;               // Lowest and highest frame in the subtree of this node, so subtrees outside a frame window are skipped
+    int maxFrame;
+    uint8_t axis;               // Axis this node splits its subtree on
+    bool isKeyFrame;            // Frames of a node are either all key frames or none
+    bool hasKeyFrame;           // Whether the subtree of this node has a key frame
+} sDemoIndexNode_t;
+
+// Events that are kept as a bitmap in the column layout
+typedef enum
+{
+    DEMO_EVENT_SAVE,
+    DEMO_EVENT_LOAD,
+    DEMO_EVENT_RPG,
+    DEMO_EVENT_KEY_FRAME,
+    DEMO_NR_EVENTS
+} eDemoEvent_t;
+
+// Column layout of a completed demo for bulk analysis: 1 array per attribute, so a scan over an attribute only reads that attribute.
+// All arrays are in 1 allocation, which starts at pX
+typedef struct
+{
+    float *pX;
+    float *pY;
+    float *pZ;
+    uint16_t *pFps;
+    uint64_t *pEvents[DEMO_NR_EVENTS];  // Bit (x & 63) of word (x >> 6) is set if frame x has the event
+    int nrFrames;
+    size_t size;                        // Size of the allocation
+} sDemoColumns_t;
+
+// Frames of a sparse demo that were not stored because they were the same as the stored frame before them
+typedef struct
+{
+    int startFrame;             // First repeated frame
+    int nrFrames;
+    int nrRepeatedBefore;       // Number of repeated frames before startFrame, frame x is stored at (x - repeated frames before x)
+} sDemoRepeatRun_t;
+
+typedef struct
+{
+    uint8_t *pEncoded;
+    int encodedSize;
+    sDemoAnchor_t *pAnchors;
+    int nrAnchors;
+} sDemoEncoding_t;
+
+typedef struct
+{
+    int origin[3];              // In 1/DEMO_ORIGIN_SCALE units
+    int angles[3];              // In 1/DEMO_ANGLE_SCALE degrees, always in the range of a short
+    int flags;
+    int fps;
+} sDemoQuantizedFrame_t;
+
 typedef struct
 {
     uint32_t magic;             // Magic number to hopefully provide clear errors when unexpected memory is accessed
@@ -70,340 +280,4083 @@ typedef struct
     bool isComplete;            // Whether (or not) this demo has been completed and thus its size will not increase
     bool isFirstFrameFilled;    // Whether or not the first frame is already filled (at the start, currentFrame is 0 but it has not been filled yet)
     int size;                   // Size. This can change if the demo was not yet finished
-    sDemoFrame_t *pDemoFrames;  // Pointer to all frames of this demo (not used as handle because can be re-allocated)
-    int nrAllocatedFrames;      // Number of currently allocated frames for this demo
+    sDemoFrameBlock_t **ppBlocks;   // Block table, frame x is in block (x >> DEMO_FRAMES_PER_BLOCK_SHIFT). Table can be re-allocated
+    int nrBlocks;               // Number of blocks in use by this demo
+    int nrBlockSlots;           // Size of the block table
     int currentFrame;           // Index of the last frame of this demo (actively updated)
     int lastKeyFrame;           // To remember which demo frame is the current last key frame
+    int *pKeyFrames;            // Indices of all key frames in order, for skipping through the frames that are not yet encoded
+    int nrKeyFrames;            // Also kept for encoded demos, where the anchors index the key frames
+    int nrKeyFrameSlots;        // Size of the key frame index
+    int *pSaveFrames;           // Frames on which the player saved, in order. Only needed while recording
+    int nrSaveFrames;
+    int nrSaveFrameSlots;
+    sDemoSegment_t *pSegments;  // Segments in the order they were recorded, so also ordered by startFrame
+    int nrSegments;
+    int nrSegmentSlots;
+    sDemoTimeRange_t *pTimeRanges;  // Frame times, see sDemoTimeRange_t
+    int nrTimeRanges;
+    int nrTimeRangeSlots;
+    int startTime;              // Server time of the first frame, only needed while recording
+    int lastFrameTime;          // Time of the last frame relative to the first frame
+    bool isSparse;              // Frames that don't change beyond the tolerances are not stored, see sDemoRepeatRun_t
+    float sparseOriginTolerance;
+    float sparseAngleTolerance;
+    sDemoRepeatRun_t *pRepeatRuns;  // Only while recording, in order
+    int nrRepeatRuns;
+    int nrRepeatRunSlots;
+    int nrRepeatedFrames;       // Total of all repeat runs
+    sDemoPathRange_t *pPathRanges;  // Final path, available once the demo is complete
+    int nrPathRanges;
+    int pathSize;               // Number of frames on the final path
+    sDemoIndexNode_t *pIndexNodes;  // Spatial index of a completed demo, built on completion or on the first query
+    int nrIndexNodes;
+    sDemoColumns_t columns;     // Column layout of a completed demo, built on the first bulk analysis
+    uint8_t *pEncoded;          // Compact encoding of a completed demo. Once encoded, the frame blocks are released
+    int encodedSize;            // Size of the encoded stream in bytes
+    sDemoAnchor_t *pAnchors;    // One anchor per DEMO_FRAMES_PER_ANCHOR frames of the encoded stream
+    int nrAnchors;
+    void *pMapping;             // If the demo was loaded from a file, pEncoded and pAnchors point into this mapping
+    size_t mappingSize;
+    bool isBeingPersisted;      // The writer thread is reading this demo, it can't be cleared until the writer is done
+    bool isClearPending;        // The demo was destroyed while it was being persisted
+    int nextFreeSlot;           // While this slot is free: index of the next free slot, or -1
+    uint32_t lastUsed;          // Use counter when script last used this demo, the least recently used demos are spilled first
+    bool isSpilled;             // Frames were moved to the spill file to stay within the memory budget, they are loaded again on use
 } sDemo_t;
 
 typedef struct
+{
+    sDemo_t *pDemo;             // Demo that is recorded for this client every server frame, NULL if not recording
+    bool isKeyFrame;            // Events flagged by script, they are stored in the next recorded frame
+    bool saveNow;
+    bool loadNow;
+    bool rpgNow;
+    int loadBackwardsCount;
+} sDemoRecorder_t;
+
+typedef enum
+{
+    DEMO_PERSIST_FILE,
+    DEMO_PERSIST_MYSQL
+} eDemoPersistTarget_t;
+
+typedef struct sDemoPersistJob_t
+{
+    struct sDemoPersistJob_t *pNext;
+    sDemo_t *pDemo;             // Only the frames are read by the writer thread, which do not change once a demo is complete
+    int demoId;
+    eDemoPersistTarget_t target;
+    char destination[DEMO_PERSIST_MAX_DESTINATION]; // File path or table name
+
+    // Filled in by the writer thread
+    bool isOk;
+    bool isEncodedByWriter;     // Whether encoding is a new encoding that still needs to be given to the demo
+    sDemoEncoding_t encoding;
+    char **ppQueries;           // For MySQL, queued by the game thread once the job is done
+    int nrQueries;
+
+    // For MySQL, filled in by the game thread. The demo is only persisted once all queries succeeded
+    int *pQueryIds;
+    int nrQueryIds;
+    int nrQueriesDone;
+    bool isCleanupQueued;       // A query failed, the rows that were stored are deleted again
+} sDemoPersistJob_t;
+
+typedef struct
+{
+    int frameIdx;                   // Index of the last decoded frame, -1 if nothing was decoded yet
+    int offset;                     // Offset in the encoded stream of the frame after frameIdx
+    int nrRepeatsLeft;              // Number of frames after frameIdx that repeat it, before the entry at offset
+    sDemoQuantizedFrame_t state;    // Values of the last decoded frame, as they were encoded
+    sDemoFrame_t frame;             // The last decoded frame
+} sDemoDecoder_t;
+
+// Comparison of a player's run with a reference run, e.g. a personal best. It has its own copy of what it needs of the demos,
+// so it stays valid when they are destroyed or spilled
+typedef struct
+{
+    float *pX;                  // Origins of the final path, 1 array per axis so distances are computed 4 at a time.
+    float *pY;                  // All 4 arrays are in the allocation of pX
+    float *pZ;
+    float *pTimes;              // Path time of every final path position in ms
+    int nrPoints;
+    float *pSplitTimes;         // Path times of the splits: saves (or key frames) on the final path
+    int nrSplits;
+} sDemoComparePath_t;
+
+typedef struct
+{
+    int referenceId;            // Demo the comparison was made with, 0 if there is no comparison
+    sDemoComparePath_t reference;
+    int alignedPos;             // Position on the reference path that the last live lookup matched
+    int runId;                  // Optional complete run that was compared as a whole, 0 if none
+    float *pDeltas;             // Time delta of the run with the reference at every final path position of the run
+    int nrDeltas;
+    float *pRunSplitTimes;
+    int nrRunSplits;
+} sDemoComparison_t;
+
+typedef struct sDemoPlayback_t
 {
     const sDemo_t *pDemo;   // The demo that is being watched
     int selectedFrame;      // The last selected frame (i.e. player is watching this frame)
+    bool isFinalPathOnly;   // Only play the frames of the final path, skipping is done in path positions
+    int selectedPathPos;    // Position of selectedFrame on the final path
+    sDemoDecoder_t decoder; // For sequential playback of compact demos, so frames are decoded from the previous frame rather than the anchor
+    sDemoDecoder_t nextDecoder; // Same, for the frame after the selected frame which is needed for interpolation
+    float time;             // Playback time in ms, the selected frame is the last frame at or before this time
+    float lerpFraction;     // How far time is between the selected frame and the next frame (0 - 1)
+    gentity_t *pEntity;     // Entity that is moved by the server every frame, NULL if playback is driven by script
+    float speed;            // Playback speed when driven by the server, 1 is real time and negative plays in reverse
+    bool isPaused;
+    struct sDemoPlayback_t *pLeader; // Playback this player shares with other viewers at the same position, NULL if it has its own
 } sDemoPlayback_t;
 
+// Latencies of 1 kind of call during a benchmark
+typedef struct
+{
+    uint32_t *pNs;
+    int nrSamples;
+    int maxNrSamples;
+    int stride;         // Only every stride-th call is sampled
+    long long nrCalls;
+    uint64_t totalNs;
+} sDemoBenchmarkSamples_t;
+
+// Movement of a synthetic player during a benchmark
+typedef struct
+{
+    uint32_t seed;
+    float origin[3];
+    float yaw;
+    float saveOrigins[3][3];    // Last saves, the player loads back to one of them
+    int nrSaves;
+} sDemoBenchmarkPlayer_t;
+
 /**************************************************************************
  * Globals                                                                *
  **************************************************************************/
 
-// For now max. number of demos per map
-static sDemo_t opencj_demos[MAX_NR_DEMOS_PER_MAP];
-// For faster access every time an id is provided, use a map
-static std::map<uint32_t, uint16_t> opencj_demoIdToIdx;
+// Demo slots, allocated when the first demo is created. Free slots are linked through nextFreeSlot
+static sDemo_t *opencj_demos = NULL;
+static int opencj_maxNrDemos = DEFAULT_MAX_NR_DEMOS_PER_MAP;
+static int opencj_firstFreeDemoSlot = -1;
+static int opencj_nrDemosInUse = 0;         // Including demos that are destroyed but still being persisted
+
+// Demo ids (run ids) are not dense, so slots are found through an open addressing table of slot indices (-1 is empty)
+static int *opencj_demoIdTable = NULL;
+static uint32_t opencj_demoIdTableMask = 0;
 
 // A player can only watch 1 demo at a time
 static sDemoPlayback_t opencj_playback[MAX_CLIENTS];
 
+// A player can be recorded natively, instead of having script add every frame
+static sDemoRecorder_t opencj_recorders[MAX_CLIENTS];
+
+// A player can compare with 1 reference run at a time
+static sDemoComparison_t opencj_comparisons[MAX_CLIENTS];
+
+// Residency: once all demos together use more memory than the budget, the least recently used completed demos are spilled to files
+static size_t opencj_demoMemoryBudget = 0;  // 0 means no budget
+static char opencj_demoSpillDir[DEMO_PERSIST_MAX_DESTINATION] = "";
+static uint32_t opencj_demoUseCounter = 0;
+
+// Frame blocks that are not in use by any demo
+static sDemoFrameBlock_t *opencj_freeFrameBlocks = NULL;
+static int opencj_nrFreeFrameBlocks = 0;
+
+// Background writer. Jobs are handed over through these lists, the game thread picks up the done jobs when polled
+static pthread_mutex_t opencj_persistLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t opencj_persistWakeup = PTHREAD_COND_INITIALIZER;
+static sDemoPersistJob_t *opencj_pendingPersistJobs = NULL;
+static sDemoPersistJob_t *opencj_donePersistJobs = NULL;
+static sDemoPersistJob_t *opencj_queryingPersistJobs = NULL; // Game thread only, MySQL jobs that wait for their queries
+static bool opencj_isPersistWriterStarted = false;
+
 /**************************************************************************
  * Local functions                                                        *
  **************************************************************************/
 
-static sDemo_t *findDemoById(int demoId)
+static sDemoFrameBlock_t *allocFrameBlock()
 {
-    sDemo_t *pDemo = NULL;
-    auto it = opencj_demoIdToIdx.find(demoId);
-    if (it == opencj_demoIdToIdx.end())
+    sDemoFrameBlock_t *pBlock = opencj_freeFrameBlocks;
+    if (pBlock)
     {
-        printf("Demo with id %d was not found or is empty\n", demoId);
+        opencj_freeFrameBlocks = pBlock->pNextFree;
+        opencj_nrFreeFrameBlocks--;
     }
     else
     {
-        pDemo = &opencj_demos[it->second];
+        pBlock = new (std::nothrow) sDemoFrameBlock_t;
     }
 
-    return pDemo;
+    if (pBlock)
+    {
+        memset(pBlock, 0, sizeof(*pBlock)); // Recycled blocks should not contain data of a previous demo
+    }
+
+    return pBlock;
 }
 
-static void clearDemoById(int demoId)
+static void releaseFrameBlock(sDemoFrameBlock_t *pBlock)
+{
+    if (opencj_nrFreeFrameBlocks >= MAX_NR_POOLED_FRAME_BLOCKS)
+    {
+        delete pBlock;
+        return;
+    }
+
+    pBlock->pNextFree = opencj_freeFrameBlocks;
+    opencj_freeFrameBlocks = pBlock;
+    opencj_nrFreeFrameBlocks++;
+}
+
+// Index of the stored frame that a frame of a sparse demo reads from
+static int getStoredFrameIdx(const sDemo_t *pDemo, int frameIdx)
 {
-    auto it = opencj_demoIdToIdx.find(demoId);
-    if (it != opencj_demoIdToIdx.end())
+    if ((pDemo->nrRepeatRuns == 0) || (frameIdx < pDemo->pRepeatRuns[0].startFrame))
     {
-        sDemo_t *pDemo = &opencj_demos[it->second];
-        opencj_demoIdToIdx.erase(it);
+        return frameIdx;
+    }
 
-        // Clear demo data, free up this spot
-        if ((pDemo->magic != DEMO_MAGIC_NUMBER) || (pDemo->id <= 0))
+    // Last run that starts at or before the frame
+    int low = 0;
+    int high = pDemo->nrRepeatRuns - 1;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if (pDemo->pRepeatRuns[mid].startFrame <= frameIdx)
         {
-            printf("Demo is already clear (%p)\n", pDemo);
-            return;
+            low = mid;
         }
-
-        printf("Clearing demo with pointer %p\n", pDemo);
-        if (pDemo->pDemoFrames)
+        else
         {
-            delete[] pDemo->pDemoFrames;
-            pDemo->pDemoFrames = nullptr;
+            high = mid - 1;
         }
-
-        memset(pDemo, 0, sizeof(*pDemo));
     }
-}
 
-static void clearAllDemos()
-{
-    printf("Clearing all demos\n");
-    for (int i = 0; i < (int)(sizeof(opencj_demos) / sizeof(opencj_demos[0])); i++)
+    const sDemoRepeatRun_t *pRun = &pDemo->pRepeatRuns[low];
+    int endFrame = pRun->startFrame + pRun->nrFrames;
+    if (frameIdx < endFrame)
     {
-        clearDemoById(opencj_demos[i].id);
+        return pRun->startFrame - 1 - pRun->nrRepeatedBefore; // The stored frame before the run
     }
+    return frameIdx - pRun->nrRepeatedBefore - pRun->nrFrames;
 }
 
-static sDemo_t *createDemo(int demoId)
+static inline sDemoFrame_t *getStoredDemoFrame(const sDemo_t *pDemo, int storedIdx)
 {
-    if (findDemoById(demoId) != NULL)
-    {
-        printf("Demo with id %d already exists!\n", demoId);
-        return NULL;
-    }
+    return &pDemo->ppBlocks[storedIdx >> DEMO_FRAMES_PER_BLOCK_SHIFT]->frames[storedIdx & DEMO_FRAME_BLOCK_MASK];
+}
 
-    printf("Creating demo with id %d\n", demoId);
+static inline sDemoFrame_t *getDemoFrame(const sDemo_t *pDemo, int frameIdx)
+{
+    return getStoredDemoFrame(pDemo, getStoredFrameIdx(pDemo, frameIdx));
+}
 
-    sDemo_t *pDemo = NULL;
-    for (int i = 0; i < (int)(sizeof(opencj_demos) / sizeof(opencj_demos[0])); i++)
+// Makes sure the demo has storage for the specified stored frame
+static bool reserveDemoFrame(sDemo_t *pDemo, int frameIdx)
+{
+    int blockIdx = frameIdx >> DEMO_FRAMES_PER_BLOCK_SHIFT;
+    while (pDemo->nrBlocks <= blockIdx)
     {
-        printf("Checking for free slot at %d\n", i);
-        if (opencj_demos[i].id <= 0)
+        if (pDemo->nrBlocks >= pDemo->nrBlockSlots)
         {
-            // Free slot
-            pDemo = &opencj_demos[i];
-            opencj_demoIdToIdx[demoId] = i;
-            break;
+            int nrBlockSlots = (pDemo->nrBlockSlots > 0) ? (pDemo->nrBlockSlots * 2) : INITIAL_NR_DEMO_BLOCK_SLOTS;
+            sDemoFrameBlock_t **ppBlocks = (sDemoFrameBlock_t **)realloc(pDemo->ppBlocks, nrBlockSlots * sizeof(*ppBlocks));
+            if (!ppBlocks)
+            {
+                return false;
+            }
+            pDemo->ppBlocks = ppBlocks;
+            pDemo->nrBlockSlots = nrBlockSlots;
         }
-    }
-
-    if (pDemo)
-    {
-        memset(pDemo, 0, sizeof(*pDemo));
 
-        pDemo->magic = DEMO_MAGIC_NUMBER;
-        pDemo->id = demoId;
-
-        pDemo->pDemoFrames = new sDemoFrame_t[INITIAL_DEMO_FRAME_ALLOCATION];
-        memset(pDemo->pDemoFrames, 0, INITIAL_DEMO_FRAME_ALLOCATION);
+        sDemoFrameBlock_t *pBlock = allocFrameBlock();
+        if (!pBlock)
+        {
+            return false;
+        }
+        pDemo->ppBlocks[pDemo->nrBlocks++] = pBlock;
     }
 
-    return pDemo;
+    return true;
 }
 
 /**************************************************************************
- * Helper functions                                                       *
+ * Compact encoding                                                       *
  **************************************************************************/
 
-static bool Base_Gsc_IsValidClientNum(int clientNum)
+static inline uint32_t zigZagEncode(int value)
 {
-    if ((clientNum < 0) || (clientNum >= MAX_CLIENTS))
-    {
-        stackError("clientNum %d out of range", clientNum);
-        return true;
-    }
-
-    return false;
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
 }
 
-static bool Base_Gsc_GetValidDemoId(int *pDemoId, int nrArgsExpected)
+static inline int zigZagDecode(uint32_t value)
 {
-    if (!pDemoId) return false;
+    return (int)(value >> 1) ^ -(int)(value & 1);
+}
 
-    int nrReceivedArgs = Scr_GetNumParam();
-    if (nrReceivedArgs != nrArgsExpected)
+static inline uint8_t *writeVarint(uint8_t *pOut, uint32_t value)
+{
+    while (value >= 0x80)
     {
-        stackError("Expected %d arguments, but got %d", nrArgsExpected, nrReceivedArgs);
-        stackPushUndefined();
-        return false;
+        *pOut++ = (uint8_t)(value | 0x80);
+        value >>= 7;
     }
+    *pOut++ = (uint8_t)value;
+    return pOut;
+}
 
-    int demoId = -1;
-    if (stackGetParamType(0) != STACK_INT)
+static inline const uint8_t *readVarint(const uint8_t *pIn, const uint8_t *pEnd, uint32_t *pValue)
+{
+    uint32_t value = 0;
+    for (int shift = 0; (pIn < pEnd) && (shift < 35); shift += 7)
     {
-        stackError("Argument 1 (demoId) is not an int");
-        stackPushUndefined();
-        return false;
+        uint8_t byte = *pIn++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            break;
+        }
     }
-    stackGetParamInt(0, &demoId);
+    *pValue = value;
+    return pIn;
+}
 
-    if (demoId <= 0)
+static void quantizeDemoFrame(const sDemoFrame_t *pFrame, sDemoQuantizedFrame_t *pOut)
+{
+    for (int i = 0; i < 3; i++)
     {
-        stackError("Argument 1 (demoId) is not > 0");
-        stackPushUndefined();
-        return false;
+        pOut->origin[i] = (int)lrintf(pFrame->origin[i] * DEMO_ORIGIN_SCALE);
+        pOut->angles[i] = (short)(lrintf(pFrame->angles[i] * DEMO_ANGLE_SCALE) & 0xFFFF);
     }
+    pOut->flags = (unsigned short)pFrame->flags;
+    pOut->fps = (unsigned short)pFrame->fps;
+}
 
-    *pDemoId = demoId;
-    return true;
+// A frame without events that quantizes to the same values as the previous frame is stored as part of a repeat entry
+static inline bool isRepeatedDemoFrame(const sDemoFrame_t *pFrame, const sDemoQuantizedFrame_t *pPrev, const sDemoQuantizedFrame_t *pCurr)
+{
+    return !pFrame->saveNow && !pFrame->loadNow && !pFrame->rpgNow && (memcmp(pPrev, pCurr, sizeof(*pCurr)) == 0);
 }
 
-static void Base_Gsc_Demo_FrameSkip(int playerId, int nrToSkip, bool areKeyFrames) // Helper function for skipping frames and keyframes
+static inline uint8_t *encodeDemoRepeat(uint8_t *pOut, int nrFrames)
 {
-    if (Base_Gsc_IsValidClientNum(playerId)) return;
+    *pOut++ = DEMO_ENC_REPEAT;
+    return writeVarint(pOut, (uint32_t)(nrFrames - 1));
+}
 
-    //printf("[%d] is skipping %d %sframes\n", playerId, nrToSkip, areKeyFrames ? "key" : "");
+// Encodes the quantized frame as the difference with the previous frame, or as an absolute frame if the previous frame is all zeroes
+static uint8_t *encodeDemoFrame(uint8_t *pOut, const sDemoFrame_t *pFrame, const sDemoQuantizedFrame_t *pPrev, const sDemoQuantizedFrame_t *pCurr)
+{
+    uint8_t misc = 0;
+    if (pFrame->saveNow) misc |= DEMO_ENC_MISC_SAVE;
+    if (pFrame->loadNow) misc |= DEMO_ENC_MISC_LOAD;
+    if (pFrame->rpgNow) misc |= DEMO_ENC_MISC_RPG;
+    if (pCurr->flags != pPrev->flags) misc |= DEMO_ENC_MISC_FLAGS;
+    if (pCurr->fps != pPrev->fps) misc |= DEMO_ENC_MISC_FPS;
 
-    sDemoPlayback_t *pPlayback = &opencj_playback[playerId];
-    const sDemo_t *pDemo = pPlayback->pDemo;
-    if (!pDemo)
+    uint8_t header = (misc != 0) ? DEMO_ENC_MISC : 0;
+    for (int i = 0; i < 3; i++)
     {
-        stackPushUndefined();
+        if (pCurr->origin[i] != pPrev->origin[i]) header |= (DEMO_ENC_ORIGIN_X << i);
+        if (pCurr->angles[i] != pPrev->angles[i]) header |= (DEMO_ENC_ANGLE_PITCH << i);
     }
-    else
-    {
-        // If we're requested to skip n keyframes, then we need to figure out how many real frames that is
-        if (areKeyFrames)
-        {
-            if (nrToSkip != 0)
-            {
-                //printf("Trying to skip %d keyFrames\n", nrToSkip);
-                int nrKeyFramesToSkip = abs(nrToSkip);      // The total number of key frames we need to skip
-                int nrKeyFramesSkipped = 0;                 // The number of key frames skipped so far
-                int currFrame = pPlayback->selectedFrame;   // The current frame being processed
-                bool isReverse = (nrToSkip < 0);            // Whether the skipping needs to be in reverse (true) or forward (false)
-                // OK, now for the actual key frame skipping
-                for (int i = 0; i < nrKeyFramesToSkip; i++)
-                {
-                    // First we select the "next" key frame (next can be previous as well if we are searching in reverse)
-                    const sDemoFrame_t *pCurrFrame = &pDemo->pDemoFrames[currFrame];
-                    int nextKeyFrame = isReverse ? pCurrFrame->prevKeyFrame : pCurrFrame->nextKeyFrame;
-
-                    // Check if we skipped any frames
-                    if (nextKeyFrame == currFrame)
-                    {
-                        // We didn't get anywhere, so this must have been the last key frame
-                        break;
-                    }
-
-                    currFrame = nextKeyFrame;
-
-                    // Check if we skipped enough key frames
-                    if (++nrKeyFramesSkipped >= nrKeyFramesToSkip)
-                    {
-                        //printf("[%d] skipped enough keyframes (%d)\n", playerId, nrKeyFramesSkipped);
-                        break;
-                    }
-                }
-
-                // We overwrite this with the number of frames to skip (rather than number of key frames), so we can re-use the code below
-                // No check for reverse, because we need this to be negative if skipping backwards, and positive if skipping forward
-                nrToSkip = (currFrame - pPlayback->selectedFrame);
-            }
-        }
 
-        int requestedFrame = pPlayback->selectedFrame + nrToSkip;
-        if (requestedFrame > (pDemo->size - 1)) // - 1 because we're comparing an index to a size
-        {
-            printf("[%d] can't select next frame, demo is finished\n", playerId);
-            requestedFrame = pDemo->size - 1;
-        }
-        else if (requestedFrame < 0) // TODO: start & end, 0 may not be begin
+    *pOut++ = header;
+    if (header & DEMO_ENC_MISC)
+    {
+        *pOut++ = misc;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (header & (DEMO_ENC_ORIGIN_X << i))
         {
-            printf("[%d] can't select previous frame, demo is at start\n", playerId);
-            requestedFrame = 0;
+            pOut = writeVarint(pOut, zigZagEncode(pCurr->origin[i] - pPrev->origin[i]));
         }
-        else
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (header & (DEMO_ENC_ANGLE_PITCH << i))
         {
-            // This is fine, not out of bounds
+            pOut = writeVarint(pOut, zigZagEncode((short)(pCurr->angles[i] - pPrev->angles[i]))); // Wraps around, like the angle itself
         }
-
-        pPlayback->selectedFrame = requestedFrame;
-        stackPushInt(requestedFrame);
-
-        //printf("Requested frame skip %d -> %d, returned %d\n", pPlayback->selectedFrame, pPlayback->selectedFrame + nrToSkip, requestedFrame);
     }
-}
-
-//==========================================================================
-// Functions that do work for any demo                                        
-//==========================================================================
-
-void Gsc_Demo_ClearAllDemos()
-{
-    clearAllDemos();
-}
-
-void Gsc_Demo_HasKeyFrames()
-{
-    int demoId = -1;
-    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
-
-    const sDemo_t *pDemo = findDemoById(demoId);
-    if (!pDemo)
+    if (misc & DEMO_ENC_MISC_FLAGS)
     {
-        stackPushUndefined();
+        pOut = writeVarint(pOut, (uint32_t)pCurr->flags);
     }
-    else
+    if (misc & DEMO_ENC_MISC_FPS)
     {
-        //printf("Returning %d numberOfFrames for demo %d\n", pDemo->size, demoId);
-        stackPushInt((pDemo->lastKeyFrame == 0) ? 0 : 1);
+        pOut = writeVarint(pOut, (uint32_t)pCurr->fps);
     }
+
+    return pOut;
 }
 
-void Gsc_Demo_NumberOfFrames()
+// Decodes the frame after the decoder's current frame
+static void decodeNextDemoFrame(const sDemo_t *pDemo, sDemoDecoder_t *pDecoder)
 {
-    int demoId = -1;
-    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+    const uint8_t *pIn = pDemo->pEncoded + pDecoder->offset;
+    const uint8_t *pEnd = pDemo->pEncoded + pDemo->encodedSize;
+    sDemoQuantizedFrame_t *pState = &pDecoder->state;
+    uint32_t value = 0;
 
-    const sDemo_t *pDemo = findDemoById(demoId);
-    if (!pDemo)
+    // Repeated frames have the values of the frame before them, without its events
+    uint8_t header = 0;
+    if (pDecoder->nrRepeatsLeft > 0)
     {
-        stackPushUndefined();
+        pDecoder->nrRepeatsLeft--;
     }
-    else
+    else if (pIn < pEnd)
     {
-        //printf("Returning %d numberOfFrames for demo %d\n", pDemo->size, demoId);
-        stackPushInt(pDemo->size);
+        header = *pIn++;
+    }
+    if (header == DEMO_ENC_REPEAT)
+    {
+        pIn = readVarint(pIn, pEnd, &value);
+        pDecoder->nrRepeatsLeft = (int)value;
+        header = 0;
     }
-}
-void Gsc_Demo_NumberOfKeyFrames()
-{
-    int demoId = -1;
-    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
 
-    const sDemo_t *pDemo = findDemoById(demoId);
-    if (!pDemo)
+    uint8_t misc = 0;
+    if ((header & DEMO_ENC_MISC) && (pIn < pEnd))
     {
-        stackPushUndefined();
+        misc = *pIn++;
     }
-    else
+    for (int i = 0; i < 3; i++)
     {
-        int nrOfKeyFrames = 0;
-        int iter = 0;
-        while (iter < pDemo->size)
+        if (header & (DEMO_ENC_ORIGIN_X << i))
         {
-            sDemoFrame_t *pFrame = &pDemo->pDemoFrames[iter];
-            if (pFrame->isKeyFrame)
-            {
-                nrOfKeyFrames++;
-            }
-
-            // Sanity check for development
-            int nextKeyFrame = pFrame->nextKeyFrame;
-            if (nextKeyFrame < iter)
-            {
-                printf("Key frame %d goes backwards to key frame %d??\n", iter, nextKeyFrame);
-                stackPushUndefined();
-                return;
-            }
+            pIn = readVarint(pIn, pEnd, &value);
+            pState->origin[i] += zigZagDecode(value);
+        }
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (header & (DEMO_ENC_ANGLE_PITCH << i))
+        {
+            pIn = readVarint(pIn, pEnd, &value);
+            pState->angles[i] = (short)(pState->angles[i] + zigZagDecode(value));
+        }
+    }
+    if (misc & DEMO_ENC_MISC_FLAGS)
+    {
+        pIn = readVarint(pIn, pEnd, &value);
+        pState->flags = (int)value;
+    }
+    if (misc & DEMO_ENC_MISC_FPS)
+    {
+        pIn = readVarint(pIn, pEnd, &value);
+        pState->fps = (int)value;
+    }
 
-            // Check if we found the last key frame
-            if (nextKeyFrame == iter)
-            {
-                break;
-            }
+    pDecoder->frameIdx++;
+    pDecoder->offset = (int)(pIn - pDemo->pEncoded);
 
-            // Skip to next key frame. TODO: how will this go with keyframe branching?
-            iter = nextKeyFrame;
-        }
-        printf("Returning %d numberOfKeyFrames for demo %d\n", nrOfKeyFrames, demoId);
-        stackPushInt(nrOfKeyFrames);
+    sDemoFrame_t *pFrame = &pDecoder->frame;
+    for (int i = 0; i < 3; i++)
+    {
+        pFrame->origin[i] = (float)pState->origin[i] / DEMO_ORIGIN_SCALE;
+        pFrame->angles[i] = (float)pState->angles[i] / DEMO_ANGLE_SCALE;
     }
+    pFrame->flags = (short)pState->flags;
+    pFrame->fps = (short)pState->fps;
+    pFrame->saveNow = ((misc & DEMO_ENC_MISC_SAVE) != 0);
+    pFrame->loadNow = ((misc & DEMO_ENC_MISC_LOAD) != 0);
+    pFrame->rpgNow = ((misc & DEMO_ENC_MISC_RPG) != 0);
+    const sDemoAnchor_t *pAnchor = &pDemo->pAnchors[pDecoder->frameIdx >> DEMO_FRAMES_PER_ANCHOR_SHIFT];
+    pFrame->isKeyFrame = ((pAnchor->keyFrameMask >> (pDecoder->frameIdx & (DEMO_FRAMES_PER_ANCHOR - 1))) & 1) != 0;
+    pFrame->keyFrameRank = -1;
 }
 
-void Gsc_Demo_CreateDemo()
+// Decodes a frame of a compact demo. Sequential access (forwards) costs one frame decode, anything else starts at the nearest anchor
+static sDemoFrame_t *decodeDemoFrame(const sDemo_t *pDemo, sDemoDecoder_t *pDecoder, int frameIdx)
 {
-    int demoId = -1;
-    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+    if (pDecoder->frameIdx == frameIdx)
+    {
+        return &pDecoder->frame;
+    }
 
-    sDemo_t *pDemo = findDemoById(demoId);
-    if (pDemo)
+    int anchorIdx = frameIdx >> DEMO_FRAMES_PER_ANCHOR_SHIFT;
+    if ((pDecoder->frameIdx < 0) || (pDecoder->frameIdx > frameIdx) || ((pDecoder->frameIdx >> DEMO_FRAMES_PER_ANCHOR_SHIFT) != anchorIdx))
+    {
+        // Anchor frames are encoded as the difference with an all-zero frame
+        pDecoder->frameIdx = (anchorIdx << DEMO_FRAMES_PER_ANCHOR_SHIFT) - 1;
+        pDecoder->offset = pDemo->pAnchors[anchorIdx].offset;
+        pDecoder->nrRepeatsLeft = 0;
+        memset(&pDecoder->state, 0, sizeof(pDecoder->state));
+    }
+
+    while (pDecoder->frameIdx < frameIdx)
+    {
+        decodeNextDemoFrame(pDemo, pDecoder);
+    }
+
+    return &pDecoder->frame;
+}
+
+// Converts the frames of a demo to the compact encoding. Only reads the demo, so this can be done by the writer thread
+static bool encodeDemoFrames(const sDemo_t *pDemo, sDemoEncoding_t *pEncoding)
+{
+    if (pDemo->size == 0)
+    {
+        return false;
+    }
+
+    int nrAnchors = (pDemo->size + DEMO_FRAMES_PER_ANCHOR - 1) >> DEMO_FRAMES_PER_ANCHOR_SHIFT;
+    sDemoAnchor_t *pAnchors = (sDemoAnchor_t *)calloc(nrAnchors, sizeof(*pAnchors));
+    int capacity = (pDemo->size * 8) + DEMO_MAX_ENCODED_FRAME_SIZE + DEMO_MAX_ENCODED_REPEAT_SIZE; // Typical frames are much smaller than the max, buffer grows if needed
+    uint8_t *pEncoded = (uint8_t *)malloc(capacity);
+    if (!pAnchors || !pEncoded)
+    {
+        free(pAnchors);
+        free(pEncoded);
+        return false;
+    }
+
+    sDemoQuantizedFrame_t frames[2];
+    sDemoQuantizedFrame_t *pPrev = &frames[0];
+    sDemoQuantizedFrame_t *pCurr = &frames[1];
+    int size = 0;
+    int nrKeyFrames = 0;
+    int nrRepeats = 0;      // Repeated frames that are not written yet. Runs end at anchors, so anchors can be decoded on their own
+    for (int frameIdx = 0; frameIdx < pDemo->size; frameIdx++)
+    {
+        const sDemoFrame_t *pFrame = getDemoFrame(pDemo, frameIdx);
+        sDemoAnchor_t *pAnchor = &pAnchors[frameIdx >> DEMO_FRAMES_PER_ANCHOR_SHIFT];
+        int bit = frameIdx & (DEMO_FRAMES_PER_ANCHOR - 1);
+        quantizeDemoFrame(pFrame, pCurr);
+        bool isRepeat = (bit != 0) && isRepeatedDemoFrame(pFrame, pPrev, pCurr);
+        if ((nrRepeats > 0) && !isRepeat)
+        {
+            size = (int)(encodeDemoRepeat(pEncoded + size, nrRepeats) - pEncoded);
+            nrRepeats = 0;
+        }
+
+        if (bit == 0)
+        {
+            pAnchor->offset = size;
+            pAnchor->keyFrameRank = nrKeyFrames;
+            memset(pPrev, 0, sizeof(*pPrev));
+        }
+        if (pFrame->isKeyFrame)
+        {
+            pAnchor->keyFrameMask |= (1ULL << bit);
+            nrKeyFrames++;
+        }
+
+        if (isRepeat)
+        {
+            nrRepeats++;
+            continue;
+        }
+
+        if ((size + DEMO_MAX_ENCODED_FRAME_SIZE + DEMO_MAX_ENCODED_REPEAT_SIZE) > capacity) // Room for a repeat entry after the frame
+        {
+            capacity *= 2;
+            uint8_t *pNewEncoded = (uint8_t *)realloc(pEncoded, capacity);
+            if (!pNewEncoded)
+            {
+                free(pAnchors);
+                free(pEncoded);
+                return false;
+            }
+            pEncoded = pNewEncoded;
+        }
+
+        size = (int)(encodeDemoFrame(pEncoded + size, pFrame, pPrev, pCurr) - pEncoded);
+
+        sDemoQuantizedFrame_t *pTmp = pPrev;
+        pPrev = pCurr;
+        pCurr = pTmp;
+    }
+    if (nrRepeats > 0)
+    {
+        size = (int)(encodeDemoRepeat(pEncoded + size, nrRepeats) - pEncoded);
+    }
+
+    uint8_t *pShrunk = (uint8_t *)realloc(pEncoded, size);
+    if (pShrunk)
+    {
+        pEncoded = pShrunk;
+    }
+
+    printf("Encoded demo with id %d: %d frames, %d -> %d bytes\n", pDemo->id, pDemo->size,
+            (int)(pDemo->size * sizeof(sDemoFrame_t)), size + (int)(nrAnchors * sizeof(*pAnchors)));
+
+    pEncoding->pEncoded = pEncoded;
+    pEncoding->encodedSize = size;
+    pEncoding->pAnchors = pAnchors;
+    pEncoding->nrAnchors = nrAnchors;
+    return true;
+}
+
+static void freeDemoEncoding(sDemoEncoding_t *pEncoding)
+{
+    free(pEncoding->pEncoded);
+    free(pEncoding->pAnchors);
+    memset(pEncoding, 0, sizeof(*pEncoding));
+}
+
+// Gives the encoding to the demo and releases its frame blocks. If pMapping is set, the encoding points into this mapping
+static void setDemoEncoding(sDemo_t *pDemo, const sDemoEncoding_t *pEncoding, void *pMapping, size_t mappingSize)
+{
+    for (int i = 0; i < pDemo->nrBlocks; i++)
+    {
+        releaseFrameBlock(pDemo->ppBlocks[i]);
+    }
+    free(pDemo->ppBlocks);
+    pDemo->ppBlocks = NULL;
+    pDemo->nrBlocks = 0;
+    pDemo->nrBlockSlots = 0;
+
+    // The encoding has its own key frame masks
+    free(pDemo->pKeyFrames);
+    pDemo->pKeyFrames = NULL;
+    pDemo->nrKeyFrameSlots = 0;
+    free(pDemo->pSaveFrames);
+    pDemo->pSaveFrames = NULL;
+    pDemo->nrSaveFrames = 0;
+    pDemo->nrSaveFrameSlots = 0;
+    // The encoding has its own repeat entries
+    free(pDemo->pRepeatRuns);
+    pDemo->pRepeatRuns = NULL;
+    pDemo->nrRepeatRuns = 0;
+    pDemo->nrRepeatRunSlots = 0;
+    pDemo->nrRepeatedFrames = 0;
+
+    pDemo->pEncoded = pEncoding->pEncoded;
+    pDemo->encodedSize = pEncoding->encodedSize;
+    pDemo->pAnchors = pEncoding->pAnchors;
+    pDemo->nrAnchors = pEncoding->nrAnchors;
+    const sDemoAnchor_t *pLastAnchor = &pEncoding->pAnchors[pEncoding->nrAnchors - 1];
+    pDemo->nrKeyFrames = pLastAnchor->keyFrameRank + __builtin_popcountll(pLastAnchor->keyFrameMask);
+    pDemo->pMapping = pMapping;
+    pDemo->mappingSize = mappingSize;
+}
+
+// Converts the frames of a demo to the compact encoding and releases its frame blocks
+static bool encodeDemo(sDemo_t *pDemo)
+{
+    sDemoEncoding_t encoding;
+    if (pDemo->pEncoded || !encodeDemoFrames(pDemo, &encoding))
+    {
+        return false;
+    }
+
+    setDemoEncoding(pDemo, &encoding, NULL, 0);
+    return true;
+}
+
+static bool isKeyFrame(const sDemo_t *pDemo, int frameIdx)
+{
+    if (!pDemo->pEncoded)
+    {
+        return getDemoFrame(pDemo, frameIdx)->isKeyFrame;
+    }
+
+    uint64_t mask = pDemo->pAnchors[frameIdx >> DEMO_FRAMES_PER_ANCHOR_SHIFT].keyFrameMask;
+    return ((mask >> (frameIdx & (DEMO_FRAMES_PER_ANCHOR - 1))) & 1) != 0;
+}
+
+// Number of key frames before the frame
+static int getKeyFrameRank(const sDemo_t *pDemo, int frameIdx)
+{
+    if (!pDemo->pEncoded)
+    {
+        return getDemoFrame(pDemo, frameIdx)->keyFrameRank;
+    }
+
+    const sDemoAnchor_t *pAnchor = &pDemo->pAnchors[frameIdx >> DEMO_FRAMES_PER_ANCHOR_SHIFT];
+    uint64_t maskBefore = (1ULL << (frameIdx & (DEMO_FRAMES_PER_ANCHOR - 1))) - 1;
+    return pAnchor->keyFrameRank + __builtin_popcountll(pAnchor->keyFrameMask & maskBefore);
+}
+
+// Frame index of the key frame with the given rank, which should be < nrKeyFrames
+static int getKeyFrameByRank(const sDemo_t *pDemo, int rank)
+{
+    if (!pDemo->pEncoded)
+    {
+        return pDemo->pKeyFrames[rank];
+    }
+
+    // Last anchor that has at most rank key frames before it
+    int low = 0;
+    int high = pDemo->nrAnchors - 1;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if (pDemo->pAnchors[mid].keyFrameRank <= rank)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+
+    const sDemoAnchor_t *pAnchor = &pDemo->pAnchors[low];
+    uint64_t mask = pAnchor->keyFrameMask;
+    for (int i = pAnchor->keyFrameRank; i < rank; i++)
+    {
+        mask &= mask - 1; // Clear the lowest key frame
+    }
+    return (low << DEMO_FRAMES_PER_ANCHOR_SHIFT) + __builtin_ctzll(mask);
+}
+
+// Skips a number of key frames (negative for backwards). Forwards it stops at the last key frame, backwards it ends at the first frame
+static int skipKeyFrames(const sDemo_t *pDemo, int frameIdx, int nrToSkip)
+{
+    int rank = getKeyFrameRank(pDemo, frameIdx);
+    if (nrToSkip > 0)
+    {
+        // Rank of the first key frame after this frame
+        rank += isKeyFrame(pDemo, frameIdx) ? 1 : 0;
+        if (rank >= pDemo->nrKeyFrames)
+        {
+            return frameIdx;
+        }
+
+        int nrKeyFramesLeft = pDemo->nrKeyFrames - rank;
+        rank += (nrToSkip < nrKeyFramesLeft) ? (nrToSkip - 1) : (nrKeyFramesLeft - 1);
+        return getKeyFrameByRank(pDemo, rank);
+    }
+    else if (nrToSkip < 0)
+    {
+        rank += nrToSkip;
+        return (rank >= 0) ? getKeyFrameByRank(pDemo, rank) : 0;
+    }
+
+    return frameIdx;
+}
+
+static sDemoFrame_t *getPlaybackFrame(sDemoPlayback_t *pPlayback)
+{
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (pDemo->pEncoded)
+    {
+        return decodeDemoFrame(pDemo, &pPlayback->decoder, pPlayback->selectedFrame);
+    }
+
+    return getDemoFrame(pDemo, pPlayback->selectedFrame);
+}
+
+// Makes sure a growable list has room for one more element, doubling its size when needed
+template <typename T>
+static bool reserveListSlot(T **ppList, int nrUsed, int *pNrSlots, int initialNrSlots)
+{
+    if (nrUsed < *pNrSlots)
+    {
+        return true;
+    }
+
+    int nrSlots = (*pNrSlots > 0) ? (*pNrSlots * 2) : initialNrSlots;
+    T *pList = (T *)realloc(*ppList, nrSlots * sizeof(T));
+    if (!pList)
+    {
+        return false;
+    }
+    *ppList = pList;
+    *pNrSlots = nrSlots;
+    return true;
+}
+
+// Segment that contains the frame
+static int findSegment(const sDemo_t *pDemo, int frameIdx)
+{
+    int low = 0;
+    int high = pDemo->nrSegments - 1;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if (pDemo->pSegments[mid].startFrame <= frameIdx)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+// Time range that contains the frame
+static const sDemoTimeRange_t *getTimeRange(const sDemo_t *pDemo, int frameIdx)
+{
+    int low = 0;
+    int high = pDemo->nrTimeRanges - 1;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if (pDemo->pTimeRanges[mid].startFrame <= frameIdx)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return &pDemo->pTimeRanges[low];
+}
+
+// Time of the frame in ms, relative to the first frame of the demo
+static int getDemoFrameTime(const sDemo_t *pDemo, int frameIdx)
+{
+    if (pDemo->nrTimeRanges == 0)
+    {
+        return frameIdx * DEMO_DEFAULT_FRAME_TIME;
+    }
+
+    const sDemoTimeRange_t *pRange = getTimeRange(pDemo, frameIdx);
+    return pRange->startTime + ((frameIdx - pRange->startFrame) * pRange->frameTime);
+}
+
+// Last frame at or before the time
+static int getDemoFrameAtTime(const sDemo_t *pDemo, float time)
+{
+    int frameIdx = 0;
+    if (time <= 0.0f)
+    {
+        frameIdx = 0;
+    }
+    else if (pDemo->nrTimeRanges == 0)
+    {
+        frameIdx = (int)(time / DEMO_DEFAULT_FRAME_TIME);
+    }
+    else
+    {
+        int low = 0;
+        int high = pDemo->nrTimeRanges - 1;
+        while (low < high)
+        {
+            int mid = (low + high + 1) / 2;
+            if (pDemo->pTimeRanges[mid].startTime <= time)
+            {
+                low = mid;
+            }
+            else
+            {
+                high = mid - 1;
+            }
+        }
+
+        const sDemoTimeRange_t *pRange = &pDemo->pTimeRanges[low];
+        int endFrame = ((low + 1) < pDemo->nrTimeRanges) ? pDemo->pTimeRanges[low + 1].startFrame : pDemo->size;
+        frameIdx = endFrame - 1;
+        if (pRange->frameTime > 0)
+        {
+            int nrFrames = (int)((time - pRange->startTime) / pRange->frameTime);
+            frameIdx = ((pRange->startFrame + nrFrames) < endFrame) ? (pRange->startFrame + nrFrames) : (endFrame - 1);
+        }
+    }
+
+    return (frameIdx < pDemo->size) ? frameIdx : (pDemo->size - 1);
+}
+
+// Keeps track of the frame times while recording. Time is the server time of the new frame
+static bool addDemoFrameTime(sDemo_t *pDemo, int frameIdx, int time)
+{
+    if (frameIdx == 0)
+    {
+        pDemo->startTime = time;
+    }
+
+    // Time never goes backwards within a demo
+    int frameTime = time - pDemo->startTime;
+    if ((frameIdx == 0) || (frameTime < pDemo->lastFrameTime))
+    {
+        frameTime = (frameIdx == 0) ? 0 : pDemo->lastFrameTime;
+    }
+
+    bool isNewRange = (pDemo->nrTimeRanges == 0);
+    if (!isNewRange)
+    {
+        sDemoTimeRange_t *pRange = &pDemo->pTimeRanges[pDemo->nrTimeRanges - 1];
+        if ((frameIdx - pRange->startFrame) == 1)
+        {
+            // The second frame of a range sets the time between its frames
+            pRange->frameTime = frameTime - pRange->startTime;
+        }
+        else
+        {
+            isNewRange = (frameTime != (pRange->startTime + ((frameIdx - pRange->startFrame) * pRange->frameTime)));
+        }
+    }
+
+    if (isNewRange)
+    {
+        if (!reserveListSlot(&pDemo->pTimeRanges, pDemo->nrTimeRanges, &pDemo->nrTimeRangeSlots, INITIAL_NR_SEGMENT_SLOTS))
+        {
+            return false;
+        }
+        sDemoTimeRange_t *pRange = &pDemo->pTimeRanges[pDemo->nrTimeRanges++];
+        pRange->startFrame = frameIdx;
+        pRange->startTime = frameTime;
+        pRange->frameTime = 0;
+    }
+
+    pDemo->lastFrameTime = frameTime;
+    return true;
+}
+
+// Works out which frames the completed run consists of: the last segment, preceded by the part of its parent up to the branch, and so on
+static bool buildFinalPath(sDemo_t *pDemo)
+{
+    free(pDemo->pPathRanges);
+    pDemo->pPathRanges = NULL;
+    pDemo->nrPathRanges = 0;
+    pDemo->pathSize = 0;
+
+    int nrRanges = 0;
+    for (int segmentIdx = pDemo->nrSegments - 1; segmentIdx >= 0; segmentIdx = pDemo->pSegments[segmentIdx].parent)
+    {
+        nrRanges++;
+    }
+    if (nrRanges == 0)
+    {
+        return true;
+    }
+
+    sDemoPathRange_t *pRanges = (sDemoPathRange_t *)malloc(nrRanges * sizeof(*pRanges));
+    if (!pRanges)
+    {
+        return false;
+    }
+
+    int rangeIdx = nrRanges;
+    int endFrame = pDemo->pSegments[pDemo->nrSegments - 1].endFrame;
+    for (int segmentIdx = pDemo->nrSegments - 1; segmentIdx >= 0; segmentIdx = pDemo->pSegments[segmentIdx].parent)
+    {
+        const sDemoSegment_t *pSegment = &pDemo->pSegments[segmentIdx];
+        sDemoPathRange_t *pRange = &pRanges[--rangeIdx];
+        pRange->startFrame = pSegment->startFrame;
+        pRange->nrFrames = endFrame - pSegment->startFrame;
+        endFrame = pSegment->branchFrame + 1;
+    }
+
+    int pathSize = 0;
+    int pathTime = 0;
+    for (int i = 0; i < nrRanges; i++)
+    {
+        // The step from the last frame of the previous range is as long as the step into this range (from the abandoned frame before it)
+        int startFrame = pRanges[i].startFrame;
+        if (i > 0)
+        {
+            const sDemoPathRange_t *pPrev = &pRanges[i - 1];
+            int lastFrame = pPrev->startFrame + pPrev->nrFrames - 1;
+            pathTime += getDemoFrameTime(pDemo, lastFrame) - getDemoFrameTime(pDemo, pPrev->startFrame);
+            pathTime += getDemoFrameTime(pDemo, startFrame) - getDemoFrameTime(pDemo, startFrame - 1);
+        }
+
+        pRanges[i].pathStart = pathSize;
+        pRanges[i].pathTime = pathTime;
+        pathSize += pRanges[i].nrFrames;
+    }
+
+    pDemo->pPathRanges = pRanges;
+    pDemo->nrPathRanges = nrRanges;
+    pDemo->pathSize = pathSize;
+    return true;
+}
+
+// Range of the final path that contains the path position
+static const sDemoPathRange_t *getPathRange(const sDemo_t *pDemo, int pathPos)
+{
+    int low = 0;
+    int high = pDemo->nrPathRanges - 1;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if (pDemo->pPathRanges[mid].pathStart <= pathPos)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return &pDemo->pPathRanges[low];
+}
+
+static int getPathFrame(const sDemo_t *pDemo, int pathPos)
+{
+    const sDemoPathRange_t *pRange = getPathRange(pDemo, pathPos);
+    return pRange->startFrame + (pathPos - pRange->pathStart);
+}
+
+// Position of the frame on the final path, or -1 if the player loaded back to before this frame
+static int getFramePathPos(const sDemo_t *pDemo, int frameIdx)
+{
+    if (pDemo->nrPathRanges == 0)
+    {
+        return -1;
+    }
+
+    // Segments only branch off earlier segments, so the ranges of the final path are ordered by frame as well
+    int low = 0;
+    int high = pDemo->nrPathRanges - 1;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if (pDemo->pPathRanges[mid].startFrame <= frameIdx)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+
+    const sDemoPathRange_t *pRange = &pDemo->pPathRanges[low];
+    if ((frameIdx < pRange->startFrame) || (frameIdx >= (pRange->startFrame + pRange->nrFrames)))
+    {
+        return -1;
+    }
+    return pRange->pathStart + (frameIdx - pRange->startFrame);
+}
+
+// Time of a final path position in ms. The time spent in abandoned segments is left out
+static int getPathPosTime(const sDemo_t *pDemo, int pathPos)
+{
+    const sDemoPathRange_t *pRange = getPathRange(pDemo, pathPos);
+    int frameIdx = pRange->startFrame + (pathPos - pRange->pathStart);
+    return pRange->pathTime + getDemoFrameTime(pDemo, frameIdx) - getDemoFrameTime(pDemo, pRange->startFrame);
+}
+
+static bool initDemoSlots(int maxNrDemos)
+{
+    // Twice as many table entries as slots keeps the probe sequences short
+    uint32_t tableSize = 1;
+    while (tableSize < (uint32_t)(maxNrDemos * 2))
+    {
+        tableSize <<= 1;
+    }
+
+    sDemo_t *pDemos = (sDemo_t *)calloc(maxNrDemos, sizeof(sDemo_t));
+    int *pTable = (int *)malloc(tableSize * sizeof(int));
+    if (!pDemos || !pTable)
+    {
+        printf("Failed to allocate %d demo slots\n", maxNrDemos);
+        free(pDemos);
+        free(pTable);
+        return false;
+    }
+
+    free(opencj_demos);
+    free(opencj_demoIdTable);
+    opencj_demos = pDemos;
+    opencj_demoIdTable = pTable;
+    opencj_demoIdTableMask = tableSize - 1;
+    opencj_maxNrDemos = maxNrDemos;
+    memset(opencj_demoIdTable, 0xFF, tableSize * sizeof(int));
+
+    for (int i = 0; i < maxNrDemos; i++)
+    {
+        opencj_demos[i].nextFreeSlot = ((i + 1) < maxNrDemos) ? (i + 1) : -1;
+    }
+    opencj_firstFreeDemoSlot = 0;
+    return true;
+}
+
+static uint32_t getDemoIdHome(int demoId)
+{
+    uint32_t hash = (uint32_t)demoId * 2654435761u;
+    return (hash ^ (hash >> 16)) & opencj_demoIdTableMask;
+}
+
+// Position of the demo id in the id table, or -1 if the id is not in use
+static int findDemoIdPos(int demoId)
+{
+    if (!opencj_demoIdTable)
+    {
+        return -1;
+    }
+
+    for (uint32_t pos = getDemoIdHome(demoId); opencj_demoIdTable[pos] >= 0; pos = (pos + 1) & opencj_demoIdTableMask)
+    {
+        if (opencj_demos[opencj_demoIdTable[pos]].id == demoId)
+        {
+            return (int)pos;
+        }
+    }
+
+    return -1;
+}
+
+static void insertDemoId(int demoId, int slot)
+{
+    uint32_t pos = getDemoIdHome(demoId);
+    while (opencj_demoIdTable[pos] >= 0)
+    {
+        pos = (pos + 1) & opencj_demoIdTableMask;
+    }
+    opencj_demoIdTable[pos] = slot;
+}
+
+static void removeDemoIdPos(uint32_t pos)
+{
+    // Entries after the removed one are shifted back if their probe sequence passes the hole, so lookups never need tombstones
+    uint32_t next = pos;
+    while (true)
+    {
+        next = (next + 1) & opencj_demoIdTableMask;
+        if (opencj_demoIdTable[next] < 0)
+        {
+            break;
+        }
+
+        uint32_t home = getDemoIdHome(opencj_demos[opencj_demoIdTable[next]].id);
+        if (((next - home) & opencj_demoIdTableMask) >= ((next - pos) & opencj_demoIdTableMask))
+        {
+            opencj_demoIdTable[pos] = opencj_demoIdTable[next];
+            pos = next;
+        }
+    }
+    opencj_demoIdTable[pos] = -1;
+}
+
+static sDemo_t *findDemoById(int demoId)
+{
+    int pos = findDemoIdPos(demoId);
+    if (pos < 0)
+    {
+        printf("Demo with id %d was not found or is empty\n", demoId);
+        return NULL;
+    }
+
+    return &opencj_demos[opencj_demoIdTable[pos]];
+}
+
+static void getDemoSpillPath(int demoId, char *path, size_t pathSize)
+{
+    snprintf(path, pathSize, "%s/%d.ocjd", opencj_demoSpillDir, demoId);
+}
+
+// Releases the frames and everything derived from them. What describes the demo (id, size, number of key frames) is kept
+static void releaseDemoData(sDemo_t *pDemo)
+{
+    for (int i = 0; i < pDemo->nrBlocks; i++)
+    {
+        releaseFrameBlock(pDemo->ppBlocks[i]);
+    }
+    free(pDemo->ppBlocks);
+    free(pDemo->pKeyFrames);
+    free(pDemo->pSaveFrames);
+    free(pDemo->pSegments);
+    free(pDemo->pTimeRanges);
+    free(pDemo->pRepeatRuns);
+    free(pDemo->pPathRanges);
+    free(pDemo->pIndexNodes);
+    free(pDemo->columns.pX);
+    if (pDemo->pMapping)
+    {
+        munmap(pDemo->pMapping, pDemo->mappingSize);
+    }
+    else
+    {
+        free(pDemo->pEncoded);
+        free(pDemo->pAnchors);
+    }
+
+    pDemo->ppBlocks = NULL;
+    pDemo->nrBlocks = 0;
+    pDemo->nrBlockSlots = 0;
+    pDemo->pKeyFrames = NULL;
+    pDemo->nrKeyFrameSlots = 0;
+    pDemo->pSaveFrames = NULL;
+    pDemo->nrSaveFrames = 0;
+    pDemo->nrSaveFrameSlots = 0;
+    pDemo->pSegments = NULL;
+    pDemo->nrSegments = 0;
+    pDemo->nrSegmentSlots = 0;
+    pDemo->pTimeRanges = NULL;
+    pDemo->nrTimeRanges = 0;
+    pDemo->nrTimeRangeSlots = 0;
+    pDemo->pRepeatRuns = NULL;
+    pDemo->nrRepeatRuns = 0;
+    pDemo->nrRepeatRunSlots = 0;
+    pDemo->nrRepeatedFrames = 0;
+    pDemo->pPathRanges = NULL;
+    pDemo->nrPathRanges = 0;
+    pDemo->pathSize = 0;
+    pDemo->pIndexNodes = NULL;
+    pDemo->nrIndexNodes = 0;
+    memset(&pDemo->columns, 0, sizeof(pDemo->columns));
+    pDemo->pEncoded = NULL;
+    pDemo->encodedSize = 0;
+    pDemo->pAnchors = NULL;
+    pDemo->nrAnchors = 0;
+    pDemo->pMapping = NULL;
+    pDemo->mappingSize = 0;
+}
+
+static void releaseDemo(sDemo_t *pDemo)
+{
+    printf("Clearing demo with pointer %p\n", pDemo);
+    int pos = findDemoIdPos(pDemo->id);
+    if (pos >= 0)
+    {
+        removeDemoIdPos(pos);
+    }
+    releaseDemoData(pDemo);
+    if (pDemo->isSpilled)
+    {
+        char spillPath[1024];
+        getDemoSpillPath(pDemo->id, spillPath, sizeof(spillPath));
+        unlink(spillPath);
+    }
+
+    // Players that were watching this demo stop watching, the slot is handed out to the next demo that is created.
+    // Players that share a playback all have the demo selected, so the whole group stops. Players that were recorded stop recording
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (opencj_playback[i].pDemo == pDemo)
+        {
+            opencj_playback[i].pDemo = NULL;
+            opencj_playback[i].pEntity = NULL;
+            opencj_playback[i].pLeader = NULL;
+        }
+        if (opencj_recorders[i].pDemo == pDemo)
+        {
+            opencj_recorders[i].pDemo = NULL;
+        }
+    }
+
+    memset(pDemo, 0, sizeof(*pDemo));
+
+    int slot = (int)(pDemo - opencj_demos);
+    pDemo->nextFreeSlot = opencj_firstFreeDemoSlot;
+    opencj_firstFreeDemoSlot = slot;
+    opencj_nrDemosInUse--;
+}
+
+static void clearDemoById(int demoId)
+{
+    int pos = findDemoIdPos(demoId);
+    if (pos >= 0)
+    {
+        sDemo_t *pDemo = &opencj_demos[opencj_demoIdTable[pos]];
+
+        // Clear demo data, free up this spot
+        if ((pDemo->magic != DEMO_MAGIC_NUMBER) || (pDemo->id <= 0))
+        {
+            printf("Demo is already clear (%p)\n", pDemo);
+            removeDemoIdPos(pos);
+            return;
+        }
+
+        // The writer thread is still reading the frames, the spot and the id are freed once the writer is done.
+        // Until then the demo still exists, so a new demo with the same id can't write to the same destination
+        if (pDemo->isBeingPersisted)
+        {
+            printf("Demo with id %d is being persisted, it will be cleared afterwards\n", demoId);
+            pDemo->isClearPending = true;
+            return;
+        }
+
+        releaseDemo(pDemo);
+    }
+}
+
+static void clearAllDemos()
+{
+    printf("Clearing all demos\n");
+    for (int i = 0; (i < opencj_maxNrDemos) && opencj_demos; i++)
+    {
+        if (opencj_demos[i].id > 0)
+        {
+            clearDemoById(opencj_demos[i].id);
+        }
+    }
+}
+
+static inline bool isWithinAngleTolerance(float a, float b, float tolerance)
+{
+    float diff = fabsf(remainderf(a - b, 360.0f));
+    return diff <= tolerance;
+}
+
+// Whether a frame of a sparse demo doesn't need to be stored, because it repeats the last stored frame.
+// Frames with events are always stored, so playback sees them on the frame they happened
+static bool isSparseRepeatFrame(const sDemo_t *pDemo, const sDemoFrame_t *pFrame, const sDemoFrame_t *pStored)
+{
+    if (pFrame->isKeyFrame || pFrame->saveNow || pFrame->loadNow || pFrame->rpgNow
+        || pStored->isKeyFrame || pStored->saveNow || pStored->loadNow || pStored->rpgNow
+        || (pFrame->flags != pStored->flags) || (pFrame->fps != pStored->fps))
+    {
+        return false;
+    }
+
+    // Compared with the stored frame rather than the previous frame, so slow movement doesn't get lost
+    for (int i = 0; i < 3; i++)
+    {
+        if ((fabsf(pFrame->origin[i] - pStored->origin[i]) > pDemo->sparseOriginTolerance)
+            || !isWithinAngleTolerance(pFrame->angles[i], pStored->angles[i], pDemo->sparseAngleTolerance))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Extends the last repeat run, or starts a new one. A slot for a new run must be reserved
+static void addDemoRepeatFrame(sDemo_t *pDemo, int frameIdx)
+{
+    if (pDemo->nrRepeatRuns > 0)
+    {
+        sDemoRepeatRun_t *pRun = &pDemo->pRepeatRuns[pDemo->nrRepeatRuns - 1];
+        if ((pRun->startFrame + pRun->nrFrames) == frameIdx)
+        {
+            pRun->nrFrames++;
+            pDemo->nrRepeatedFrames++;
+            return;
+        }
+    }
+
+    sDemoRepeatRun_t *pRun = &pDemo->pRepeatRuns[pDemo->nrRepeatRuns++];
+    pRun->startFrame = frameIdx;
+    pRun->nrFrames = 1;
+    pRun->nrRepeatedBefore = pDemo->nrRepeatedFrames;
+    pDemo->nrRepeatedFrames++;
+}
+
+static sDemo_t *createDemo(int demoId)
+{
+    sDemo_t *pExisting = findDemoById(demoId);
+    if (pExisting != NULL)
+    {
+        printf(pExisting->isClearPending ? "Demo with id %d is still being cleared!\n" : "Demo with id %d already exists!\n", demoId);
+        return NULL;
+    }
+
+    printf("Creating demo with id %d\n", demoId);
+
+    if (!opencj_demos && !initDemoSlots(opencj_maxNrDemos))
+    {
+        return NULL;
+    }
+
+    int slot = opencj_firstFreeDemoSlot;
+    if (slot < 0)
+    {
+        printf("No free slot for demo with id %d, all %d slots are in use\n", demoId, opencj_maxNrDemos);
+        return NULL;
+    }
+
+    sDemo_t *pDemo = &opencj_demos[slot];
+    opencj_firstFreeDemoSlot = pDemo->nextFreeSlot;
+    opencj_nrDemosInUse++;
+
+    memset(pDemo, 0, sizeof(*pDemo));
+    pDemo->magic = DEMO_MAGIC_NUMBER;
+    pDemo->id = demoId;
+    pDemo->nextFreeSlot = -1;
+    // Frame blocks are allocated once frames are added
+
+    insertDemoId(demoId, slot);
+    return pDemo;
+}
+
+// Appends a frame to a demo that is being recorded. For loads, loadBackwardsCount selects the loaded save (0 is the last save).
+// Time is the server time of the frame in ms
+static bool addDemoFrame(sDemo_t *pDemo, const sDemoFrame_t *pFrame, int loadBackwardsCount, int time)
+{
+    if (pDemo->isComplete)
+    {
+        printf("Demo with id %d is already complete.. stop adding frames please\n", pDemo->id);
+        return false;
+    }
+
+    bool isFirstFrame = !pDemo->isFirstFrameFilled;
+    int idxNewFrame = pDemo->currentFrame;
+    if (!isFirstFrame) // First frame might not be filled in yet
+    {
+        idxNewFrame++;
+    }
+
+    bool isNewSegment = isFirstFrame || pFrame->loadNow;
+    int storedIdx = idxNewFrame - pDemo->nrRepeatedFrames;
+    bool isRepeat = pDemo->isSparse && !isNewSegment && isSparseRepeatFrame(pDemo, pFrame, getStoredDemoFrame(pDemo, storedIdx - 1));
+    if ((isRepeat ? !reserveListSlot(&pDemo->pRepeatRuns, pDemo->nrRepeatRuns, &pDemo->nrRepeatRunSlots, INITIAL_NR_REPEAT_RUN_SLOTS)
+                  : !reserveDemoFrame(pDemo, storedIdx))
+        || (pFrame->isKeyFrame && !reserveListSlot(&pDemo->pKeyFrames, pDemo->nrKeyFrames, &pDemo->nrKeyFrameSlots, INITIAL_NR_KEY_FRAME_SLOTS))
+        || (pFrame->saveNow && !reserveListSlot(&pDemo->pSaveFrames, pDemo->nrSaveFrames, &pDemo->nrSaveFrameSlots, INITIAL_NR_SEGMENT_SLOTS))
+        || (isNewSegment && !reserveListSlot(&pDemo->pSegments, pDemo->nrSegments, &pDemo->nrSegmentSlots, INITIAL_NR_SEGMENT_SLOTS))
+        || !addDemoFrameTime(pDemo, idxNewFrame, time))
+    {
+        printf("Out of memory for frame %d of demo %d\n", idxNewFrame, pDemo->id);
+        return false;
+    }
+
+    // Repeated frames read the stored frame before them, which has no events and the same key frame rank
+    if (isRepeat)
+    {
+        addDemoRepeatFrame(pDemo, idxNewFrame);
+    }
+    else
+    {
+        sDemoFrame_t *pNewFrame = getStoredDemoFrame(pDemo, storedIdx);
+
+        // Fill in new frame
+        *pNewFrame = *pFrame;
+
+        // The key frames before and after any frame follow from its rank in the key frame index,
+        // so adding a key frame never has to update the frames before it
+        pNewFrame->keyFrameRank = pDemo->nrKeyFrames;
+    }
+    if (pFrame->isKeyFrame)
+    {
+        pDemo->pKeyFrames[pDemo->nrKeyFrames++] = idxNewFrame;
+        if (!isFirstFrame)
+        {
+            // Update the last key frame of the demo
+            pDemo->lastKeyFrame = idxNewFrame;
+        }
+    }
+
+    // A load starts a new segment that continues from the frame of the loaded save.
+    // If that save is not part of this demo, the new segment simply continues the previous one
+    if (isNewSegment)
+    {
+        sDemoSegment_t *pSegment = &pDemo->pSegments[pDemo->nrSegments];
+        pSegment->startFrame = idxNewFrame;
+        pSegment->parent = -1;
+        pSegment->branchFrame = -1;
+        if (!isFirstFrame)
+        {
+            int saveIdx = pDemo->nrSaveFrames - 1 - loadBackwardsCount;
+            pSegment->branchFrame = ((saveIdx >= 0) && (saveIdx < pDemo->nrSaveFrames)) ? pDemo->pSaveFrames[saveIdx] : (idxNewFrame - 1);
+            pSegment->parent = findSegment(pDemo, pSegment->branchFrame);
+        }
+        pDemo->nrSegments++;
+    }
+    pDemo->pSegments[pDemo->nrSegments - 1].endFrame = idxNewFrame + 1;
+    if (pFrame->saveNow)
+    {
+        pDemo->pSaveFrames[pDemo->nrSaveFrames++] = idxNewFrame;
+    }
+
+    // We added 1 frame, so demo size increases by 1
+    pDemo->size++;
+    pDemo->currentFrame = idxNewFrame;
+    pDemo->isFirstFrameFilled = true;
+
+    return true;
+}
+
+/**************************************************************************
+ * Spatial index                                                          *
+ **************************************************************************/
+
+typedef struct
+{
+    int axis;
+    bool operator()(const sDemoIndexNode_t &a, const sDemoIndexNode_t &b) const
+    {
+        return a.origin[axis] < b.origin[axis];
+    }
+} sDemoIndexNodeLess_t;
+
+// Builds the subtree of the nodes [low, high), splitting on the axis along which they are spread the most
+static void buildDemoIndexTree(sDemoIndexNode_t *pNodes, int low, int high)
+{
+    if (low >= high)
+    {
+        return;
+    }
+
+    float mins[3] = { pNodes[low].origin[0], pNodes[low].origin[1], pNodes[low].origin[2] };
+    float maxs[3] = { mins[0], mins[1], mins[2] };
+    for (int i = low + 1; i < high; i++)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            mins[axis] = std::min(mins[axis], pNodes[i].origin[axis]);
+            maxs[axis] = std::max(maxs[axis], pNodes[i].origin[axis]);
+        }
+    }
+    sDemoIndexNodeLess_t less;
+    less.axis = 0;
+    for (int axis = 1; axis < 3; axis++)
+    {
+        if ((maxs[axis] - mins[axis]) > (maxs[less.axis] - mins[less.axis]))
+        {
+            less.axis = axis;
+        }
+    }
+
+    int mid = (low + high) / 2;
+    std::nth_element(pNodes + low, pNodes + mid, pNodes + high, less);
+    buildDemoIndexTree(pNodes, low, mid);
+    buildDemoIndexTree(pNodes, mid + 1, high);
+
+    sDemoIndexNode_t *pNode = &pNodes[mid];
+    pNode->axis = (uint8_t)less.axis;
+    pNode->minFrame = pNode->startFrame;
+    pNode->maxFrame = pNode->startFrame + pNode->nrFrames - 1;
+    pNode->hasKeyFrame = pNode->isKeyFrame;
+    for (int i = 0; i < 2; i++)
+    {
+        int childLow = (i == 0) ? low : (mid + 1);
+        int childHigh = (i == 0) ? mid : high;
+        if (childLow < childHigh)
+        {
+            const sDemoIndexNode_t *pChild = &pNodes[(childLow + childHigh) / 2];
+            pNode->minFrame = std::min(pNode->minFrame, pChild->minFrame);
+            pNode->maxFrame = std::max(pNode->maxFrame, pChild->maxFrame);
+            pNode->hasKeyFrame = pNode->hasKeyFrame || pChild->hasKeyFrame;
+        }
+    }
+}
+
+static bool buildDemoIndex(sDemo_t *pDemo)
+{
+    free(pDemo->pIndexNodes);
+    pDemo->pIndexNodes = NULL;
+    pDemo->nrIndexNodes = 0;
+    if (pDemo->size == 0)
+    {
+        return true;
+    }
+
+    // Standing still (or a sparse demo) gives many frames at the same origin, which only need 1 node
+    sDemoIndexNode_t *pNodes = NULL;
+    int nrNodes = 0;
+    int nrNodeSlots = 0;
+    sDemoDecoder_t decoder;
+    decoder.frameIdx = -1;
+    for (int frameIdx = 0; frameIdx < pDemo->size; frameIdx++)
+    {
+        const sDemoFrame_t *pFrame = pDemo->pEncoded ? decodeDemoFrame(pDemo, &decoder, frameIdx) : getDemoFrame(pDemo, frameIdx);
+        sDemoIndexNode_t *pLast = (nrNodes > 0) ? &pNodes[nrNodes - 1] : NULL;
+        if (pLast && (pFrame->isKeyFrame == pLast->isKeyFrame) && !memcmp(pFrame->origin, pLast->origin, sizeof(pFrame->origin)))
+        {
+            pLast->nrFrames++;
+            continue;
+        }
+
+        if (!reserveListSlot(&pNodes, nrNodes, &nrNodeSlots, INITIAL_NR_INDEX_NODE_SLOTS))
+        {
+            free(pNodes);
+            return false;
+        }
+        sDemoIndexNode_t *pNode = &pNodes[nrNodes++];
+        memcpy(pNode->origin, pFrame->origin, sizeof(pNode->origin));
+        pNode->startFrame = frameIdx;
+        pNode->nrFrames = 1;
+        pNode->isKeyFrame = pFrame->isKeyFrame;
+    }
+
+    sDemoIndexNode_t *pShrunk = (sDemoIndexNode_t *)realloc(pNodes, nrNodes * sizeof(*pNodes));
+    if (pShrunk)
+    {
+        pNodes = pShrunk;
+    }
+
+    buildDemoIndexTree(pNodes, 0, nrNodes);
+    pDemo->pIndexNodes = pNodes;
+    pDemo->nrIndexNodes = nrNodes;
+    return true;
+}
+
+typedef struct
+{
+    float origin[3];
+    int startFrame;             // Frame window, inclusive
+    int endFrame;
+    bool isKeyFrameOnly;
+    float bestDistSq;
+    int bestFrame;              // -1 until a frame in the window is found
+} sDemoIndexQuery_t;
+
+static void findNearestDemoIndexNode(const sDemoIndexNode_t *pNodes, int low, int high, sDemoIndexQuery_t *pQuery)
+{
+    if (low >= high)
+    {
+        return;
+    }
+
+    int mid = (low + high) / 2;
+    const sDemoIndexNode_t *pNode = &pNodes[mid];
+    if ((pNode->maxFrame < pQuery->startFrame) || (pNode->minFrame > pQuery->endFrame) || (pQuery->isKeyFrameOnly && !pNode->hasKeyFrame))
+    {
+        return;
+    }
+
+    int lastFrame = pNode->startFrame + pNode->nrFrames - 1;
+    if ((!pQuery->isKeyFrameOnly || pNode->isKeyFrame) && (lastFrame >= pQuery->startFrame) && (pNode->startFrame <= pQuery->endFrame))
+    {
+        float distSq = 0.0f;
+        for (int i = 0; i < 3; i++)
+        {
+            float diff = pQuery->origin[i] - pNode->origin[i];
+            distSq += diff * diff;
+        }
+        // Ties go to the earliest frame, so the result doesn't depend on how the tree was built
+        int frameIdx = std::max(pNode->startFrame, pQuery->startFrame);
+        if ((pQuery->bestFrame < 0) || (distSq < pQuery->bestDistSq) || ((distSq == pQuery->bestDistSq) && (frameIdx < pQuery->bestFrame)))
+        {
+            pQuery->bestDistSq = distSq;
+            pQuery->bestFrame = frameIdx;
+        }
+    }
+
+    // The side of the split that contains the position first, the other side only if it can be closer
+    float diff = pQuery->origin[pNode->axis] - pNode->origin[pNode->axis];
+    bool isLeftFirst = (diff < 0.0f);
+    findNearestDemoIndexNode(pNodes, isLeftFirst ? low : (mid + 1), isLeftFirst ? mid : high, pQuery);
+    if ((pQuery->bestFrame < 0) || ((diff * diff) <= pQuery->bestDistSq))
+    {
+        findNearestDemoIndexNode(pNodes, isLeftFirst ? (mid + 1) : low, isLeftFirst ? high : mid, pQuery);
+    }
+}
+
+// Frame in [startFrame, endFrame] that is closest to the origin, or -1 if there is no (key) frame in the window
+static int findNearestDemoFrame(sDemo_t *pDemo, const float *origin, bool isKeyFrameOnly, int startFrame, int endFrame)
+{
+    if (!pDemo->pIndexNodes && !buildDemoIndex(pDemo))
+    {
+        return -1;
+    }
+
+    sDemoIndexQuery_t query;
+    memcpy(query.origin, origin, sizeof(query.origin));
+    query.startFrame = startFrame;
+    query.endFrame = endFrame;
+    query.isKeyFrameOnly = isKeyFrameOnly;
+    query.bestDistSq = 0.0f;
+    query.bestFrame = -1;
+    findNearestDemoIndexNode(pDemo->pIndexNodes, 0, pDemo->nrIndexNodes, &query);
+    return query.bestFrame;
+}
+
+// Stops recording a demo and builds what is only built once all frames are known
+static void finishDemoRecording(sDemo_t *pDemo)
+{
+    pDemo->isComplete = true;
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (opencj_recorders[i].pDemo == pDemo)
+        {
+            opencj_recorders[i].pDemo = NULL;
+        }
+    }
+    if (!buildFinalPath(pDemo))
+    {
+        printf("Out of memory for the final path of demo %d\n", pDemo->id);
+    }
+    if (!buildDemoIndex(pDemo))
+    {
+        printf("Out of memory for the spatial index of demo %d, it is built again on the first query\n", pDemo->id);
+    }
+}
+
+/**************************************************************************
+ * Comparison                                                             *
+ **************************************************************************/
+
+static void freeDemoComparePath(sDemoComparePath_t *pPath)
+{
+    free(pPath->pX);
+    free(pPath->pSplitTimes);
+    memset(pPath, 0, sizeof(*pPath));
+}
+
+static void freeDemoComparison(sDemoComparison_t *pComparison)
+{
+    freeDemoComparePath(&pComparison->reference);
+    free(pComparison->pDeltas);
+    free(pComparison->pRunSplitTimes);
+    memset(pComparison, 0, sizeof(*pComparison));
+}
+
+// Copies the origins and times of the final path of a completed demo
+static bool readDemoComparePath(const sDemo_t *pDemo, bool isKeyFrameSplit, sDemoComparePath_t *pPath)
+{
+    memset(pPath, 0, sizeof(*pPath));
+    int nrPoints = pDemo->pathSize;
+    pPath->pX = (float *)malloc(4 * nrPoints * sizeof(float));
+    if (!pPath->pX)
+    {
+        return false;
+    }
+    pPath->pY = pPath->pX + nrPoints;
+    pPath->pZ = pPath->pY + nrPoints;
+    pPath->pTimes = pPath->pZ + nrPoints;
+    pPath->nrPoints = nrPoints;
+
+    int nrSplitSlots = 0;
+    sDemoDecoder_t decoder;
+    decoder.frameIdx = -1;
+    for (int rangeIdx = 0; rangeIdx < pDemo->nrPathRanges; rangeIdx++)
+    {
+        // Ranges are ordered by frame, so the frames are decoded sequentially within each range
+        const sDemoPathRange_t *pRange = &pDemo->pPathRanges[rangeIdx];
+        int startTime = getDemoFrameTime(pDemo, pRange->startFrame);
+        for (int i = 0; i < pRange->nrFrames; i++)
+        {
+            int frameIdx = pRange->startFrame + i;
+            int pos = pRange->pathStart + i;
+            const sDemoFrame_t *pFrame = pDemo->pEncoded ? decodeDemoFrame(pDemo, &decoder, frameIdx) : getDemoFrame(pDemo, frameIdx);
+            pPath->pX[pos] = pFrame->origin[0];
+            pPath->pY[pos] = pFrame->origin[1];
+            pPath->pZ[pos] = pFrame->origin[2];
+            pPath->pTimes[pos] = (float)(pRange->pathTime + getDemoFrameTime(pDemo, frameIdx) - startTime);
+
+            if (isKeyFrameSplit ? pFrame->isKeyFrame : pFrame->saveNow)
+            {
+                if (!reserveListSlot(&pPath->pSplitTimes, pPath->nrSplits, &nrSplitSlots, INITIAL_NR_SEGMENT_SLOTS))
+                {
+                    freeDemoComparePath(pPath);
+                    return false;
+                }
+                pPath->pSplitTimes[pPath->nrSplits++] = pPath->pTimes[pos];
+            }
+        }
+    }
+
+    return true;
+}
+
+// Position in [startPos, endPos) of the path that is closest to the origin, -1 if the range is empty
+static int findNearestPathPoint(const sDemoComparePath_t *pPath, const float *origin, int startPos, int endPos, float *pDistSq)
+{
+    int bestPos = -1;
+    float bestDistSq = 0.0f;
+    int pos = startPos;
+#ifdef __SSE__
+    // 4 positions at a time, each lane keeps its own closest position. Positions are exact as floats up to 2^24
+    if ((endPos - pos) >= 4)
+    {
+        __m128 originX = _mm_set1_ps(origin[0]);
+        __m128 originY = _mm_set1_ps(origin[1]);
+        __m128 originZ = _mm_set1_ps(origin[2]);
+        __m128 lanePos = _mm_setr_ps((float)pos, (float)(pos + 1), (float)(pos + 2), (float)(pos + 3));
+        __m128 laneStep = _mm_set1_ps(4.0f);
+        __m128 bestLaneDistSq = _mm_set1_ps(FLT_MAX);
+        __m128 bestLanePos = _mm_set1_ps(-1.0f);
+        for (; (pos + 4) <= endPos; pos += 4)
+        {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(pPath->pX + pos), originX);
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(pPath->pY + pos), originY);
+            __m128 dz = _mm_sub_ps(_mm_loadu_ps(pPath->pZ + pos), originZ);
+            __m128 distSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            __m128 isCloser = _mm_cmplt_ps(distSq, bestLaneDistSq);
+            bestLaneDistSq = _mm_min_ps(distSq, bestLaneDistSq);
+            bestLanePos = _mm_or_ps(_mm_and_ps(isCloser, lanePos), _mm_andnot_ps(isCloser, bestLanePos));
+            lanePos = _mm_add_ps(lanePos, laneStep);
+        }
+
+        float laneDistSq[4];
+        float laneBestPos[4];
+        _mm_storeu_ps(laneDistSq, bestLaneDistSq);
+        _mm_storeu_ps(laneBestPos, bestLanePos);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            int lanePosIdx = (int)laneBestPos[lane];
+            if ((lanePosIdx >= 0) && ((bestPos < 0) || (laneDistSq[lane] < bestDistSq) || ((laneDistSq[lane] == bestDistSq) && (lanePosIdx < bestPos))))
+            {
+                bestPos = lanePosIdx;
+                bestDistSq = laneDistSq[lane];
+            }
+        }
+    }
+#endif
+    for (; pos < endPos; pos++)
+    {
+        float dx = pPath->pX[pos] - origin[0];
+        float dy = pPath->pY[pos] - origin[1];
+        float dz = pPath->pZ[pos] - origin[2];
+        float distSq = (dx * dx) + (dy * dy) + (dz * dz);
+        if ((bestPos < 0) || (distSq < bestDistSq))
+        {
+            bestPos = pos;
+            bestDistSq = distSq;
+        }
+    }
+
+    *pDistSq = bestDistSq;
+    return bestPos;
+}
+
+// Path time at the origin, which is near the path position. The origin is projected on the steps to and from that position,
+// so the time is more precise than the time between frames. Steps longer than DEMO_COMPARE_RESYNC_DISTANCE are loads, not movement
+static float getPathTimeNear(const sDemoComparePath_t *pPath, const float *origin, int pos)
+{
+    float time = pPath->pTimes[pos];
+    float bestDistSq = FLT_MAX;
+    for (int from = ((pos > 0) ? (pos - 1) : 0); (from <= pos) && ((from + 1) < pPath->nrPoints); from++)
+    {
+        int to = from + 1;
+        float step[3] = { pPath->pX[to] - pPath->pX[from], pPath->pY[to] - pPath->pY[from], pPath->pZ[to] - pPath->pZ[from] };
+        float offset[3] = { origin[0] - pPath->pX[from], origin[1] - pPath->pY[from], origin[2] - pPath->pZ[from] };
+        float stepLengthSq = (step[0] * step[0]) + (step[1] * step[1]) + (step[2] * step[2]);
+        if ((stepLengthSq <= 0.0f) || (stepLengthSq > (DEMO_COMPARE_RESYNC_DISTANCE * DEMO_COMPARE_RESYNC_DISTANCE)))
+        {
+            continue;
+        }
+
+        float fraction = ((offset[0] * step[0]) + (offset[1] * step[1]) + (offset[2] * step[2])) / stepLengthSq;
+        fraction = (fraction < 0.0f) ? 0.0f : ((fraction > 1.0f) ? 1.0f : fraction);
+        float distSq = 0.0f;
+        for (int i = 0; i < 3; i++)
+        {
+            float diff = offset[i] - (step[i] * fraction);
+            distSq += diff * diff;
+        }
+        if (distSq < bestDistSq)
+        {
+            bestDistSq = distSq;
+            time = pPath->pTimes[from] + ((pPath->pTimes[to] - pPath->pTimes[from]) * fraction);
+        }
+    }
+    return time;
+}
+
+// Time at which the reference was at the origin. Players move forward along the path, so only a window around the last match is searched
+static float alignWithReference(sDemoComparison_t *pComparison, const float *origin)
+{
+    const sDemoComparePath_t *pPath = &pComparison->reference;
+    int startPos = (pComparison->alignedPos > DEMO_COMPARE_WINDOW_BEHIND) ? (pComparison->alignedPos - DEMO_COMPARE_WINDOW_BEHIND) : 0;
+    int endPos = pComparison->alignedPos + DEMO_COMPARE_WINDOW_AHEAD + 1;
+    endPos = (endPos < pPath->nrPoints) ? endPos : pPath->nrPoints;
+
+    float distSq = 0.0f;
+    int pos = findNearestPathPoint(pPath, origin, startPos, endPos, &distSq);
+    if ((pos < 0) || (distSq > (DEMO_COMPARE_RESYNC_DISTANCE * DEMO_COMPARE_RESYNC_DISTANCE)))
+    {
+        pos = findNearestPathPoint(pPath, origin, 0, pPath->nrPoints, &distSq);
+    }
+
+    pComparison->alignedPos = pos;
+    return getPathTimeNear(pPath, origin, pos);
+}
+
+// Time delta with the reference at every final path position of a completed run, so playback of the run only has to look it up
+static bool compareDemoRun(sDemoComparison_t *pComparison, const sDemo_t *pRun, bool isKeyFrameSplit)
+{
+    sDemoComparePath_t run;
+    if (!readDemoComparePath(pRun, isKeyFrameSplit, &run))
+    {
+        return false;
+    }
+
+    pComparison->pDeltas = (float *)malloc(run.nrPoints * sizeof(float));
+    if (!pComparison->pDeltas)
+    {
+        freeDemoComparePath(&run);
+        return false;
+    }
+
+    pComparison->alignedPos = 0;
+    for (int pos = 0; pos < run.nrPoints; pos++)
+    {
+        float origin[3] = { run.pX[pos], run.pY[pos], run.pZ[pos] };
+        pComparison->pDeltas[pos] = run.pTimes[pos] - alignWithReference(pComparison, origin);
+    }
+    pComparison->alignedPos = 0;
+    pComparison->nrDeltas = run.nrPoints;
+    pComparison->runId = pRun->id;
+
+    // Only the splits of the run are kept
+    pComparison->pRunSplitTimes = run.pSplitTimes;
+    pComparison->nrRunSplits = run.nrSplits;
+    run.pSplitTimes = NULL;
+    freeDemoComparePath(&run);
+    return true;
+}
+
+/**************************************************************************
+ * Bulk analysis                                                          *
+ **************************************************************************/
+
+static inline size_t alignColumnSize(size_t size)
+{
+    return (size + 15) & ~(size_t)15;
+}
+
+static bool buildDemoColumns(sDemo_t *pDemo)
+{
+    sDemoColumns_t *pColumns = &pDemo->columns;
+    int nrFrames = pDemo->size;
+    int nrEventWords = (nrFrames + 63) >> 6;
+    size_t floatsSize = alignColumnSize(nrFrames * sizeof(float));
+    size_t fpsSize = alignColumnSize(nrFrames * sizeof(uint16_t));
+    size_t eventsSize = nrEventWords * sizeof(uint64_t);
+    size_t size = (3 * floatsSize) + fpsSize + (DEMO_NR_EVENTS * eventsSize);
+
+    uint8_t *pData = (uint8_t *)calloc(1, size);
+    if (!pData)
+    {
+        return false;
+    }
+    pColumns->pX = (float *)pData;
+    pColumns->pY = (float *)(pData + floatsSize);
+    pColumns->pZ = (float *)(pData + (2 * floatsSize));
+    pColumns->pFps = (uint16_t *)(pData + (3 * floatsSize));
+    for (int event = 0; event < DEMO_NR_EVENTS; event++)
+    {
+        pColumns->pEvents[event] = (uint64_t *)(pData + (3 * floatsSize) + fpsSize + (event * eventsSize));
+    }
+    pColumns->nrFrames = nrFrames;
+    pColumns->size = size;
+
+    sDemoDecoder_t decoder;
+    decoder.frameIdx = -1;
+    for (int frameIdx = 0; frameIdx < nrFrames; frameIdx++)
+    {
+        const sDemoFrame_t *pFrame = pDemo->pEncoded ? decodeDemoFrame(pDemo, &decoder, frameIdx) : getDemoFrame(pDemo, frameIdx);
+        pColumns->pX[frameIdx] = pFrame->origin[0];
+        pColumns->pY[frameIdx] = pFrame->origin[1];
+        pColumns->pZ[frameIdx] = pFrame->origin[2];
+        pColumns->pFps[frameIdx] = (uint16_t)pFrame->fps;
+
+        uint64_t bit = 1ULL << (frameIdx & 63);
+        int word = frameIdx >> 6;
+        if (pFrame->saveNow) pColumns->pEvents[DEMO_EVENT_SAVE][word] |= bit;
+        if (pFrame->loadNow) pColumns->pEvents[DEMO_EVENT_LOAD][word] |= bit;
+        if (pFrame->rpgNow) pColumns->pEvents[DEMO_EVENT_RPG][word] |= bit;
+        if (pFrame->isKeyFrame) pColumns->pEvents[DEMO_EVENT_KEY_FRAME][word] |= bit;
+    }
+
+    return true;
+}
+
+static const sDemoColumns_t *getDemoColumns(sDemo_t *pDemo)
+{
+    if (!pDemo->columns.pX && ((pDemo->size == 0) || !buildDemoColumns(pDemo)))
+    {
+        return NULL;
+    }
+    return &pDemo->columns;
+}
+
+// Bits of the event bitmap word for the frames in [startFrame, endFrame]
+static inline uint64_t getEventWord(const uint64_t *pEvents, int word, int startFrame, int endFrame)
+{
+    uint64_t bits = pEvents[word];
+    if (word == (startFrame >> 6))
+    {
+        bits &= ~0ULL << (startFrame & 63);
+    }
+    if (word == (endFrame >> 6))
+    {
+        bits &= ~0ULL >> (63 - (endFrame & 63));
+    }
+    return bits;
+}
+
+static int countEventFrames(const uint64_t *pEvents, int startFrame, int endFrame)
+{
+    int nrFrames = 0;
+    for (int word = startFrame >> 6; word <= (endFrame >> 6); word++)
+    {
+        nrFrames += __builtin_popcountll(getEventWord(pEvents, word, startFrame, endFrame));
+    }
+    return nrFrames;
+}
+
+// First frame in [startFrame, endFrame] with the event, or -1
+static int findNextEventFrame(const uint64_t *pEvents, int startFrame, int endFrame)
+{
+    for (int word = startFrame >> 6; word <= (endFrame >> 6); word++)
+    {
+        uint64_t bits = getEventWord(pEvents, word, startFrame, endFrame);
+        if (bits)
+        {
+            return (word << 6) + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+// Longest horizontal step of the frames in [startFrame, endFrame), i.e. from frame x - 1 to x for x in (startFrame, endFrame)
+static float getMaxStepLengthSq(const sDemoColumns_t *pColumns, int startFrame, int endFrame, int *pFrame)
+{
+    float maxLengthSq = -1.0f;
+    int frameIdx = startFrame + 1;
+#ifdef __SSE__
+    // 4 steps at a time, each lane keeps its own longest step. Frames are exact as floats up to 2^24
+    if ((endFrame - frameIdx) >= 4)
+    {
+        __m128 laneFrame = _mm_setr_ps((float)frameIdx, (float)(frameIdx + 1), (float)(frameIdx + 2), (float)(frameIdx + 3));
+        __m128 laneStep = _mm_set1_ps(4.0f);
+        __m128 maxLaneLengthSq = _mm_set1_ps(-1.0f);
+        __m128 maxLaneFrame = _mm_set1_ps(-1.0f);
+        for (; (frameIdx + 4) <= endFrame; frameIdx += 4)
+        {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(pColumns->pX + frameIdx), _mm_loadu_ps(pColumns->pX + frameIdx - 1));
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(pColumns->pY + frameIdx), _mm_loadu_ps(pColumns->pY + frameIdx - 1));
+            __m128 lengthSq = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+            __m128 isLonger = _mm_cmpgt_ps(lengthSq, maxLaneLengthSq);
+            maxLaneLengthSq = _mm_max_ps(lengthSq, maxLaneLengthSq);
+            maxLaneFrame = _mm_or_ps(_mm_and_ps(isLonger, laneFrame), _mm_andnot_ps(isLonger, maxLaneFrame));
+            laneFrame = _mm_add_ps(laneFrame, laneStep);
+        }
+
+        float laneLengthSq[4];
+        float laneMaxFrame[4];
+        _mm_storeu_ps(laneLengthSq, maxLaneLengthSq);
+        _mm_storeu_ps(laneMaxFrame, maxLaneFrame);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            int laneFrameIdx = (int)laneMaxFrame[lane];
+            if ((laneLengthSq[lane] > maxLengthSq) || ((laneLengthSq[lane] == maxLengthSq) && (laneFrameIdx < *pFrame)))
+            {
+                maxLengthSq = laneLengthSq[lane];
+                *pFrame = laneFrameIdx;
+            }
+        }
+    }
+#endif
+    for (; frameIdx < endFrame; frameIdx++)
+    {
+        float dx = pColumns->pX[frameIdx] - pColumns->pX[frameIdx - 1];
+        float dy = pColumns->pY[frameIdx] - pColumns->pY[frameIdx - 1];
+        float lengthSq = (dx * dx) + (dy * dy);
+        if (lengthSq > maxLengthSq)
+        {
+            maxLengthSq = lengthSq;
+            *pFrame = frameIdx;
+        }
+    }
+    return maxLengthSq;
+}
+
+// Highest horizontal speed in units per second over the steps into the frames in (startFrame, endFrame]. Loads are teleports, not steps.
+// Frames are the same time apart within a time range, so the longest step of each part between loads and range starts is the fastest
+static float getMaxSpeed(const sDemo_t *pDemo, const sDemoColumns_t *pColumns, int startFrame, int endFrame, int *pFrame)
+{
+    float maxSpeed = 0.0f;
+    *pFrame = -1;
+    int frameIdx = startFrame;
+    while (frameIdx < endFrame)
+    {
+        // The steps of this part are into the frames in (frameIdx, partEnd)
+        int partEnd = endFrame + 1;
+        int loadFrame = findNextEventFrame(pColumns->pEvents[DEMO_EVENT_LOAD], frameIdx + 1, endFrame);
+        if (loadFrame > 0)
+        {
+            partEnd = loadFrame;
+        }
+        for (int i = 0; i < pDemo->nrTimeRanges; i++)
+        {
+            // The step into the first frame of a range is as long as the time between the ranges, so it is a part of its own
+            int rangeStart = pDemo->pTimeRanges[i].startFrame;
+            int rangePartEnd = (rangeStart == (frameIdx + 1)) ? (rangeStart + 1) : rangeStart;
+            if ((rangeStart >= (frameIdx + 1)) && (rangePartEnd < partEnd))
+            {
+                partEnd = rangePartEnd;
+            }
+        }
+
+        int frameTime = (partEnd > (frameIdx + 1)) ? (getDemoFrameTime(pDemo, frameIdx + 1) - getDemoFrameTime(pDemo, frameIdx)) : 0;
+        int maxFrame = -1;
+        float maxLengthSq = getMaxStepLengthSq(pColumns, frameIdx, partEnd, &maxFrame);
+        if ((frameTime > 0) && (maxFrame > 0))
+        {
+            float speed = sqrtf(maxLengthSq) * 1000.0f / (float)frameTime;
+            if (speed > maxSpeed)
+            {
+                maxSpeed = speed;
+                *pFrame = maxFrame;
+            }
+        }
+
+        // A load frame starts the next part, otherwise the last frame of this part is the first of the next part
+        frameIdx = (partEnd == loadFrame) ? partEnd : (partEnd - 1);
+    }
+    return maxSpeed;
+}
+
+typedef struct
+{
+    int fps;
+    int nrFrames;
+} sDemoFpsCount_t;
+
+static bool isFpsCountLess(const sDemoFpsCount_t &a, const sDemoFpsCount_t &b)
+{
+    return a.fps < b.fps;
+}
+
+// Index of the first frame in [frameIdx, endFrame] with a different fps than frameIdx, or endFrame + 1
+static int findFpsChange(const uint16_t *pFps, int frameIdx, int endFrame)
+{
+    uint16_t fps = pFps[frameIdx];
+    int i = frameIdx + 1;
+#ifdef __SSE2__
+    // Fps rarely changes, so 8 frames are compared at a time
+    __m128i fpsLanes = _mm_set1_epi16((short)fps);
+    for (; (i + 8) <= (endFrame + 1); i += 8)
+    {
+        int isEqualMask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(pFps + i)), fpsLanes));
+        if (isEqualMask != 0xFFFF)
+        {
+            return i + (__builtin_ctz(~isEqualMask) / 2);
+        }
+    }
+#endif
+    for (; (i <= endFrame) && (pFps[i] == fps); i++)
+    {
+    }
+    return i;
+}
+
+// Number of frames in [startFrame, endFrame] per fps, ordered by fps. Returns the number of different fps, or -1 if out of memory
+static int getFpsHistogram(const sDemoColumns_t *pColumns, int startFrame, int endFrame, sDemoFpsCount_t **ppCounts)
+{
+    sDemoFpsCount_t *pCounts = NULL;
+    int nrCounts = 0;
+    int nrCountSlots = 0;
+    for (int frameIdx = startFrame; frameIdx <= endFrame; )
+    {
+        int changeFrame = findFpsChange(pColumns->pFps, frameIdx, endFrame);
+        int fps = pColumns->pFps[frameIdx];
+        int countIdx = 0;
+        while ((countIdx < nrCounts) && (pCounts[countIdx].fps != fps))
+        {
+            countIdx++;
+        }
+        if (countIdx == nrCounts)
+        {
+            if (!reserveListSlot(&pCounts, nrCounts, &nrCountSlots, INITIAL_NR_SEGMENT_SLOTS))
+            {
+                free(pCounts);
+                return -1;
+            }
+            pCounts[nrCounts].fps = fps;
+            pCounts[nrCounts].nrFrames = 0;
+            nrCounts++;
+        }
+        pCounts[countIdx].nrFrames += changeFrame - frameIdx;
+        frameIdx = changeFrame;
+    }
+
+    std::sort(pCounts, pCounts + nrCounts, isFpsCountLess);
+    *ppCounts = pCounts;
+    return nrCounts;
+}
+
+/**************************************************************************
+ * Route simplification                                                   *
+ **************************************************************************/
+
+// Part of the route between 2 kept points, with the point in between that is furthest from the straight line between them
+typedef struct
+{
+    float distSq;
+    int startPos;
+    int endPos;
+    int furthestPos;
+} sDemoRouteSegment_t;
+
+static bool isRouteSegmentCloser(const sDemoRouteSegment_t &a, const sDemoRouteSegment_t &b)
+{
+    return a.distSq < b.distSq;
+}
+
+static void findFurthestRoutePoint(const sDemoComparePath_t *pPath, sDemoRouteSegment_t *pSegment)
+{
+    int a = pSegment->startPos;
+    int b = pSegment->endPos;
+    float line[3] = { pPath->pX[b] - pPath->pX[a], pPath->pY[b] - pPath->pY[a], pPath->pZ[b] - pPath->pZ[a] };
+    float lineLengthSq = (line[0] * line[0]) + (line[1] * line[1]) + (line[2] * line[2]);
+
+    pSegment->distSq = -1.0f;
+    pSegment->furthestPos = -1;
+    for (int pos = a + 1; pos < b; pos++)
+    {
+        float offset[3] = { pPath->pX[pos] - pPath->pX[a], pPath->pY[pos] - pPath->pY[a], pPath->pZ[pos] - pPath->pZ[a] };
+        float fraction = (lineLengthSq > 0.0f) ? (((offset[0] * line[0]) + (offset[1] * line[1]) + (offset[2] * line[2])) / lineLengthSq) : 0.0f;
+        fraction = (fraction < 0.0f) ? 0.0f : ((fraction > 1.0f) ? 1.0f : fraction);
+        float distSq = 0.0f;
+        for (int i = 0; i < 3; i++)
+        {
+            float diff = offset[i] - (line[i] * fraction);
+            distSq += diff * diff;
+        }
+        if (distSq > pSegment->distSq)
+        {
+            pSegment->distSq = distSq;
+            pSegment->furthestPos = pos;
+        }
+    }
+}
+
+// Douglas-Peucker, but the segment with the furthest point is always split first. So if maxPoints is reached before every point
+// is within the tolerance, the points that were kept are still the ones that matter most. Marks the kept points in pIsKept
+static int simplifyRoute(const sDemoComparePath_t *pPath, float tolerance, int maxPoints, uint8_t *pIsKept)
+{
+    memset(pIsKept, 0, pPath->nrPoints);
+    pIsKept[0] = 1;
+    pIsKept[pPath->nrPoints - 1] = 1;
+    int nrKept = (pPath->nrPoints > 1) ? 2 : 1;
+
+    // Every split adds at most 1 segment to the heap
+    sDemoRouteSegment_t *pHeap = (sDemoRouteSegment_t *)malloc(pPath->nrPoints * sizeof(*pHeap));
+    if (!pHeap)
+    {
+        return -1;
+    }
+    int heapSize = 0;
+    if (pPath->nrPoints > 2)
+    {
+        pHeap[0].startPos = 0;
+        pHeap[0].endPos = pPath->nrPoints - 1;
+        findFurthestRoutePoint(pPath, &pHeap[0]);
+        heapSize = 1;
+    }
+
+    float toleranceSq = tolerance * tolerance;
+    while ((heapSize > 0) && (nrKept < maxPoints))
+    {
+        std::pop_heap(pHeap, pHeap + heapSize, isRouteSegmentCloser);
+        sDemoRouteSegment_t segment = pHeap[--heapSize];
+        if (segment.distSq <= toleranceSq)
+        {
+            break;
+        }
+
+        pIsKept[segment.furthestPos] = 1;
+        nrKept++;
+
+        for (int i = 0; i < 2; i++)
+        {
+            sDemoRouteSegment_t *pPart = &pHeap[heapSize];
+            pPart->startPos = (i == 0) ? segment.startPos : segment.furthestPos;
+            pPart->endPos = (i == 0) ? segment.furthestPos : segment.endPos;
+            if ((pPart->endPos - pPart->startPos) > 1)
+            {
+                findFurthestRoutePoint(pPath, pPart);
+                std::push_heap(pHeap, pHeap + ++heapSize, isRouteSegmentCloser);
+            }
+        }
+    }
+
+    free(pHeap);
+    return nrKept;
+}
+
+/**************************************************************************
+ * Demo files                                                             *
+ **************************************************************************/
+
+static void fillDemoFileHeader(sDemoFileHeader_t *pHeader, const sDemo_t *pDemo, const sDemoEncoding_t *pEncoding)
+{
+    memset(pHeader, 0, sizeof(*pHeader));
+    pHeader->magic = DEMO_FILE_MAGIC;
+    pHeader->version = DEMO_FILE_VERSION;
+    pHeader->headerSize = sizeof(*pHeader);
+    pHeader->demoId = pDemo->id;
+    pHeader->nrFrames = pDemo->size;
+    pHeader->lastKeyFrame = pDemo->lastKeyFrame;
+    pHeader->nrAnchors = pEncoding->nrAnchors;
+    pHeader->anchorsOffset = sizeof(*pHeader);
+    pHeader->nrSegments = pDemo->nrSegments;
+    pHeader->segmentsOffset = pHeader->anchorsOffset + (pEncoding->nrAnchors * sizeof(sDemoAnchor_t));
+    pHeader->nrTimeRanges = pDemo->nrTimeRanges;
+    pHeader->timeRangesOffset = pHeader->segmentsOffset + (pDemo->nrSegments * sizeof(sDemoSegment_t));
+    pHeader->encodedOffset = pHeader->timeRangesOffset + (pDemo->nrTimeRanges * sizeof(sDemoTimeRange_t));
+    pHeader->encodedSize = pEncoding->encodedSize;
+}
+
+static bool writeDemoFile(const sDemo_t *pDemo, const sDemoEncoding_t *pEncoding, const char *path)
+{
+    sDemoFileHeader_t header;
+    fillDemoFileHeader(&header, pDemo, pEncoding);
+
+    // Write to a temporary file first, so a demo that is being played back from the same path is never seen half-written
+    char tmpPath[1024];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *pFile = fopen(tmpPath, "wb");
+    if (!pFile)
+    {
+        printf("Can't open %s for writing demo with id %d\n", tmpPath, pDemo->id);
+        return false;
+    }
+
+    bool isOk = (fwrite(&header, sizeof(header), 1, pFile) == 1);
+    isOk = isOk && (fwrite(pEncoding->pAnchors, sizeof(sDemoAnchor_t), pEncoding->nrAnchors, pFile) == (size_t)pEncoding->nrAnchors);
+    isOk = isOk && (fwrite(pDemo->pSegments, sizeof(sDemoSegment_t), pDemo->nrSegments, pFile) == (size_t)pDemo->nrSegments);
+    isOk = isOk && (fwrite(pDemo->pTimeRanges, sizeof(sDemoTimeRange_t), pDemo->nrTimeRanges, pFile) == (size_t)pDemo->nrTimeRanges);
+    isOk = isOk && (fwrite(pEncoding->pEncoded, 1, pEncoding->encodedSize, pFile) == (size_t)pEncoding->encodedSize);
+    isOk = (fclose(pFile) == 0) && isOk;
+    if (!isOk || (rename(tmpPath, path) != 0))
+    {
+        printf("Failed to write demo with id %d to %s\n", pDemo->id, path);
+        unlink(tmpPath);
+        return false;
+    }
+
+    printf("Saved demo with id %d to %s\n", pDemo->id, path);
+    return true;
+}
+
+static bool saveDemoToFile(const sDemo_t *pDemo, const char *path)
+{
+    if (!pDemo->pEncoded)
+    {
+        printf("Demo with id %d is not complete, can't save it\n", pDemo->id);
+        return false;
+    }
+
+    sDemoEncoding_t encoding = {pDemo->pEncoded, pDemo->encodedSize, pDemo->pAnchors, pDemo->nrAnchors};
+    return writeDemoFile(pDemo, &encoding, path);
+}
+
+// Time ranges of a demo file, version 3 files have none
+static const sDemoTimeRange_t *getDemoFileTimeRanges(const sDemoFileHeader_t *pHeader, int *pNrTimeRanges)
+{
+    *pNrTimeRanges = (pHeader->version >= 4) ? pHeader->nrTimeRanges : 0;
+    return (const sDemoTimeRange_t *)((const uint8_t *)pHeader + ((pHeader->version >= 4) ? pHeader->timeRangesOffset : 0));
+}
+
+static bool isValidDemoFile(const sDemoFileHeader_t *pHeader, size_t fileSize)
+{
+    if ((fileSize < DEMO_FILE_V3_HEADER_SIZE) || (pHeader->magic != DEMO_FILE_MAGIC))
+    {
+        printf("Not a demo file\n");
+        return false;
+    }
+
+    size_t minHeaderSize = (pHeader->version >= 4) ? sizeof(*pHeader) : DEMO_FILE_V3_HEADER_SIZE;
+    if ((pHeader->version < DEMO_FILE_MIN_VERSION) || (pHeader->version > DEMO_FILE_VERSION) || (pHeader->headerSize < minHeaderSize) || (fileSize < pHeader->headerSize))
+    {
+        printf("Unsupported demo file version %d\n", pHeader->version);
+        return false;
+    }
+
+    if ((pHeader->nrFrames <= 0) || (pHeader->nrAnchors != ((pHeader->nrFrames + DEMO_FRAMES_PER_ANCHOR - 1) >> DEMO_FRAMES_PER_ANCHOR_SHIFT))
+        || (pHeader->lastKeyFrame < 0) || (pHeader->lastKeyFrame >= pHeader->nrFrames) || (pHeader->anchorsOffset % 8))
+    {
+        printf("Demo file has an invalid number of frames\n");
+        return false;
+    }
+
+    uint64_t anchorsEnd = (uint64_t)pHeader->anchorsOffset + ((uint64_t)pHeader->nrAnchors * sizeof(sDemoAnchor_t));
+    uint64_t segmentsEnd = (uint64_t)pHeader->segmentsOffset + ((uint64_t)pHeader->nrSegments * sizeof(sDemoSegment_t));
+    int nrTimeRanges = 0;
+    const sDemoTimeRange_t *pTimeRanges = getDemoFileTimeRanges(pHeader, &nrTimeRanges);
+    uint64_t timeRangesStart = (nrTimeRanges > 0) ? (uint64_t)pHeader->timeRangesOffset : segmentsEnd;
+    uint64_t timeRangesEnd = timeRangesStart + ((uint64_t)nrTimeRanges * sizeof(sDemoTimeRange_t));
+    uint64_t encodedEnd = (uint64_t)pHeader->encodedOffset + pHeader->encodedSize;
+    if ((pHeader->anchorsOffset < pHeader->headerSize) || (anchorsEnd > fileSize) || (pHeader->segmentsOffset < anchorsEnd) || (pHeader->nrSegments < 0)
+        || (segmentsEnd > fileSize) || (nrTimeRanges < 0) || (timeRangesStart < segmentsEnd) || (timeRangesStart % 4) || (timeRangesEnd > fileSize)
+        || (pHeader->encodedOffset < timeRangesEnd) || (encodedEnd > fileSize))
+    {
+        printf("Demo file is truncated\n");
+        return false;
+    }
+
+    // Frame times start at 0 and never go backwards
+    for (int i = 0; i < nrTimeRanges; i++)
+    {
+        const sDemoTimeRange_t *pRange = &pTimeRanges[i];
+        bool isValidStart = (i == 0) ? ((pRange->startFrame == 0) && (pRange->startTime == 0))
+                                     : ((pRange->startFrame > pTimeRanges[i - 1].startFrame)
+                                        && (pRange->startTime >= ((int64_t)pTimeRanges[i - 1].startTime + ((int64_t)(pRange->startFrame - 1 - pTimeRanges[i - 1].startFrame) * pTimeRanges[i - 1].frameTime))));
+        if (!isValidStart || (pRange->startFrame >= pHeader->nrFrames) || (pRange->frameTime < 0)
+            || (((int64_t)pRange->startTime + ((int64_t)pHeader->nrFrames * pRange->frameTime)) > INT32_MAX))
+        {
+            printf("Demo file has an invalid time range %d\n", i);
+            return false;
+        }
+    }
+
+    // Key frame lookups rely on the ranks being consistent with the masks
+    const sDemoAnchor_t *pAnchors = (const sDemoAnchor_t *)((const uint8_t *)pHeader + pHeader->anchorsOffset);
+    int nrKeyFrames = 0;
+    for (int i = 0; i < pHeader->nrAnchors; i++)
+    {
+        if ((pAnchors[i].offset < 0) || ((uint32_t)pAnchors[i].offset >= pHeader->encodedSize) || (pAnchors[i].keyFrameRank != nrKeyFrames))
+        {
+            printf("Demo file has an invalid anchor %d\n", i);
+            return false;
+        }
+        nrKeyFrames += __builtin_popcountll(pAnchors[i].keyFrameMask);
+    }
+
+    // Segments should follow each other and only branch off earlier segments
+    const sDemoSegment_t *pSegments = (const sDemoSegment_t *)((const uint8_t *)pHeader + pHeader->segmentsOffset);
+    for (int i = 0; i < pHeader->nrSegments; i++)
+    {
+        const sDemoSegment_t *pSegment = &pSegments[i];
+        int expectedStart = (i > 0) ? pSegments[i - 1].endFrame : 0;
+        bool isValidParent = (i == 0) ? ((pSegment->parent == -1) && (pSegment->branchFrame == -1))
+                                      : ((pSegment->parent >= 0) && (pSegment->parent < i) && (pSegment->branchFrame >= pSegments[pSegment->parent].startFrame)
+                                         && (pSegment->branchFrame < pSegments[pSegment->parent].endFrame));
+        if ((pSegment->startFrame != expectedStart) || (pSegment->endFrame <= pSegment->startFrame) || (pSegment->endFrame > pHeader->nrFrames) || !isValidParent)
+        {
+            printf("Demo file has an invalid segment %d\n", i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Maps a demo file and validates it. Returns its header, which is at the start of the mapping
+static const sDemoFileHeader_t *mapDemoFile(const char *path, void **ppMapping, size_t *pMappingSize)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Can't open demo file %s\n", path);
+        return NULL;
+    }
+
+    struct stat st;
+    void *pMapping = MAP_FAILED;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+    {
+        // Frames are paged in by the kernel once they are played back
+        pMapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (pMapping == MAP_FAILED)
+    {
+        printf("Can't map demo file %s\n", path);
+        return NULL;
+    }
+
+    const sDemoFileHeader_t *pHeader = (const sDemoFileHeader_t *)pMapping;
+    if (!isValidDemoFile(pHeader, st.st_size))
+    {
+        munmap(pMapping, st.st_size);
+        return NULL;
+    }
+
+    *ppMapping = pMapping;
+    *pMappingSize = st.st_size;
+    return pHeader;
+}
+
+static void getMappedDemoEncoding(const sDemoFileHeader_t *pHeader, sDemoEncoding_t *pEncoding)
+{
+    uint8_t *pMapping = (uint8_t *)pHeader;
+    pEncoding->pEncoded = pMapping + pHeader->encodedOffset;
+    pEncoding->encodedSize = pHeader->encodedSize;
+    pEncoding->pAnchors = (sDemoAnchor_t *)(pMapping + pHeader->anchorsOffset);
+    pEncoding->nrAnchors = pHeader->nrAnchors;
+}
+
+// Gives the contents of a mapped demo file to the demo
+static void setDemoFileContents(sDemo_t *pDemo, const sDemoFileHeader_t *pHeader, void *pMapping, size_t mappingSize)
+{
+    pDemo->isComplete = true;
+    pDemo->isFirstFrameFilled = true;
+    pDemo->size = pHeader->nrFrames;
+    pDemo->currentFrame = pHeader->nrFrames - 1;
+    pDemo->lastKeyFrame = pHeader->lastKeyFrame;
+
+    // Segments are small, copy them so they are owned by the demo the same way as for recorded demos
+    if (pHeader->nrSegments > 0)
+    {
+        pDemo->pSegments = (sDemoSegment_t *)malloc(pHeader->nrSegments * sizeof(sDemoSegment_t));
+        if (pDemo->pSegments)
+        {
+            memcpy(pDemo->pSegments, (uint8_t *)pMapping + pHeader->segmentsOffset, pHeader->nrSegments * sizeof(sDemoSegment_t));
+            pDemo->nrSegments = pHeader->nrSegments;
+            pDemo->nrSegmentSlots = pHeader->nrSegments;
+        }
+    }
+
+    int nrTimeRanges = 0;
+    const sDemoTimeRange_t *pTimeRanges = getDemoFileTimeRanges(pHeader, &nrTimeRanges);
+    if (nrTimeRanges > 0)
+    {
+        pDemo->pTimeRanges = (sDemoTimeRange_t *)malloc(nrTimeRanges * sizeof(sDemoTimeRange_t));
+        if (pDemo->pTimeRanges)
+        {
+            memcpy(pDemo->pTimeRanges, pTimeRanges, nrTimeRanges * sizeof(sDemoTimeRange_t));
+            pDemo->nrTimeRanges = nrTimeRanges;
+            pDemo->nrTimeRangeSlots = nrTimeRanges;
+        }
+    }
+    pDemo->lastFrameTime = getDemoFrameTime(pDemo, pDemo->size - 1);
+    buildFinalPath(pDemo);
+
+    sDemoEncoding_t encoding;
+    getMappedDemoEncoding(pHeader, &encoding);
+    setDemoEncoding(pDemo, &encoding, pMapping, mappingSize);
+}
+
+static sDemo_t *loadDemoFromFile(int demoId, const char *path)
+{
+    void *pMapping = NULL;
+    size_t mappingSize = 0;
+    const sDemoFileHeader_t *pHeader = mapDemoFile(path, &pMapping, &mappingSize);
+    sDemo_t *pDemo = NULL;
+    if (pHeader)
+    {
+        pDemo = createDemo(demoId);
+    }
+    if (!pDemo)
+    {
+        printf("Can't load demo file %s\n", path);
+        if (pMapping)
+        {
+            munmap(pMapping, mappingSize);
+        }
+        return NULL;
+    }
+
+    setDemoFileContents(pDemo, pHeader, pMapping, mappingSize);
+    printf("Loaded demo with id %d from %s (%d frames)\n", demoId, path, pDemo->size);
+    return pDemo;
+}
+
+/**************************************************************************
+ * Residency                                                              *
+ **************************************************************************/
+
+static size_t getDemoMemoryUsage(const sDemo_t *pDemo)
+{
+    size_t size = ((size_t)pDemo->nrBlocks * sizeof(sDemoFrameBlock_t)) + ((size_t)pDemo->nrBlockSlots * sizeof(sDemoFrameBlock_t *));
+    size += ((size_t)pDemo->nrKeyFrameSlots + pDemo->nrSaveFrameSlots) * sizeof(int);
+    size += ((size_t)pDemo->nrSegmentSlots * sizeof(sDemoSegment_t)) + ((size_t)pDemo->nrPathRanges * sizeof(sDemoPathRange_t));
+    size += (size_t)pDemo->nrTimeRangeSlots * sizeof(sDemoTimeRange_t);
+    size += (size_t)pDemo->nrRepeatRunSlots * sizeof(sDemoRepeatRun_t);
+    size += (size_t)pDemo->nrIndexNodes * sizeof(sDemoIndexNode_t);
+    size += pDemo->columns.size;
+    if (pDemo->pMapping)
+    {
+        size += pDemo->mappingSize; // Page cache rather than heap, but it is what playback keeps resident
+    }
+    else
+    {
+        size += (size_t)pDemo->encodedSize + ((size_t)pDemo->nrAnchors * sizeof(sDemoAnchor_t));
+    }
+    return size;
+}
+
+static bool isDemoInUseByPlayer(const sDemo_t *pDemo)
+{
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        if ((opencj_playback[i].pDemo == pDemo) || (opencj_recorders[i].pDemo == pDemo))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves the frames of a completed demo to its spill file and releases them
+static bool spillDemo(sDemo_t *pDemo)
+{
+    char spillPath[1024];
+    getDemoSpillPath(pDemo->id, spillPath, sizeof(spillPath));
+    if (!saveDemoToFile(pDemo, spillPath))
+    {
+        return false;
+    }
+
+    releaseDemoData(pDemo);
+    pDemo->isSpilled = true;
+    printf("Spilled demo with id %d to %s\n", pDemo->id, spillPath);
+    return true;
+}
+
+static bool reloadDemo(sDemo_t *pDemo)
+{
+    char spillPath[1024];
+    getDemoSpillPath(pDemo->id, spillPath, sizeof(spillPath));
+
+    void *pMapping = NULL;
+    size_t mappingSize = 0;
+    const sDemoFileHeader_t *pHeader = mapDemoFile(spillPath, &pMapping, &mappingSize);
+    if (!pHeader || (pHeader->demoId != pDemo->id) || (pHeader->nrFrames != pDemo->size))
+    {
+        printf("Can't reload demo with id %d from %s\n", pDemo->id, spillPath);
+        if (pMapping)
+        {
+            munmap(pMapping, mappingSize);
+        }
+        return false;
+    }
+
+    // The mapping keeps the file contents, so the file itself is not needed anymore. It is written again if the demo is spilled again
+    setDemoFileContents(pDemo, pHeader, pMapping, mappingSize);
+    pDemo->isSpilled = false;
+    unlink(spillPath);
+    return true;
+}
+
+// Spills the least recently used demos until all demos fit in the memory budget. pKeep is never spilled
+static void enforceDemoMemoryBudget(const sDemo_t *pKeep)
+{
+    if ((opencj_demoMemoryBudget == 0) || !opencj_demos)
+    {
+        return;
+    }
+
+    size_t totalSize = 0;
+    for (int i = 0; i < opencj_maxNrDemos; i++)
+    {
+        totalSize += getDemoMemoryUsage(&opencj_demos[i]);
+    }
+
+    while (totalSize > opencj_demoMemoryBudget)
+    {
+        // Only completed demos that no player is watching can be spilled
+        sDemo_t *pOldest = NULL;
+        uint32_t oldestAge = 0;
+        for (int i = 0; i < opencj_maxNrDemos; i++)
+        {
+            sDemo_t *pDemo = &opencj_demos[i];
+            if ((pDemo->id <= 0) || (pDemo == pKeep) || !pDemo->pEncoded || pDemo->isSpilled || pDemo->isBeingPersisted)
+            {
+                continue;
+            }
+
+            uint32_t age = opencj_demoUseCounter - pDemo->lastUsed;
+            if ((!pOldest || (age > oldestAge)) && !isDemoInUseByPlayer(pDemo))
+            {
+                pOldest = pDemo;
+                oldestAge = age;
+            }
+        }
+
+        size_t size = pOldest ? getDemoMemoryUsage(pOldest) : 0;
+        if (!pOldest || !spillDemo(pOldest))
+        {
+            printf("Demos use %zu bytes, which is over the budget of %zu bytes, but no demo can be spilled\n", totalSize, opencj_demoMemoryBudget);
+            return;
+        }
+        totalSize -= size;
+    }
+}
+
+// Finds a demo for script, which makes it the most recently used demo and loads it again if it was spilled
+static sDemo_t *useDemoById(int demoId)
+{
+    sDemo_t *pDemo = findDemoById(demoId);
+    if (!pDemo)
+    {
+        return NULL;
+    }
+
+    pDemo->lastUsed = ++opencj_demoUseCounter;
+    if (pDemo->isSpilled)
+    {
+        if (!reloadDemo(pDemo))
+        {
+            return NULL;
+        }
+        enforceDemoMemoryBudget(pDemo);
+    }
+
+    return pDemo;
+}
+
+/**************************************************************************
+ * Background writer                                                      *
+ **************************************************************************/
+
+static bool isValidTableName(const char *name)
+{
+    if (!name[0])
+    {
+        return false;
+    }
+
+    for (const char *p = name; *p; p++)
+    {
+        if (!(((*p >= 'a') && (*p <= 'z')) || ((*p >= 'A') && (*p <= 'Z')) || ((*p >= '0') && (*p <= '9')) || (*p == '_')))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Builds the queries that store the demo file in chunks: (demoId, chunkIdx, data), with (demoId, chunkIdx) as primary key.
+// Chunks replace the chunks of an earlier save of the demo, and the last query deletes the chunks that an earlier save had beyond these.
+// The queries may run in any order
+static bool buildDemoPersistQueries(sDemoPersistJob_t *pJob, const sDemoEncoding_t *pEncoding)
+{
+    sDemoFileHeader_t header;
+    fillDemoFileHeader(&header, pJob->pDemo, pEncoding);
+    size_t fileSize = header.encodedOffset + header.encodedSize;
+    uint8_t *pFile = (uint8_t *)malloc(fileSize);
+    int nrChunks = (int)((fileSize + DEMO_PERSIST_MYSQL_CHUNK_SIZE - 1) / DEMO_PERSIST_MYSQL_CHUNK_SIZE);
+    int nrQueries = nrChunks + 1;
+    char **ppQueries = (char **)calloc(nrQueries, sizeof(*ppQueries));
+    if (!pFile || !ppQueries)
+    {
+        free(pFile);
+        free(ppQueries);
+        return false;
+    }
+
+    memcpy(pFile, &header, sizeof(header));
+    memcpy(pFile + header.anchorsOffset, pEncoding->pAnchors, pEncoding->nrAnchors * sizeof(sDemoAnchor_t));
+    memcpy(pFile + header.segmentsOffset, pJob->pDemo->pSegments, pJob->pDemo->nrSegments * sizeof(sDemoSegment_t));
+    memcpy(pFile + header.timeRangesOffset, pJob->pDemo->pTimeRanges, pJob->pDemo->nrTimeRanges * sizeof(sDemoTimeRange_t));
+    memcpy(pFile + header.encodedOffset, pEncoding->pEncoded, pEncoding->encodedSize);
+
+    static const char hexDigits[] = "0123456789abcdef";
+    bool isOk = true;
+    for (int chunkIdx = 0; isOk && (chunkIdx < nrChunks); chunkIdx++)
+    {
+        size_t chunkStart = (size_t)chunkIdx * DEMO_PERSIST_MYSQL_CHUNK_SIZE;
+        size_t chunkSize = ((fileSize - chunkStart) < DEMO_PERSIST_MYSQL_CHUNK_SIZE) ? (fileSize - chunkStart) : DEMO_PERSIST_MYSQL_CHUNK_SIZE;
+        size_t querySize = strlen(pJob->destination) + (chunkSize * 2) + 128;
+        char *query = (char *)malloc(querySize);
+        if (!query)
+        {
+            isOk = false;
+            break;
+        }
+
+        int length = snprintf(query, querySize, "REPLACE INTO %s (demoId, chunkIdx, data) VALUES (%d, %d, 0x", pJob->destination, pJob->demoId, chunkIdx);
+        for (size_t i = 0; i < chunkSize; i++)
+        {
+            query[length++] = hexDigits[pFile[chunkStart + i] >> 4];
+            query[length++] = hexDigits[pFile[chunkStart + i] & 0xF];
+        }
+        strcpy(&query[length], ")");
+        ppQueries[chunkIdx] = query;
+    }
+    free(pFile);
+
+    size_t querySize = strlen(pJob->destination) + 128;
+    char *query = isOk ? (char *)malloc(querySize) : NULL;
+    if (query)
+    {
+        snprintf(query, querySize, "DELETE FROM %s WHERE demoId = %d AND chunkIdx >= %d", pJob->destination, pJob->demoId, nrChunks);
+        ppQueries[nrChunks] = query;
+    }
+    isOk = isOk && query;
+
+    pJob->ppQueries = ppQueries;
+    pJob->nrQueries = nrQueries;
+    return isOk;
+}
+
+static void freeDemoPersistJob(sDemoPersistJob_t *pJob)
+{
+    if (pJob->isEncodedByWriter)
+    {
+        freeDemoEncoding(&pJob->encoding);
+    }
+    for (int i = 0; i < pJob->nrQueries; i++)
+    {
+        free(pJob->ppQueries[i]);
+    }
+    free(pJob->ppQueries);
+    free(pJob->pQueryIds);
+    delete pJob;
+}
+
+static void runDemoPersistJob(sDemoPersistJob_t *pJob)
+{
+    const sDemo_t *pDemo = pJob->pDemo;
+    if (pDemo->pEncoded)
+    {
+        // Already encoded (for example loaded from a file), the encoding does not change while the demo is being persisted
+        pJob->encoding.pEncoded = pDemo->pEncoded;
+        pJob->encoding.encodedSize = pDemo->encodedSize;
+        pJob->encoding.pAnchors = pDemo->pAnchors;
+        pJob->encoding.nrAnchors = pDemo->nrAnchors;
+    }
+    else if (encodeDemoFrames(pDemo, &pJob->encoding))
+    {
+        pJob->isEncodedByWriter = true;
+    }
+    else
+    {
+        printf("Demo with id %d could not be encoded for persisting\n", pJob->demoId);
+        return;
+    }
+
+    if (pJob->target == DEMO_PERSIST_FILE)
+    {
+        pJob->isOk = writeDemoFile(pDemo, &pJob->encoding, pJob->destination);
+    }
+    else
+    {
+        pJob->isOk = buildDemoPersistQueries(pJob, &pJob->encoding);
+    }
+}
+
+static void *demoPersistWriter(void *pArg)
+{
+    pthread_mutex_lock(&opencj_persistLock);
+    while (true)
+    {
+        while (!opencj_pendingPersistJobs)
+        {
+            pthread_cond_wait(&opencj_persistWakeup, &opencj_persistLock);
+        }
+
+        sDemoPersistJob_t *pJob = opencj_pendingPersistJobs;
+        opencj_pendingPersistJobs = pJob->pNext;
+        pthread_mutex_unlock(&opencj_persistLock);
+
+        runDemoPersistJob(pJob);
+
+        pthread_mutex_lock(&opencj_persistLock);
+        sDemoPersistJob_t **ppLast = &opencj_donePersistJobs;
+        while (*ppLast)
+        {
+            ppLast = &(*ppLast)->pNext;
+        }
+        pJob->pNext = NULL;
+        *ppLast = pJob;
+    }
+
+    return NULL;
+}
+
+// Hands the (complete) demo to the writer thread. Game thread only
+static bool queueDemoPersistJob(sDemo_t *pDemo, eDemoPersistTarget_t target, const char *destination)
+{
+    if (pDemo->isBeingPersisted)
+    {
+        printf("Demo with id %d is already being persisted\n", pDemo->id);
+        return false;
+    }
+
+    sDemoPersistJob_t *pJob = new (std::nothrow) sDemoPersistJob_t();
+    if (!pJob)
+    {
+        return false;
+    }
+    pJob->pDemo = pDemo;
+    pJob->demoId = pDemo->id;
+    pJob->target = target;
+    snprintf(pJob->destination, sizeof(pJob->destination), "%s", destination);
+
+    pthread_mutex_lock(&opencj_persistLock);
+    if (!opencj_isPersistWriterStarted)
+    {
+        pthread_t writer;
+        if (pthread_create(&writer, NULL, demoPersistWriter, NULL) != 0)
+        {
+            pthread_mutex_unlock(&opencj_persistLock);
+            printf("Could not start the demo writer thread\n");
+            delete pJob;
+            return false;
+        }
+        pthread_detach(writer);
+        opencj_isPersistWriterStarted = true;
+    }
+
+    sDemoPersistJob_t **ppLast = &opencj_pendingPersistJobs;
+    while (*ppLast)
+    {
+        ppLast = &(*ppLast)->pNext;
+    }
+    *ppLast = pJob;
+    pDemo->isBeingPersisted = true;
+    pthread_cond_signal(&opencj_persistWakeup);
+    pthread_mutex_unlock(&opencj_persistLock);
+
+    return true;
+}
+
+// Hands the queries of a MySQL job over to the async queries, which take over the query buffers. Game thread only
+static bool queueDemoPersistQueries(sDemoPersistJob_t *pJob)
+{
+    pJob->pQueryIds = (int *)calloc(pJob->nrQueries + 1, sizeof(int)); // + 1 for the clean up
+    if (!pJob->pQueryIds)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < pJob->nrQueries; i++)
+    {
+        pJob->pQueryIds[pJob->nrQueryIds++] = mysql_async_queue_query(pJob->ppQueries[i], false);
+        pJob->ppQueries[i] = NULL;
+    }
+    return true;
+}
+
+// Takes the results of the queries of a job, returns whether all are done. Game thread only
+static bool pollDemoPersistQueries(sDemoPersistJob_t *pJob)
+{
+    while (pJob->nrQueriesDone < pJob->nrQueryIds)
+    {
+        // A query that is not found anymore was taken by script, so it's unknown whether it succeeded
+        int status = mysql_async_take_status(pJob->pQueryIds[pJob->nrQueriesDone]);
+        if (status == 0)
+        {
+            return false;
+        }
+        if ((status != 1) && !pJob->isCleanupQueued)
+        {
+            printf("Query %d of %d to persist demo with id %d failed\n", pJob->nrQueriesDone + 1, pJob->nrQueries, pJob->demoId);
+            pJob->isOk = false;
+        }
+        pJob->nrQueriesDone++;
+    }
+
+    // Rows of a demo that could not be stored completely would be read back as a broken demo
+    if (!pJob->isOk && (pJob->nrQueryIds > 0) && !pJob->isCleanupQueued)
+    {
+        pJob->isCleanupQueued = true;
+        char *query = (char *)malloc(strlen(pJob->destination) + 64);
+        if (query)
+        {
+            sprintf(query, "DELETE FROM %s WHERE demoId = %d", pJob->destination, pJob->demoId);
+            pJob->pQueryIds[pJob->nrQueryIds++] = mysql_async_queue_query(query, false);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Finishes a job of the writer thread. Returns whether the demo was persisted. Game thread only
+static bool finishDemoPersistJob(sDemoPersistJob_t *pJob)
+{
+    sDemo_t *pDemo = pJob->pDemo;
+    pDemo->isBeingPersisted = false;
+
+    if (pDemo->isClearPending)
+    {
+        releaseDemo(pDemo);
+    }
+    else if (pJob->isEncodedByWriter)
+    {
+        // A demo file is only read back by playback, so play it from the page cache rather than keeping a copy in memory
+        void *pMapping = NULL;
+        size_t mappingSize = 0;
+        const sDemoFileHeader_t *pHeader = NULL;
+        if (pJob->isOk && (pJob->target == DEMO_PERSIST_FILE))
+        {
+            pHeader = mapDemoFile(pJob->destination, &pMapping, &mappingSize);
+        }
+
+        if (pHeader && (pHeader->nrFrames == pDemo->size))
+        {
+            sDemoEncoding_t encoding;
+            getMappedDemoEncoding(pHeader, &encoding);
+            setDemoEncoding(pDemo, &encoding, pMapping, mappingSize);
+        }
+        else
+        {
+            if (pMapping)
+            {
+                munmap(pMapping, mappingSize);
+            }
+            setDemoEncoding(pDemo, &pJob->encoding, NULL, 0);
+            pJob->isEncodedByWriter = false; // Owned by the demo now
+        }
+        enforceDemoMemoryBudget(NULL);
+    }
+
+    return pJob->isOk;
+}
+
+/**************************************************************************
+ * Helper functions                                                       *
+ **************************************************************************/
+
+static bool Base_Gsc_IsValidClientNum(int clientNum)
+{
+    if ((clientNum < 0) || (clientNum >= MAX_CLIENTS))
+    {
+        stackError("clientNum %d out of range", clientNum);
+        return true;
+    }
+
+    return false;
+}
+
+static bool Base_Gsc_GetValidDemoId(int *pDemoId, int nrArgsExpected)
+{
+    if (!pDemoId) return false;
+
+    int nrReceivedArgs = Scr_GetNumParam();
+    if (nrReceivedArgs != nrArgsExpected)
+    {
+        stackError("Expected %d arguments, but got %d", nrArgsExpected, nrReceivedArgs);
+        stackPushUndefined();
+        return false;
+    }
+
+    int demoId = -1;
+    if (stackGetParamType(0) != STACK_INT)
+    {
+        stackError("Argument 1 (demoId) is not an int");
+        stackPushUndefined();
+        return false;
+    }
+    stackGetParamInt(0, &demoId);
+
+    if (demoId <= 0)
+    {
+        stackError("Argument 1 (demoId) is not > 0");
+        stackPushUndefined();
+        return false;
+    }
+
+    *pDemoId = demoId;
+    return true;
+}
+
+// For the bulk analysis functions: demoId, the fixed arguments, then optionally a frame window. The window defaults to the whole demo
+static sDemo_t *Base_Gsc_GetAnalysisDemo(int nrFixedArgs, const char *usage, int *pStartFrame, int *pEndFrame)
+{
+    int nrArgs = Scr_GetNumParam();
+    if ((nrArgs != nrFixedArgs) && (nrArgs != (nrFixedArgs + 2)))
+    {
+        stackError("%s", usage);
+        stackPushUndefined();
+        return NULL;
+    }
+
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, nrArgs)) return NULL;
+
+    int startFrame = 0;
+    int endFrame = INT_MAX;
+    if (nrArgs > nrFixedArgs)
+    {
+        if ((stackGetParamType(nrFixedArgs) != STACK_INT) || (stackGetParamType(nrFixedArgs + 1) != STACK_INT))
+        {
+            stackError("Argument %d (startFrame) and %d (endFrame) should be ints", nrFixedArgs + 1, nrFixedArgs + 2);
+            stackPushUndefined();
+            return NULL;
+        }
+        stackGetParamInt(nrFixedArgs, &startFrame);
+        stackGetParamInt(nrFixedArgs + 1, &endFrame);
+    }
+
+    sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo || !pDemo->isComplete || (pDemo->size == 0) || (startFrame < 0) || (startFrame > endFrame) || (startFrame >= pDemo->size))
+    {
+        stackPushUndefined();
+        return NULL;
+    }
+
+    *pStartFrame = startFrame;
+    *pEndFrame = (endFrame < pDemo->size) ? endFrame : (pDemo->size - 1);
+    return pDemo;
+}
+
+static bool Base_Gsc_GetDemoEvent(int argIdx, eDemoEvent_t *pEvent)
+{
+    static const char *eventNames[DEMO_NR_EVENTS] = { "save", "load", "rpg", "keyframe" };
+
+    const char *name = NULL;
+    if (stackGetParamType(argIdx) == STACK_STRING)
+    {
+        stackGetParamString(argIdx, &name);
+        for (int event = 0; event < DEMO_NR_EVENTS; event++)
+        {
+            if (!strcmp(name, eventNames[event]))
+            {
+                *pEvent = (eDemoEvent_t)event;
+                return true;
+            }
+        }
+    }
+
+    stackError("Argument %d (event) should be \"save\", \"load\", \"rpg\" or \"keyframe\"", argIdx + 1);
+    stackPushUndefined();
+    return false;
+}
+
+static int getLastPlaybackPos(const sDemoPlayback_t *pPlayback)
+{
+    return (pPlayback->isFinalPathOnly ? pPlayback->pDemo->pathSize : pPlayback->pDemo->size) - 1;
+}
+
+// Time of a playback position in ms. On the final path the time spent in abandoned segments is left out
+static float getPlaybackPosTime(const sDemoPlayback_t *pPlayback, int pos)
+{
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pPlayback->isFinalPathOnly)
+    {
+        return (float)getDemoFrameTime(pDemo, pos);
+    }
+
+    return (float)getPathPosTime(pDemo, pos);
+}
+
+// Last playback position at or before the time
+static int getPlaybackPosAtTime(const sDemoPlayback_t *pPlayback, float time)
+{
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pPlayback->isFinalPathOnly)
+    {
+        return getDemoFrameAtTime(pDemo, time);
+    }
+
+    int low = 0;
+    int high = pDemo->nrPathRanges - 1;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if (pDemo->pPathRanges[mid].pathTime <= time)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+
+    const sDemoPathRange_t *pRange = &pDemo->pPathRanges[low];
+    int frameIdx = getDemoFrameAtTime(pDemo, time - pRange->pathTime + getDemoFrameTime(pDemo, pRange->startFrame));
+    int lastFrame = pRange->startFrame + pRange->nrFrames - 1;
+    frameIdx = (frameIdx < pRange->startFrame) ? pRange->startFrame : ((frameIdx > lastFrame) ? lastFrame : frameIdx);
+    return pRange->pathStart + (frameIdx - pRange->startFrame);
+}
+
+// Selects the frame at the time and remembers how far the time is towards the next frame. Returns the new playback position
+static int seekPlaybackTime(sDemoPlayback_t *pPlayback, float time)
+{
+    int lastPos = getLastPlaybackPos(pPlayback);
+    float endTime = getPlaybackPosTime(pPlayback, lastPos);
+    time = (time < 0.0f) ? 0.0f : ((time > endTime) ? endTime : time);
+
+    int pos = getPlaybackPosAtTime(pPlayback, time);
+    if (pPlayback->isFinalPathOnly)
+    {
+        pPlayback->selectedPathPos = pos;
+        pPlayback->selectedFrame = getPathFrame(pPlayback->pDemo, pos);
+    }
+    else
+    {
+        pPlayback->selectedFrame = pos;
+    }
+
+    pPlayback->time = time;
+    pPlayback->lerpFraction = 0.0f;
+    if (pos < lastPos)
+    {
+        float posTime = getPlaybackPosTime(pPlayback, pos);
+        float nextPosTime = getPlaybackPosTime(pPlayback, pos + 1);
+        if (nextPosTime > posTime)
+        {
+            pPlayback->lerpFraction = (time - posTime) / (nextPosTime - posTime);
+        }
+    }
+
+    return pos;
+}
+
+static float lerpAngle(float from, float to, float fraction)
+{
+    float delta = fmodf(to - from, 360.0f);
+    if (delta > 180.0f)
+    {
+        delta -= 360.0f;
+    }
+    else if (delta < -180.0f)
+    {
+        delta += 360.0f;
+    }
+    return from + (delta * fraction);
+}
+
+// Origin and angles at the playback time, in between the selected frame and the next frame
+static void getInterpolatedPlaybackFrame(sDemoPlayback_t *pPlayback, float *origin, float *angles)
+{
+    const sDemoFrame_t *pDemoFrame = getPlaybackFrame(pPlayback);
+    memcpy(origin, pDemoFrame->origin, sizeof(pDemoFrame->origin));
+    memcpy(angles, pDemoFrame->angles, sizeof(pDemoFrame->angles));
+    if (pPlayback->lerpFraction <= 0.0f)
+    {
+        return;
+    }
+
+    // The next frame has its own decoder, so the selected and next frame are both decoded sequentially
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    int nextFrameIdx = pPlayback->isFinalPathOnly ? getPathFrame(pDemo, pPlayback->selectedPathPos + 1) : (pPlayback->selectedFrame + 1);
+    const sDemoFrame_t *pNextFrame = pDemo->pEncoded ? decodeDemoFrame(pDemo, &pPlayback->nextDecoder, nextFrameIdx) : getDemoFrame(pDemo, nextFrameIdx);
+
+    // A load teleports the player, so there is nothing to interpolate
+    if (pNextFrame->loadNow)
+    {
+        return;
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        origin[i] += (pNextFrame->origin[i] - origin[i]) * pPlayback->lerpFraction;
+        angles[i] = lerpAngle(angles[i], pNextFrame->angles[i], pPlayback->lerpFraction);
+    }
+}
+
+// Skips frames or keyframes for a player that has a demo selected, returns the new playback position
+static int skipPlaybackFrames(int playerId, sDemoPlayback_t *pPlayback, int nrToSkip, bool areKeyFrames)
+{
+    //printf("[%d] is skipping %d %sframes\n", playerId, nrToSkip, areKeyFrames ? "key" : "");
+
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (pPlayback->isFinalPathOnly)
+    {
+        // Every frame on the final path is part of the completed run, so key frames are skipped like any other frame
+        int requestedPos = pPlayback->selectedPathPos + nrToSkip;
+        if (requestedPos > (pDemo->pathSize - 1))
+        {
+            printf("[%d] can't select next frame, demo is finished\n", playerId);
+            requestedPos = pDemo->pathSize - 1;
+        }
+        else if (requestedPos < 0)
+        {
+            printf("[%d] can't select previous frame, demo is at start\n", playerId);
+            requestedPos = 0;
+        }
+
+        pPlayback->selectedPathPos = requestedPos;
+        pPlayback->selectedFrame = getPathFrame(pDemo, requestedPos);
+        pPlayback->time = getPlaybackPosTime(pPlayback, requestedPos);
+        pPlayback->lerpFraction = 0.0f;
+        return requestedPos;
+    }
+
+    // If we're requested to skip n keyframes, then we need to figure out how many real frames that is
+    if (areKeyFrames)
+    {
+        // We overwrite this with the number of frames to skip (rather than number of key frames), so we can re-use the code below
+        // No check for reverse, because we need this to be negative if skipping backwards, and positive if skipping forward
+        nrToSkip = skipKeyFrames(pDemo, pPlayback->selectedFrame, nrToSkip) - pPlayback->selectedFrame;
+    }
+
+    int requestedFrame = pPlayback->selectedFrame + nrToSkip;
+    if (requestedFrame > (pDemo->size - 1)) // - 1 because we're comparing an index to a size
+    {
+        printf("[%d] can't select next frame, demo is finished\n", playerId);
+        requestedFrame = pDemo->size - 1;
+    }
+    else if (requestedFrame < 0) // TODO: start & end, 0 may not be begin
+    {
+        printf("[%d] can't select previous frame, demo is at start\n", playerId);
+        requestedFrame = 0;
+    }
+    else
+    {
+        // This is fine, not out of bounds
+    }
+
+    //printf("Requested frame skip %d -> %d, returned %d\n", pPlayback->selectedFrame, pPlayback->selectedFrame + nrToSkip, requestedFrame);
+    pPlayback->selectedFrame = requestedFrame;
+    pPlayback->time = getPlaybackPosTime(pPlayback, requestedFrame);
+    pPlayback->lerpFraction = 0.0f;
+    return requestedFrame;
+}
+
+// Viewers of the same demo at the same position share 1 playback, which is advanced and decoded once for all of them.
+// A viewer follows the playback of its group leader until it changes its own playback, then it gets a copy of its own
+static inline sDemoPlayback_t *getSharedPlayback(int playerId)
+{
+    sDemoPlayback_t *pPlayback = &opencj_playback[playerId];
+    return pPlayback->pLeader ? pPlayback->pLeader : pPlayback;
+}
+
+static void copyPlaybackState(sDemoPlayback_t *pTo, const sDemoPlayback_t *pFrom)
+{
+    gentity_t *pEntity = pTo->pEntity; // The entity belongs to the viewer, not to the playback
+    *pTo = *pFrom;
+    pTo->pEntity = pEntity;
+    pTo->pLeader = NULL;
+}
+
+// Gives a player its own playback before it is changed. The other viewers in its group keep the playback as it is
+static sDemoPlayback_t *detachPlayback(int playerId)
+{
+    sDemoPlayback_t *pPlayback = &opencj_playback[playerId];
+    if (pPlayback->pLeader)
+    {
+        copyPlaybackState(pPlayback, pPlayback->pLeader);
+        return pPlayback;
+    }
+
+    // The leader leaves, the first follower gets a copy and leads the rest of the group
+    sDemoPlayback_t *pNewLeader = NULL;
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        sDemoPlayback_t *pFollower = &opencj_playback[i];
+        if (pFollower->pLeader != pPlayback)
+        {
+            continue;
+        }
+
+        if (!pNewLeader)
+        {
+            copyPlaybackState(pFollower, pPlayback);
+            pNewLeader = pFollower;
+        }
+        else
+        {
+            pFollower->pLeader = pNewLeader;
+        }
+    }
+    return pPlayback;
+}
+
+// Whether 2 playbacks stay the same when they are advanced together
+static bool isSamePlayback(const sDemoPlayback_t *pA, const sDemoPlayback_t *pB)
+{
+    return (pA->pDemo == pB->pDemo) && (pA->isFinalPathOnly == pB->isFinalPathOnly)
+        && (pA->selectedFrame == pB->selectedFrame) && (pA->selectedPathPos == pB->selectedPathPos)
+        && (pA->time == pB->time) && (pA->lerpFraction == pB->lerpFraction)
+        && (pA->speed == pB->speed) && (pA->isPaused == pB->isPaused) && (!pA->pEntity == !pB->pEntity);
+}
+
+// Viewers with their own playback join the group of an earlier viewer that is at the same position
+static void groupPlaybacks()
+{
+    for (int i = 1; i < MAX_CLIENTS; i++)
+    {
+        sDemoPlayback_t *pPlayback = &opencj_playback[i];
+        if (pPlayback->pLeader || !pPlayback->pDemo || (pPlayback->pDemo->size == 0))
+        {
+            continue;
+        }
+
+        for (int j = 0; j < i; j++)
+        {
+            sDemoPlayback_t *pLeader = &opencj_playback[j];
+            if (pLeader->pLeader || !isSamePlayback(pPlayback, pLeader))
+            {
+                continue;
+            }
+
+            // Its followers move along to the new group
+            for (int k = 0; k < MAX_CLIENTS; k++)
+            {
+                if (opencj_playback[k].pLeader == pPlayback)
+                {
+                    opencj_playback[k].pLeader = pLeader;
+                }
+            }
+            pPlayback->pLeader = pLeader;
+            break;
+        }
+    }
+}
+
+static void Base_Gsc_Demo_FrameSkip(int playerId, int nrToSkip, bool areKeyFrames) // Helper function for skipping frames and keyframes
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    sDemoPlayback_t *pPlayback = detachPlayback(playerId);
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pDemo || (pDemo->size == 0))
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        stackPushInt(skipPlaybackFrames(playerId, pPlayback, nrToSkip, areKeyFrames));
+    }
+}
+
+// Pushes the selected playback frame as 1 array, so script doesn't need a method call per field:
+// [origin, angles, saveNow, loadNow, rpgNow, fps, flags, position], where position is what the frame skip functions return
+static void Base_Gsc_Demo_PushPlaybackFrame(sDemoPlayback_t *pPlayback)
+{
+    sDemoFrame_t *pDemoFrame = getPlaybackFrame(pPlayback); // CoD2 stock Scr_AddVector doesn't like const here
+    stackMakeArray();
+    stackPushVector(pDemoFrame->origin);
+    stackPushArrayNext();
+    stackPushVector(pDemoFrame->angles);
+    stackPushArrayNext();
+    stackPushInt(pDemoFrame->saveNow);
+    stackPushArrayNext();
+    stackPushInt(pDemoFrame->loadNow);
+    stackPushArrayNext();
+    stackPushInt(pDemoFrame->rpgNow);
+    stackPushArrayNext();
+    stackPushInt(pDemoFrame->fps);
+    stackPushArrayNext();
+    stackPushInt(pDemoFrame->flags);
+    stackPushArrayNext();
+    stackPushInt(pPlayback->isFinalPathOnly ? pPlayback->selectedPathPos : pPlayback->selectedFrame);
+    stackPushArrayNext();
+}
+
+static uint64_t getDemoBenchmarkTimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+// Counts the cache misses of the calling thread. Returns -1 if the kernel doesn't allow it (see kernel.perf_event_paranoid)
+static int openCacheMissCounter()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long readCacheMissCounter(int counterFd)
+{
+    long long count = 0;
+    if ((counterFd < 0) || (read(counterFd, &count, sizeof(count)) != sizeof(count)))
+    {
+        return -1;
+    }
+    return count;
+}
+
+static bool initBenchmarkSamples(sDemoBenchmarkSamples_t *pSamples, long long nrCalls)
+{
+    memset(pSamples, 0, sizeof(*pSamples));
+    pSamples->stride = (int)((nrCalls + DEMO_BENCHMARK_MAX_SAMPLES - 1) / DEMO_BENCHMARK_MAX_SAMPLES);
+    pSamples->maxNrSamples = (int)((nrCalls + pSamples->stride - 1) / pSamples->stride);
+    pSamples->pNs = (uint32_t *)malloc(pSamples->maxNrSamples * sizeof(uint32_t));
+    return pSamples->pNs != NULL;
+}
+
+static inline void addBenchmarkSample(sDemoBenchmarkSamples_t *pSamples, uint64_t ns)
+{
+    if (((pSamples->nrCalls++ % pSamples->stride) == 0) && (pSamples->nrSamples < pSamples->maxNrSamples))
+    {
+        pSamples->pNs[pSamples->nrSamples++] = (ns > UINT32_MAX) ? UINT32_MAX : (uint32_t)ns;
+    }
+    pSamples->totalNs += ns;
+}
+
+static int compareBenchmarkSamples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t getBenchmarkPercentile(const sDemoBenchmarkSamples_t *pSamples, int percentile) // Samples must be sorted
+{
+    if (pSamples->nrSamples <= 0)
+    {
+        return 0;
+    }
+    int idx = (int)(((long long)(pSamples->nrSamples - 1) * percentile) / 100);
+    return pSamples->pNs[idx];
+}
+
+static void printBenchmarkSamples(const char *name, sDemoBenchmarkSamples_t *pSamples)
+{
+    qsort(pSamples->pNs, pSamples->nrSamples, sizeof(uint32_t), compareBenchmarkSamples);
+    double meanNs = (pSamples->nrCalls > 0) ? ((double)pSamples->totalNs / (double)pSamples->nrCalls) : 0.0;
+    printf("  %-16s %lld calls, mean %.0f ns, p50 %u ns, p99 %u ns, max %u ns\n", name, pSamples->nrCalls, meanNs,
+           getBenchmarkPercentile(pSamples, 50), getBenchmarkPercentile(pSamples, 99), getBenchmarkPercentile(pSamples, 100));
+}
+
+// xorshift32. Every player has its own stream, so the movement of a player doesn't depend on the number of players
+static inline uint32_t nextBenchmarkRandom(uint32_t *pSeed)
+{
+    uint32_t x = *pSeed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *pSeed = x;
+    return x;
+}
+
+// Runs and jumps around, saves every few seconds and regularly loads back to 1 of the last 3 saves
+static void getSyntheticBenchmarkFrame(sDemoBenchmarkPlayer_t *pPlayer, int frameIdx, int loadBackInterval, sDemoFrame_t *pFrame, int *pLoadBackwardsCount)
+{
+    memset(pFrame, 0, sizeof(*pFrame));
+    *pLoadBackwardsCount = 0;
+    if ((loadBackInterval > 0) && (frameIdx > 0) && ((frameIdx % loadBackInterval) == 0) && (pPlayer->nrSaves > 0))
+    {
+        int nrLoadableSaves = std::min(pPlayer->nrSaves, 3);
+        *pLoadBackwardsCount = (int)(nextBenchmarkRandom(&pPlayer->seed) % nrLoadableSaves);
+        memcpy(pPlayer->origin, pPlayer->saveOrigins[(pPlayer->nrSaves - 1 - *pLoadBackwardsCount) % 3], sizeof(pPlayer->origin));
+        pFrame->loadNow = true;
+    }
+    else
+    {
+        pPlayer->yaw = remainderf(pPlayer->yaw + (float)((int)(nextBenchmarkRandom(&pPlayer->seed) % 21) - 10), 360.0f);
+        float yawRadians = pPlayer->yaw * (float)(M_PI / 180.0);
+        pPlayer->origin[0] += cosf(yawRadians) * 16.0f;
+        pPlayer->origin[1] += sinf(yawRadians) * 16.0f;
+        pPlayer->origin[2] = 64.0f * fabsf(sinf((float)frameIdx * 0.2f));
+    }
+
+    uint32_t random = nextBenchmarkRandom(&pPlayer->seed);
+    memcpy(pFrame->origin, pPlayer->origin, sizeof(pFrame->origin));
+    pFrame->angles[0] = (float)((int)(random % 61) - 30);
+    pFrame->angles[1] = pPlayer->yaw;
+    pFrame->flags = (short)((random >> 8) & 0x3);
+    pFrame->fps = ((random >> 16) % 16 == 0) ? 250 : 125;
+    pFrame->rpgNow = ((random >> 20) % 512) == 0;
+    if (((frameIdx + 1) % DEMO_BENCHMARK_SAVE_INTERVAL) == 0)
+    {
+        memcpy(pPlayer->saveOrigins[pPlayer->nrSaves % 3], pPlayer->origin, sizeof(pPlayer->origin));
+        pPlayer->nrSaves++;
+        pFrame->saveNow = true;
+    }
+    pFrame->isKeyFrame = pFrame->saveNow || (frameIdx == 0);
+}
+
+// Records a demo for every player, the way script adds a frame for every player every server frame.
+// Recorded frames are spread over the players, so they don't all add the same frame at the same time
+static bool recordBenchmarkDemos(int nrPlayers, int nrFrames, int loadBackInterval, const sDemoFrame_t *pSourceFrames, int nrSourceFrames, sDemoBenchmarkSamples_t *pAddFrame)
+{
+    sDemoBenchmarkPlayer_t *pPlayers = (sDemoBenchmarkPlayer_t *)calloc(nrPlayers, sizeof(sDemoBenchmarkPlayer_t));
+    if (!pPlayers)
+    {
+        return false;
+    }
+    for (int i = 0; i < nrPlayers; i++)
+    {
+        pPlayers[i].seed = 0x9e3779b9 * (uint32_t)(i + 1);
+        pPlayers[i].origin[0] = (float)(i * 1024);
+    }
+
+    bool isOk = true;
+    for (int frameIdx = 0; (frameIdx < nrFrames) && isOk; frameIdx++)
+    {
+        for (int i = 0; (i < nrPlayers) && isOk; i++)
+        {
+            sDemoFrame_t frame;
+            int loadBackwardsCount = 0;
+            if (pSourceFrames)
+            {
+                int sourceIdx = (int)((((long long)i * nrSourceFrames / nrPlayers) + frameIdx) % nrSourceFrames);
+                frame = pSourceFrames[sourceIdx];
+                frame.loadNow = frame.loadNow || ((sourceIdx == 0) && (frameIdx > 0)); // Starting over is a teleport, just like a load
+            }
+            else
+            {
+                getSyntheticBenchmarkFrame(&pPlayers[i], frameIdx, loadBackInterval, &frame, &loadBackwardsCount);
+            }
+
+            uint64_t startNs = getDemoBenchmarkTimeNs();
+            sDemo_t *pDemo = useDemoById(DEMO_BENCHMARK_FIRST_ID + i);
+            isOk = pDemo && addDemoFrame(pDemo, &frame, loadBackwardsCount, frameIdx * DEMO_DEFAULT_FRAME_TIME);
+            addBenchmarkSample(pAddFrame, getDemoBenchmarkTimeNs() - startNs);
+        }
+    }
+
+    free(pPlayers);
+    return isOk;
+}
+
+// Scrubs through every demo like a player watching it, skipping frames and key frames and checking the number of key frames
+static void playBenchmarkDemos(int nrPlayers, int nrSkips, sDemoBenchmarkSamples_t *pFrameSkip, sDemoBenchmarkSamples_t *pNrKeyFrames)
+{
+    uint32_t seed = 0x2545f491;
+    for (int i = 0; i < nrPlayers; i++)
+    {
+        int demoId = DEMO_BENCHMARK_FIRST_ID + i;
+        sDemoPlayback_t playback;
+        memset(&playback, 0, sizeof(playback));
+        playback.decoder.frameIdx = -1;
+        playback.nextDecoder.frameIdx = -1;
+        playback.pDemo = useDemoById(demoId);
+        if (!playback.pDemo || (playback.pDemo->size == 0))
+        {
+            continue;
+        }
+
+        for (int j = 0; j < nrSkips; j++)
+        {
+            uint64_t startNs = getDemoBenchmarkTimeNs();
+            const sDemo_t *pDemo = useDemoById(demoId);
+            int nrKeyFrames = pDemo ? pDemo->nrKeyFrames : 0;
+            addBenchmarkSample(pNrKeyFrames, getDemoBenchmarkTimeNs() - startNs);
+
+            // Frames are skipped within the demo, so skipping doesn't print that the demo is at its start or end
+            uint32_t random = nextBenchmarkRandom(&seed);
+            bool areKeyFrames = ((random % 4) == 0) && (nrKeyFrames > 0);
+            int nrToSkip = areKeyFrames ? (((random >> 8) & 1) ? 1 : -1) : ((int)((random >> 8) % ((2 * DEMO_BENCHMARK_MAX_SKIP) + 1)) - DEMO_BENCHMARK_MAX_SKIP);
+            if (!areKeyFrames)
+            {
+                int requestedFrame = playback.selectedFrame + nrToSkip;
+                if ((requestedFrame < 0) || (requestedFrame >= playback.pDemo->size))
+                {
+                    requestedFrame = playback.selectedFrame - nrToSkip;
+                    nrToSkip = ((requestedFrame < 0) || (requestedFrame >= playback.pDemo->size)) ? 0 : -nrToSkip;
+                }
+            }
+
+            startNs = getDemoBenchmarkTimeNs();
+            skipPlaybackFrames(i, &playback, nrToSkip, areKeyFrames);
+            addBenchmarkSample(pFrameSkip, getDemoBenchmarkTimeNs() - startNs);
+        }
+    }
+}
+
+//==========================================================================
+// Functions that do work for any demo                                        
+//==========================================================================
+
+void Gsc_Demo_ClearAllDemos()
+{
+    clearAllDemos();
+}
+
+void Gsc_Demo_SetMaxNumberOfDemos()
+{
+    if ((Scr_GetNumParam() != 1) || (stackGetParamType(0) != STACK_INT))
+    {
+        stackError("Expected 1 argument: maxNrDemos");
+        stackPushUndefined();
+        return;
+    }
+
+    int maxNrDemos = 0;
+    stackGetParamInt(0, &maxNrDemos);
+    if ((maxNrDemos <= 0) || (maxNrDemos > MAX_MAX_NR_DEMOS_PER_MAP))
+    {
+        stackError("Argument 1 (maxNrDemos) is not in range 1 - %d", MAX_MAX_NR_DEMOS_PER_MAP);
+        stackPushUndefined();
+        return;
+    }
+
+    // Playback, recording and the writer thread point into the slots, so they can only be re-allocated while no demo exists
+    if (opencj_nrDemosInUse > 0)
+    {
+        printf("Can't change max number of demos, %d demos still exist\n", opencj_nrDemosInUse);
+        stackPushUndefined();
+        return;
+    }
+
+    if (opencj_demos && !initDemoSlots(maxNrDemos))
+    {
+        stackPushUndefined();
+        return;
+    }
+    opencj_maxNrDemos = maxNrDemos;
+    stackPushInt(maxNrDemos);
+}
+
+void Gsc_Demo_SetMemoryBudget()
+{
+    if ((Scr_GetNumParam() != 2) || (stackGetParamType(0) != STACK_INT) || (stackGetParamType(1) != STACK_STRING))
+    {
+        stackError("Expected 2 arguments: budgetKB (0 for no budget), spillDirectory");
+        stackPushUndefined();
+        return;
+    }
+
+    int budgetKB = 0;
+    const char *spillDir = NULL;
+    stackGetParamInt(0, &budgetKB);
+    stackGetParamString(1, &spillDir);
+    if ((budgetKB < 0) || (strlen(spillDir) >= sizeof(opencj_demoSpillDir)) || ((budgetKB > 0) && (spillDir[0] == '\0')))
+    {
+        stackError("Argument 1 (budgetKB) should be >= 0 and argument 2 (spillDirectory) a valid directory");
+        stackPushUndefined();
+        return;
+    }
+
+    // Demos that are already spilled keep their files in the previous directory, so it can only change while none are spilled
+    for (int i = 0; (i < opencj_maxNrDemos) && opencj_demos; i++)
+    {
+        if ((opencj_demos[i].id > 0) && opencj_demos[i].isSpilled && strcmp(spillDir, opencj_demoSpillDir))
+        {
+            printf("Can't change the spill directory while demos are spilled\n");
+            stackPushUndefined();
+            return;
+        }
+    }
+
+    snprintf(opencj_demoSpillDir, sizeof(opencj_demoSpillDir), "%s", spillDir);
+    opencj_demoMemoryBudget = (size_t)budgetKB * 1024;
+    enforceDemoMemoryBudget(NULL);
+    stackPushInt(1);
+}
+
+void Gsc_Demo_HasKeyFrames()
+{
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+
+    const sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo)
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        //printf("Returning %d numberOfFrames for demo %d\n", pDemo->size, demoId);
+        stackPushInt((pDemo->lastKeyFrame == 0) ? 0 : 1);
+    }
+}
+
+void Gsc_Demo_NumberOfFrames()
+{
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+
+    const sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo)
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        //printf("Returning %d numberOfFrames for demo %d\n", pDemo->size, demoId);
+        stackPushInt(pDemo->size);
+    }
+}
+void Gsc_Demo_NumberOfKeyFrames()
+{
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+
+    const sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo)
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        stackPushInt(pDemo->nrKeyFrames);
+    }
+}
+
+void Gsc_Demo_NumberOfFinalPathFrames()
+{
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+
+    const sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo || !pDemo->isComplete)
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        stackPushInt(pDemo->pathSize);
+    }
+}
+
+void Gsc_Demo_FinalPathPosition()
+{
+    const int nrExpectedArgs = 2;
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, nrExpectedArgs)) return;
+
+    int frameIdx = -1;
+    if (stackGetParamType(1) != STACK_INT)
+    {
+        stackError("Argument 2 (frame) is not an int");
+        stackPushUndefined();
+        return;
+    }
+    stackGetParamInt(1, &frameIdx);
+
+    // -1 if the player loaded back to before this frame
+    const sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo || !pDemo->isComplete || (frameIdx < 0) || (frameIdx >= pDemo->size))
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        stackPushInt(getFramePathPos(pDemo, frameIdx));
+    }
+}
+
+void Gsc_Demo_KeyFrameRank()
+{
+    const int nrExpectedArgs = 2;
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, nrExpectedArgs)) return;
+
+    int frameIdx = -1;
+    if (stackGetParamType(1) != STACK_INT)
+    {
+        stackError("Argument 2 (frame) is not an int");
+        stackPushUndefined();
+        return;
+    }
+    stackGetParamInt(1, &frameIdx);
+
+    const sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo || (frameIdx < 0) || (frameIdx >= pDemo->size))
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        stackPushInt(getKeyFrameRank(pDemo, frameIdx));
+    }
+}
+
+void Gsc_Demo_KeyFrameByRank()
+{
+    const int nrExpectedArgs = 2;
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, nrExpectedArgs)) return;
+
+    int rank = -1;
+    if (stackGetParamType(1) != STACK_INT)
+    {
+        stackError("Argument 2 (rank) is not an int");
+        stackPushUndefined();
+        return;
+    }
+    stackGetParamInt(1, &rank);
+
+    const sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo || (rank < 0) || (rank >= pDemo->nrKeyFrames))
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        stackPushInt(getKeyFrameByRank(pDemo, rank));
+    }
+}
+
+void Gsc_Demo_NearestFrame()
+{
+    // Frame of a completed demo that is closest to the position, optionally only key frames and only frames in [startFrame, endFrame]
+    const int nrArgs = Scr_GetNumParam();
+    if ((nrArgs != 2) && (nrArgs != 3) && (nrArgs != 5))
+    {
+        stackError("NearestFrame expects 2, 3 or 5 arguments: demoId, position, [isKeyFrameOnly], [startFrame, endFrame]");
+        stackPushUndefined();
+        return;
+    }
+
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, nrArgs)) return;
+
+    if (stackGetParamType(1) != STACK_VECTOR)
+    {
+        stackError("Argument 2 (position) is not a vector");
+        stackPushUndefined();
+        return;
+    }
+    vec3_t position;
+    stackGetParamVector(1, position);
+
+    int isKeyFrameOnly = 0;
+    if (nrArgs > 2)
+    {
+        if (stackGetParamType(2) != STACK_INT)
+        {
+            stackError("Argument 3 (isKeyFrameOnly) is not an int");
+            stackPushUndefined();
+            return;
+        }
+        stackGetParamInt(2, &isKeyFrameOnly);
+    }
+
+    int startFrame = 0;
+    int endFrame = INT_MAX;
+    if (nrArgs > 3)
+    {
+        if ((stackGetParamType(3) != STACK_INT) || (stackGetParamType(4) != STACK_INT))
+        {
+            stackError("Argument 4 (startFrame) and 5 (endFrame) should be ints");
+            stackPushUndefined();
+            return;
+        }
+        stackGetParamInt(3, &startFrame);
+        stackGetParamInt(4, &endFrame);
+    }
+
+    sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo || !pDemo->isComplete || (startFrame < 0) || (startFrame > endFrame))
+    {
+        stackPushUndefined();
+        return;
+    }
+
+    int frameIdx = findNearestDemoFrame(pDemo, position, (isKeyFrameOnly != 0), startFrame, endFrame);
+    if (frameIdx < 0)
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        stackPushInt(frameIdx);
+    }
+}
+
+void Gsc_Demo_FindEvents()
+{
+    int startFrame = 0;
+    int endFrame = 0;
+    eDemoEvent_t event = DEMO_EVENT_SAVE;
+    sDemo_t *pDemo = Base_Gsc_GetAnalysisDemo(2, "FindEvents expects 2 or 4 arguments: demoId, event, [startFrame, endFrame]", &startFrame, &endFrame);
+    if (!pDemo || !Base_Gsc_GetDemoEvent(1, &event)) return;
+
+    const sDemoColumns_t *pColumns = getDemoColumns(pDemo);
+    if (!pColumns)
+    {
+        stackPushUndefined();
+        return;
+    }
+
+    // Frames with the event, in order
+    stackMakeArray();
+    for (int frameIdx = findNextEventFrame(pColumns->pEvents[event], startFrame, endFrame); frameIdx >= 0;
+         frameIdx = (frameIdx < endFrame) ? findNextEventFrame(pColumns->pEvents[event], frameIdx + 1, endFrame) : -1)
+    {
+        stackPushInt(frameIdx);
+        stackPushArrayNext();
+    }
+}
+
+void Gsc_Demo_CountEvents()
+{
+    int startFrame = 0;
+    int endFrame = 0;
+    eDemoEvent_t event = DEMO_EVENT_SAVE;
+    sDemo_t *pDemo = Base_Gsc_GetAnalysisDemo(2, "CountEvents expects 2 or 4 arguments: demoId, event, [startFrame, endFrame]", &startFrame, &endFrame);
+    if (!pDemo || !Base_Gsc_GetDemoEvent(1, &event)) return;
+
+    const sDemoColumns_t *pColumns = getDemoColumns(pDemo);
+    if (!pColumns)
+    {
+        stackPushUndefined();
+        return;
+    }
+
+    stackPushInt(countEventFrames(pColumns->pEvents[event], startFrame, endFrame));
+}
+
+void Gsc_Demo_MaxSpeed()
+{
+    int startFrame = 0;
+    int endFrame = 0;
+    sDemo_t *pDemo = Base_Gsc_GetAnalysisDemo(1, "MaxSpeed expects 1 or 3 arguments: demoId, [startFrame, endFrame]", &startFrame, &endFrame);
+    if (!pDemo) return;
+
+    const sDemoColumns_t *pColumns = getDemoColumns(pDemo);
+    int frameIdx = -1;
+    float speed = pColumns ? getMaxSpeed(pDemo, pColumns, startFrame, endFrame, &frameIdx) : 0.0f;
+    if (frameIdx < 0)
+    {
+        stackPushUndefined();
+        return;
+    }
+
+    // Horizontal speed in units per second, and the frame that was reached with it
+    stackMakeArray();
+    stackPushFloat(speed);
+    stackPushArrayNext();
+    stackPushInt(frameIdx);
+    stackPushArrayNext();
+}
+
+void Gsc_Demo_FpsHistogram()
+{
+    int startFrame = 0;
+    int endFrame = 0;
+    sDemo_t *pDemo = Base_Gsc_GetAnalysisDemo(1, "FpsHistogram expects 1 or 3 arguments: demoId, [startFrame, endFrame]", &startFrame, &endFrame);
+    if (!pDemo) return;
+
+    const sDemoColumns_t *pColumns = getDemoColumns(pDemo);
+    sDemoFpsCount_t *pCounts = NULL;
+    int nrCounts = pColumns ? getFpsHistogram(pColumns, startFrame, endFrame, &pCounts) : -1;
+    if (nrCounts < 0)
+    {
+        stackPushUndefined();
+        return;
+    }
+
+    // [fps, number of frames] for every fps that was used, ordered by fps
+    stackMakeArray();
+    for (int i = 0; i < nrCounts; i++)
+    {
+        stackMakeArray();
+        stackPushInt(pCounts[i].fps);
+        stackPushArrayNext();
+        stackPushInt(pCounts[i].nrFrames);
+        stackPushArrayNext();
+        stackPushArrayNext();
+    }
+    free(pCounts);
+}
+
+void Gsc_Demo_SimplifyRoute()
+{
+    // Points of the final path of a completed demo, so that the route in between them is within the tolerance of straight lines
+    const int nrArgs = Scr_GetNumParam();
+    if ((nrArgs != 2) && (nrArgs != 3))
+    {
+        stackError("SimplifyRoute expects 2 or 3 arguments: demoId, tolerance, [maxPoints]");
+        stackPushUndefined();
+        return;
+    }
+
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, nrArgs)) return;
+
+    float tolerance = 0.0f;
+    int maxPoints = INT_MAX;
+    if ((stackGetParamType(1) != STACK_FLOAT) && (stackGetParamType(1) != STACK_INT))
+    {
+        stackError("Argument 2 (tolerance) is not a number");
+        stackPushUndefined();
+        return;
+    }
+    stackGetParamFloat(1, &tolerance);
+    if (nrArgs > 2)
+    {
+        if (stackGetParamType(2) != STACK_INT)
+        {
+            stackError("Argument 3 (maxPoints) is not an int");
+            stackPushUndefined();
+            return;
+        }
+        stackGetParamInt(2, &maxPoints);
+    }
+
+    const sDemo_t *pDemo = useDemoById(demoId);
+    sDemoComparePath_t path;
+    if (!pDemo || (pDemo->pathSize == 0) || (tolerance < 0.0f) || (maxPoints < 2) || !readDemoComparePath(pDemo, false, &path))
+    {
+        stackPushUndefined();
+        return;
+    }
+
+    uint8_t *pIsKept = (uint8_t *)malloc(path.nrPoints);
+    if (!pIsKept || (simplifyRoute(&path, tolerance, maxPoints, pIsKept) < 0))
+    {
+        free(pIsKept);
+        freeDemoComparePath(&path);
+        stackPushUndefined();
+        return;
+    }
+
+    // Loads are part of the route as well, the jump of a load is kept like any other sharp change of direction
+    stackMakeArray();
+    for (int pos = 0; pos < path.nrPoints; pos++)
+    {
+        if (pIsKept[pos])
+        {
+            vec3_t origin = { path.pX[pos], path.pY[pos], path.pZ[pos] };
+            stackPushVector(origin);
+            stackPushArrayNext();
+        }
+    }
+
+    free(pIsKept);
+    freeDemoComparePath(&path);
+}
+
+void Gsc_Demo_CreateDemo()
+{
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+
+    sDemo_t *pDemo = findDemoById(demoId);
+    if (pDemo)
     {
         printf("Demo with id %d already loaded!\n", demoId);
         stackPushInt(-1);
@@ -418,350 +4371,1125 @@ void Gsc_Demo_CreateDemo()
         return;
     }
 
-    stackPushInt(demoId);
-    printf("Created demo with id %d\n", demoId);
+    stackPushInt(demoId);
+    printf("Created demo with id %d\n", demoId);
+}
+
+void Gsc_Demo_DestroyDemo()
+{
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+
+    printf("Destroying demo with id %d\n", demoId);
+    clearDemoById(demoId);
+}
+
+void Gsc_Demo_AddFrame()
+{
+    // The optional arguments are which save was loaded when loadNow is set, counting backwards from the last save (like savePosition_selectSave),
+    // and the server time of the frame (getTime()). Without a time, frames are DEMO_DEFAULT_FRAME_TIME apart
+    const int nrExpectedArgs = Scr_GetNumParam();
+    if ((nrExpectedArgs < 9) || (nrExpectedArgs > 11))
+    {
+        stackPushUndefined();
+        stackError("AddFrame expects 9 to 11 arguments: demoId, origin, angles, isKeyFrame, flags, saveNow, loadNow, rpgNow, fps, [loadBackwardsCount], [time]");
+        return;
+    }
+
+    // Argument 1: demoId
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, nrExpectedArgs)) return;
+
+    // Argument 2: origin
+    if (stackGetParamType(1) != STACK_VECTOR)
+    {
+        stackPushUndefined();
+        stackError("Argument 2 (origin) is not a vector");
+        return;
+    }
+    vec3_t origin;
+    stackGetParamVector(1, origin);
+
+    // Argument 3: angles
+    if (stackGetParamType(2) != STACK_VECTOR)
+    {
+        stackPushUndefined();
+        stackError("Argument 3 (angles) is not a vector");
+        return;
+    }
+    vec3_t angles;
+    stackGetParamVector(2, angles);
+
+    // Argument 4: isKeyFrame
+    int keyFrame = -1;
+    if (stackGetParamType(3) != STACK_INT)
+    {
+        stackPushUndefined();
+        stackError("Argument 4 (keyFrame) is not an int");
+        return;
+    }
+    stackGetParamInt(3, &keyFrame);
+
+    if (keyFrame < 0)
+    {
+        stackPushUndefined();
+        stackError("keyFrame < 0: %d", keyFrame);
+    }
+   
+    int flags;
+    if (stackGetParamType(4) != STACK_INT)
+    {
+        stackPushUndefined();
+        stackError("Argument 5 (flags) is not an int");
+        return;
+    }
+    stackGetParamInt(4, &flags);
+   
+    int saveNow;
+    if (stackGetParamType(5) != STACK_INT)
+    {
+        stackPushUndefined();
+        stackError("Argument 6 (saveNow) is not an int");
+        return;
+    }
+    stackGetParamInt(5, &saveNow);
+	int loadNow;
+    if (stackGetParamType(6) != STACK_INT)
+    {
+        stackPushUndefined();
+        stackError("Argument 7 (loadNow) is not an int");
+        return;
+    }
+    stackGetParamInt(6, &loadNow);
+    int rpgNow;
+    if (stackGetParamType(7) != STACK_INT)
+    {
+        stackPushUndefined();
+        stackError("Argument 8 (rpgNow) is not an int");
+        return;
+    }
+    stackGetParamInt(7, &rpgNow);
+
+     int fps;
+    if (stackGetParamType(8) != STACK_INT)
+    {
+        stackPushUndefined();
+        stackError("Argument 9 (fps) is not an int");
+        return;
+    }
+    stackGetParamInt(8, &fps);
+
+    int loadBackwardsCount = 0;
+    if (nrExpectedArgs > 9)
+    {
+        if ((stackGetParamType(9) != STACK_INT))
+        {
+            stackPushUndefined();
+            stackError("Argument 10 (loadBackwardsCount) is not an int");
+            return;
+        }
+        stackGetParamInt(9, &loadBackwardsCount);
+    }
+
+    bool hasTime = (nrExpectedArgs > 10);
+    int time = 0;
+    if (hasTime)
+    {
+        if ((stackGetParamType(10) != STACK_INT))
+        {
+            stackPushUndefined();
+            stackError("Argument 11 (time) is not an int");
+            return;
+        }
+        stackGetParamInt(10, &time);
+    }
+
+    sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo)
+    {
+        stackPushUndefined();
+        printf("Demo with id %d was not found.. stop adding frames please\n", demoId);
+        return;
+    }
+
+    if (!hasTime && pDemo->isFirstFrameFilled)
+    {
+        time = pDemo->startTime + pDemo->lastFrameTime + DEMO_DEFAULT_FRAME_TIME;
+    }
+
+    sDemoFrame_t frame;
+    memcpy(frame.origin, origin, sizeof(frame.origin));
+    memcpy(frame.angles, angles, sizeof(frame.angles));
+    frame.isKeyFrame = (keyFrame > 0);
+    frame.saveNow = (saveNow != 0);
+    frame.loadNow = (loadNow != 0);
+    frame.rpgNow = (rpgNow != 0);
+    frame.flags = flags & 0xFFFF;
+    frame.fps = fps & 0xFFFF;
+    if (!addDemoFrame(pDemo, &frame, loadBackwardsCount, time))
+    {
+        stackPushUndefined();
+        return;
+    }
+
+    //printf("Added frame %d to demo of player %d\n", idxNewFrame, playerId);
+    stackPushInt(demoId);
+}
+
+void Gsc_Demo_SetSparseRecording()
+{
+    // Frames of a sparse demo are only stored when origin, angles, flags or fps change beyond the tolerances, or when they have events.
+    // The frames in between repeat the stored frame on playback. A negative tolerance stores every frame again
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, 3)) return;
+
+    for (int i = 1; i < 3; i++)
+    {
+        if ((stackGetParamType(i) != STACK_FLOAT) && (stackGetParamType(i) != STACK_INT))
+        {
+            stackError("Argument %d (%s) is not a number", i + 1, (i == 1) ? "originTolerance" : "angleTolerance");
+            stackPushUndefined();
+            return;
+        }
+    }
+
+    float originTolerance = 0.0f;
+    float angleTolerance = 0.0f;
+    stackGetParamFloat(1, &originTolerance);
+    stackGetParamFloat(2, &angleTolerance);
+
+    sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo || pDemo->isComplete)
+    {
+        printf("Demo with id %d was not found or is already complete\n", demoId);
+        stackPushUndefined();
+        return;
+    }
+
+    pDemo->isSparse = (originTolerance >= 0.0f) && (angleTolerance >= 0.0f);
+    pDemo->sparseOriginTolerance = originTolerance;
+    pDemo->sparseAngleTolerance = angleTolerance;
+    stackPushInt(demoId);
+}
+
+void Gsc_Demo_CompleteDemo()
+{
+    // Either just the demoId, or demoId, "file"/"mysql", path/table to have the demo persisted by the writer thread
+    int nrArgs = Scr_GetNumParam();
+    if ((nrArgs != 1) && (nrArgs != 3))
+    {
+        stackError("CompleteDemo expects 1 or 3 arguments: demoId, [\"file\" path | \"mysql\" table]");
+        stackPushUndefined();
+        return;
+    }
+
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, nrArgs)) return;
+
+    eDemoPersistTarget_t target = DEMO_PERSIST_FILE;
+    const char *destination = NULL;
+    if (nrArgs == 3)
+    {
+        const char *targetName = NULL;
+        if ((stackGetParamType(1) != STACK_STRING) || (stackGetParamType(2) != STACK_STRING))
+        {
+            stackError("Argument 2 (target) and 3 (destination) should be strings");
+            stackPushUndefined();
+            return;
+        }
+        stackGetParamString(1, &targetName);
+        stackGetParamString(2, &destination);
+
+        if (!strcmp(targetName, "file"))
+        {
+            target = DEMO_PERSIST_FILE;
+        }
+        else if (!strcmp(targetName, "mysql"))
+        {
+            target = DEMO_PERSIST_MYSQL;
+        }
+        else
+        {
+            stackError("Argument 2 (target) should be \"file\" or \"mysql\"");
+            stackPushUndefined();
+            return;
+        }
+
+        if ((strlen(destination) >= DEMO_PERSIST_MAX_DESTINATION) || ((target == DEMO_PERSIST_MYSQL) && !isValidTableName(destination)))
+        {
+            stackError("Argument 3 (destination) is not a valid %s", (target == DEMO_PERSIST_MYSQL) ? "table name" : "path");
+            stackPushUndefined();
+            return;
+        }
+    }
+
+    sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo)
+    {
+        printf("Demo with id %d not found, can't complete..\n", demoId);
+        return;
+    }
+
+    finishDemoRecording(pDemo);
+
+    // The writer thread encodes the demo and gives the encoding back once it is persisted
+    if (destination)
+    {
+        stackPushInt(queueDemoPersistJob(pDemo, target, destination) ? 1 : 0);
+        return;
+    }
+
+    // Frames of a completed demo no longer change, so store them in the compact encoding
+    if (pDemo->isBeingPersisted)
+    {
+        return;
+    }
+    if (!encodeDemo(pDemo) && !pDemo->pEncoded)
+    {
+        printf("Demo with id %d could not be encoded, keeping its frames as they are\n", demoId);
+    }
+    enforceDemoMemoryBudget(pDemo);
+
+}
+
+void Gsc_Demo_GetPersistedDemos()
+{
+    pthread_mutex_lock(&opencj_persistLock);
+    sDemoPersistJob_t *pJobs = opencj_donePersistJobs;
+    opencj_donePersistJobs = NULL;
+    pthread_mutex_unlock(&opencj_persistLock);
+
+    // MySQL jobs first wait for their queries, after that they are done like the other jobs
+    sDemoPersistJob_t **ppLast = &opencj_queryingPersistJobs;
+    while (*ppLast)
+    {
+        ppLast = &(*ppLast)->pNext;
+    }
+    while (pJobs)
+    {
+        sDemoPersistJob_t *pJob = pJobs;
+        pJobs = pJob->pNext;
+        if (pJob->isOk && (pJob->target == DEMO_PERSIST_MYSQL) && !queueDemoPersistQueries(pJob))
+        {
+            pJob->isOk = false;
+        }
+        pJob->pNext = NULL;
+        *ppLast = pJob;
+        ppLast = &pJob->pNext;
+    }
+
+    // Ids of demos that were persisted, or negative ids of demos that failed to persist.
+    // For MySQL, a demo is only reported (and its frames released) once all of its chunks are stored
+    stackMakeArray();
+    ppLast = &opencj_queryingPersistJobs;
+    while (*ppLast)
+    {
+        sDemoPersistJob_t *pJob = *ppLast;
+        if (!pollDemoPersistQueries(pJob))
+        {
+            ppLast = &pJob->pNext;
+            continue;
+        }
+        *ppLast = pJob->pNext;
+
+        bool isOk = finishDemoPersistJob(pJob);
+        stackPushInt(isOk ? pJob->demoId : -pJob->demoId);
+        stackPushArrayNext();
+
+        freeDemoPersistJob(pJob);
+    }
 }
 
-void Gsc_Demo_DestroyDemo()
+void Gsc_Demo_SaveDemo()
 {
+    const int nrExpectedArgs = 2;
     int demoId = -1;
-    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+    if (!Base_Gsc_GetValidDemoId(&demoId, nrExpectedArgs)) return;
 
-    printf("Destroying demo with id %d\n", demoId);
-    clearDemoById(demoId);
-}
+    const char *path = NULL;
+    if (stackGetParamType(1) != STACK_STRING)
+    {
+        stackError("Argument 2 (path) is not a string");
+        stackPushUndefined();
+        return;
+    }
+    stackGetParamString(1, &path);
 
-void Gsc_Demo_AddFrame()
-{
-    const int nrExpectedArgs = 9;
-    if (Scr_GetNumParam() != nrExpectedArgs)
+    const sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo || !saveDemoToFile(pDemo, path))
     {
         stackPushUndefined();
-        stackError("AddFrame expects 9 arguments: demoId, origin, angles, isKeyFrame, flags, saveNow, loadNow, rpgNow, fps");
         return;
     }
 
-    // Argument 1: demoId
+    stackPushInt(1);
+}
+
+void Gsc_Demo_LoadDemo()
+{
+    const int nrExpectedArgs = 2;
     int demoId = -1;
     if (!Base_Gsc_GetValidDemoId(&demoId, nrExpectedArgs)) return;
 
-    // Argument 2: origin
-    if (stackGetParamType(1) != STACK_VECTOR)
+    const char *path = NULL;
+    if (stackGetParamType(1) != STACK_STRING)
     {
+        stackError("Argument 2 (path) is not a string");
         stackPushUndefined();
-        stackError("Argument 2 (origin) is not a vector");
         return;
     }
-    vec3_t origin;
-    stackGetParamVector(1, origin);
+    stackGetParamString(1, &path);
 
-    // Argument 3: angles
-    if (stackGetParamType(2) != STACK_VECTOR)
+    sDemo_t *pDemo = loadDemoFromFile(demoId, path);
+    if (!pDemo)
     {
         stackPushUndefined();
-        stackError("Argument 3 (angles) is not a vector");
         return;
     }
-    vec3_t angles;
-    stackGetParamVector(2, angles);
+    pDemo->lastUsed = ++opencj_demoUseCounter;
+    enforceDemoMemoryBudget(pDemo);
 
-    // Argument 4: isKeyFrame
-    int keyFrame = -1;
-    if (stackGetParamType(3) != STACK_INT)
+    stackPushInt(demoId);
+}
+
+/*
+    Records a demo for every (fake) player through the same path as addFrameToDemo, completes them and scrubs through them
+    like the frame skip methods do. Reports the latency of adding a frame, skipping frames and numberOfKeyFrames(), the memory the demos use
+    and cache misses. The frames are synthetic, with a load back every loadBackInterval frames, or taken from the recorded demo sourceDemoId.
+    Blocks the game thread until the benchmark is done, so only run this on a test server
+*/
+void Gsc_Demo_Benchmark()
+{
+    int nrArgs = Scr_GetNumParam();
+    if ((nrArgs < 2) || (nrArgs > 4))
     {
+        stackError("demoBenchmark expects 2 to 4 arguments: nrPlayers, nrFrames, [loadBackInterval], [sourceDemoId]");
         stackPushUndefined();
-        stackError("Argument 4 (keyFrame) is not an int");
         return;
     }
-    stackGetParamInt(3, &keyFrame);
 
-    if (keyFrame < 0)
+    int nrPlayers = 0;
+    int nrFrames = 0;
+    int loadBackInterval = 2 * SERVER_FRAMES_PER_SECOND;
+    int sourceDemoId = 0;
+    int *pArgs[] = {&nrPlayers, &nrFrames, &loadBackInterval, &sourceDemoId};
+    for (int i = 0; i < nrArgs; i++)
     {
-        stackPushUndefined();
-        stackError("keyFrame < 0: %d", keyFrame);
+        if (stackGetParamType(i) != STACK_INT)
+        {
+            stackError("Argument %d is not an int", i + 1);
+            stackPushUndefined();
+            return;
+        }
+        int *pValue = pArgs[i];
+        stackGetParamInt(i, pValue);
     }
-   
-    int flags;
-    if (stackGetParamType(4) != STACK_INT)
+
+    if ((nrPlayers <= 0) || (nrPlayers > MAX_CLIENTS) || (nrFrames <= 0) || (nrFrames > DEMO_BENCHMARK_MAX_FRAMES) || (loadBackInterval < 0) || (sourceDemoId < 0))
     {
+        stackError("demoBenchmark called with out of range arguments (max %d players, max %d frames)", MAX_CLIENTS, DEMO_BENCHMARK_MAX_FRAMES);
         stackPushUndefined();
-        stackError("Argument 5 (flags) is not an int");
         return;
     }
-    stackGetParamInt(4, &flags);
-   
-    int saveNow;
-    if (stackGetParamType(5) != STACK_INT)
+
+    // The frames of a recorded demo are copied, they are added to the benchmark demos many times over
+    sDemoFrame_t *pSourceFrames = NULL;
+    int nrSourceFrames = 0;
+    if (sourceDemoId > 0)
     {
-        stackPushUndefined();
-        stackError("Argument 6 (saveNow) is not an int");
-        return;
+        const sDemo_t *pSource = useDemoById(sourceDemoId);
+        if (!pSource || (pSource->size == 0))
+        {
+            stackError("Demo with id %d was not found or has no frames", sourceDemoId);
+            stackPushUndefined();
+            return;
+        }
+
+        nrSourceFrames = std::min(pSource->size, nrFrames);
+        pSourceFrames = (sDemoFrame_t *)malloc(nrSourceFrames * sizeof(sDemoFrame_t));
+        if (!pSourceFrames)
+        {
+            stackError("demoBenchmark out of memory");
+            stackPushUndefined();
+            return;
+        }
+
+        sDemoDecoder_t decoder;
+        decoder.frameIdx = -1;
+        for (int frameIdx = 0; frameIdx < nrSourceFrames; frameIdx++)
+        {
+            pSourceFrames[frameIdx] = *(pSource->pEncoded ? decodeDemoFrame(pSource, &decoder, frameIdx) : getDemoFrame(pSource, frameIdx));
+        }
     }
-    stackGetParamInt(5, &saveNow);
-	int loadNow;
-    if (stackGetParamType(6) != STACK_INT)
+
+    long long nrCalls = (long long)nrPlayers * nrFrames;
+    sDemoBenchmarkSamples_t addFrame;
+    sDemoBenchmarkSamples_t frameSkip;
+    sDemoBenchmarkSamples_t nrKeyFrames;
+    bool isOk = initBenchmarkSamples(&addFrame, nrCalls) & initBenchmarkSamples(&frameSkip, nrCalls) & initBenchmarkSamples(&nrKeyFrames, nrCalls);
+    int nrCreated = 0;
+    while (isOk && (nrCreated < nrPlayers))
     {
-        stackPushUndefined();
-        stackError("Argument 7 (loadNow) is not an int");
-        return;
+        isOk = (createDemo(DEMO_BENCHMARK_FIRST_ID + nrCreated) != NULL);
+        nrCreated += isOk ? 1 : 0;
     }
-    stackGetParamInt(6, &loadNow);
-    int rpgNow;
-    if (stackGetParamType(7) != STACK_INT)
+
+    int counterFd = -1;
+    long long recordMisses = -1;
+    long long playbackMisses = -1;
+    size_t recordedSize = 0;
+    size_t completedSize = 0;
+    uint64_t completeNs = 0;
+    if (isOk)
     {
-        stackPushUndefined();
-        stackError("Argument 8 (rpgNow) is not an int");
-        return;
+        counterFd = openCacheMissCounter();
+        long long startMisses = readCacheMissCounter(counterFd);
+        isOk = recordBenchmarkDemos(nrPlayers, nrFrames, loadBackInterval, pSourceFrames, nrSourceFrames, &addFrame);
+        long long endMisses = readCacheMissCounter(counterFd);
+        recordMisses = ((startMisses >= 0) && (endMisses >= 0)) ? (endMisses - startMisses) : -1;
     }
-    stackGetParamInt(7, &rpgNow);
-
-     int fps;
-    if (stackGetParamType(8) != STACK_INT)
+    if (isOk)
     {
-        stackPushUndefined();
-        stackError("Argument 9 (fps) is not an int");
-        return;
+        // Demos are largest right before they are completed, the compact encoding replaces their frames
+        uint64_t startNs = getDemoBenchmarkTimeNs();
+        for (int i = 0; i < nrPlayers; i++)
+        {
+            sDemo_t *pDemo = findDemoById(DEMO_BENCHMARK_FIRST_ID + i);
+            recordedSize += getDemoMemoryUsage(pDemo);
+            finishDemoRecording(pDemo);
+            encodeDemo(pDemo);
+            completedSize += getDemoMemoryUsage(pDemo);
+        }
+        completeNs = getDemoBenchmarkTimeNs() - startNs;
+
+        long long startMisses = readCacheMissCounter(counterFd);
+        playBenchmarkDemos(nrPlayers, nrFrames, &frameSkip, &nrKeyFrames);
+        long long endMisses = readCacheMissCounter(counterFd);
+        playbackMisses = ((startMisses >= 0) && (endMisses >= 0)) ? (endMisses - startMisses) : -1;
     }
-    stackGetParamInt(8, &fps);
 
-    sDemo_t *pDemo = findDemoById(demoId);
-    if (!pDemo)
+    if (isOk)
     {
+        struct rusage usage;
+        memset(&usage, 0, sizeof(usage));
+        getrusage(RUSAGE_SELF, &usage);
+
+        float recordMissesPerCall = (recordMisses >= 0) ? (float)((double)recordMisses / (double)addFrame.nrCalls) : -1.0f;
+        float playbackMissesPerCall = (playbackMisses >= 0) ? (float)((double)playbackMisses / (double)(frameSkip.nrCalls + nrKeyFrames.nrCalls)) : -1.0f;
+        printf("Demo benchmark: %d players, %d %s frames each, load back every %d frames\n", nrPlayers, nrFrames, pSourceFrames ? "recorded" : "synthetic", pSourceFrames ? 0 : loadBackInterval);
+        printBenchmarkSamples("add frame", &addFrame);
+        printBenchmarkSamples("frame skip", &frameSkip);
+        printBenchmarkSamples("key frame count", &nrKeyFrames);
+        printf("  completing all demos took %.1f ms\n", (double)completeNs / 1000000.0);
+        printf("  memory: %zu KB recorded, %zu KB completed, process peak %ld KB\n", recordedSize / 1024, completedSize / 1024, usage.ru_maxrss);
+        if (counterFd >= 0)
+        {
+            printf("  cache misses: %.2f per added frame, %.2f per playback call\n", recordMissesPerCall, playbackMissesPerCall);
+        }
+        else
+        {
+            printf("  cache misses: not available, perf events are not allowed\n");
+        }
+
+        // Results are also returned so a script can compare runs: [add frame p50, p99, max, frame skip p50, p99, max, key frame count p50, p99, max (ns),
+        // recorded KB, completed KB, process peak KB, cache misses per added frame, cache misses per playback call (-1 if not available)]
+        sDemoBenchmarkSamples_t *pResults[] = {&addFrame, &frameSkip, &nrKeyFrames};
+        stackMakeArray();
+        for (int i = 0; i < 3; i++)
+        {
+            stackPushInt(getBenchmarkPercentile(pResults[i], 50));
+            stackPushArrayNext();
+            stackPushInt(getBenchmarkPercentile(pResults[i], 99));
+            stackPushArrayNext();
+            stackPushInt(getBenchmarkPercentile(pResults[i], 100));
+            stackPushArrayNext();
+        }
+        stackPushInt((int)(recordedSize / 1024));
+        stackPushArrayNext();
+        stackPushInt((int)(completedSize / 1024));
+        stackPushArrayNext();
+        stackPushInt((int)usage.ru_maxrss);
+        stackPushArrayNext();
+        stackPushFloat(recordMissesPerCall);
+        stackPushArrayNext();
+        stackPushFloat(playbackMissesPerCall);
+        stackPushArrayNext();
+    }
+    else
+    {
+        printf("Demo benchmark could not run: out of memory or out of demo slots (%d of %d benchmark demos created)\n", nrCreated, nrPlayers);
         stackPushUndefined();
-        printf("Demo with id %d was not found.. stop adding frames please\n", demoId);
-        return;
     }
 
-    bool isFirstFrame = !pDemo->isFirstFrameFilled;
-    int idxLastExistingFrame = pDemo->currentFrame;
-    int idxNewFrame = pDemo->currentFrame;
-    if (!isFirstFrame) // First frame might not be filled in yet
+    for (int i = 0; i < nrCreated; i++)
     {
-        idxNewFrame++;
+        clearDemoById(DEMO_BENCHMARK_FIRST_ID + i);
+    }
+    if (counterFd >= 0)
+    {
+        close(counterFd);
     }
+    free(addFrame.pNs);
+    free(frameSkip.pNs);
+    free(nrKeyFrames.pNs);
+    free(pSourceFrames);
+}
 
-    sDemoFrame_t *pLastExistingFrame = &pDemo->pDemoFrames[idxLastExistingFrame];
-    sDemoFrame_t *pNewFrame = &pDemo->pDemoFrames[idxNewFrame];
+//==========================================================================
+// Functions related to playback & control                                        
+//==========================================================================
 
-    // Fill in new frame
-    memcpy(pNewFrame->origin, origin, sizeof(pNewFrame->origin));
-    memcpy(pNewFrame->angles, angles, sizeof(pNewFrame->angles));
+void Gsc_Demo_SelectPlaybackDemo(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
 
-    // Set key frame info for new frame
-    pNewFrame->isKeyFrame = (keyFrame > 0);
-    pNewFrame->saveNow = (saveNow != 0);
-    pNewFrame->loadNow = (loadNow != 0);
-    pNewFrame->rpgNow = (rpgNow != 0);
-    pNewFrame->flags = flags & 0xFFFF;
-    pNewFrame->fps = fps & 0xFFFF;
-    if (isFirstFrame)
+    // Optionally only the frames of the final path are played back, which requires the demo to be complete
+    int nrArgs = Scr_GetNumParam();
+    if ((nrArgs != 1) && (nrArgs != 2))
     {
-        pNewFrame->prevKeyFrame = idxLastExistingFrame;
+        stackError("Expected 1 or 2 arguments: demoId, [finalPathOnly]");
+        stackPushUndefined();
+        return;
     }
-    else
+
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, nrArgs)) return;
+
+    int finalPathOnly = 0;
+    if (nrArgs > 1)
+    {
+        if (stackGetParamType(1) != STACK_INT)
+        {
+            stackError("Argument 2 (finalPathOnly) is not an int");
+            stackPushUndefined();
+            return;
+        }
+        stackGetParamInt(1, &finalPathOnly);
+    }
+
+    printf("[%d] requesting playback demoId %d\n", playerId, demoId);
+
+    // Clear the player's current playback state
+    sDemoPlayback_t *pPlayback = detachPlayback(playerId);
+    pPlayback->selectedFrame = 0;
+    pPlayback->selectedPathPos = 0;
+    pPlayback->isFinalPathOnly = false;
+    pPlayback->decoder.frameIdx = -1;
+    pPlayback->nextDecoder.frameIdx = -1;
+    pPlayback->time = 0.0f;
+    pPlayback->lerpFraction = 0.0f;
+    pPlayback->pDemo = useDemoById(demoId);
+    if (pPlayback->pDemo && finalPathOnly)
     {
-        if (pLastExistingFrame->isKeyFrame)
+        if (pPlayback->pDemo->pathSize == 0)
         {
-            pNewFrame->prevKeyFrame = idxLastExistingFrame;
+            printf("[%d] requested playback demoId %d has no final path (yet)\n", playerId, demoId);
+            pPlayback->pDemo = NULL;
         }
         else
         {
-            pNewFrame->prevKeyFrame = pLastExistingFrame->prevKeyFrame;
+            pPlayback->isFinalPathOnly = true;
+            pPlayback->selectedFrame = getPathFrame(pPlayback->pDemo, 0);
         }
     }
 
-    // If the new frame is a key frame, update all previous non-key frames to point to this frame
-    if (!isFirstFrame && pNewFrame->isKeyFrame)
+    if (!pPlayback->pDemo)
     {
-        for (int i = pDemo->lastKeyFrame; i < idxNewFrame; i++)
-        {
-            sDemoFrame_t *pTmpFrame = &pDemo->pDemoFrames[i];
-            pTmpFrame->nextKeyFrame = idxNewFrame;
-        }
+        stackPushUndefined();
+    }
+    else
+    {
+        printf("[%d] requested playback demoId %d was found\n", playerId, demoId);
+        stackPushInt(1);
+    }
+}
+
+void Gsc_Demo_ReadFrame_Origin(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
 
-        // Update the last key frame of the demo
-        pDemo->lastKeyFrame = idxNewFrame;
+    sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pDemo || (pDemo->size == 0))
+    {
+        stackPushUndefined();
     }
     else
     {
-        pNewFrame->nextKeyFrame = idxNewFrame;
+        sDemoFrame_t *pDemoFrame = getPlaybackFrame(pPlayback); // CoD2 stock Scr_AddVector doesn't like const here
+        stackPushVector(pDemoFrame->origin);
     }
+}
 
-    // We added 1 frame, so demo size increases by 1
-    pDemo->size++;
-    pDemo->currentFrame++;
-    pDemo->isFirstFrameFilled = true;
+void Gsc_Demo_ReadFrame_SaveNow(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
 
-    // TODO: key frame branching (player loads)
-    // TODO: re-allocate pDemoFrames if we're over halfway
+    sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pDemo || (pDemo->size == 0))
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        sDemoFrame_t *pDemoFrame = getPlaybackFrame(pPlayback);
+        stackPushInt(pDemoFrame->saveNow);
+    }
+}
 
-    //printf("Added frame %d to demo of player %d\n", idxNewFrame, playerId);
-    stackPushInt(demoId);
+void Gsc_Demo_ReadFrame_LoadNow(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pDemo || (pDemo->size == 0))
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        const sDemoFrame_t *pDemoFrame = getPlaybackFrame(pPlayback);
+        stackPushInt(pDemoFrame->loadNow);
+    }
 }
 
-void Gsc_Demo_CompleteDemo()
+void Gsc_Demo_ReadFrame_FPS(int playerId)
 {
-    int demoId = -1;
-    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pDemo || (pDemo->size == 0))
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        const sDemoFrame_t *pDemoFrame = getPlaybackFrame(pPlayback);
+        stackPushInt(pDemoFrame->fps);
+    }
+}
+
+void Gsc_Demo_ReadFrame_Flags(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pDemo || (pDemo->size == 0))
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        const sDemoFrame_t *pDemoFrame = getPlaybackFrame(pPlayback);
+        stackPushInt(pDemoFrame->flags);
+    }
+}
+
+void Gsc_Demo_ReadFrame_RPGNow(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pDemo || (pDemo->size == 0))
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        const sDemoFrame_t *pDemoFrame = getPlaybackFrame(pPlayback);
+        stackPushInt(pDemoFrame->rpgNow);
+    }
+}
+
+void Gsc_Demo_ReadFrame_Angles(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pDemo || (pDemo->size == 0))
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        sDemoFrame_t *pDemoFrame = getPlaybackFrame(pPlayback); // CoD2 stock Scr_AddVector doesn't like const here
+        stackPushVector(pDemoFrame->angles);
+    }
+}
+void Gsc_Demo_ReadFrame(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pDemo || (pDemo->size == 0))
+    {
+        stackPushUndefined();
+    }
+    else
+    {
+        Base_Gsc_Demo_PushPlaybackFrame(pPlayback);
+    }
+}
 
-    sDemo_t *pDemo = findDemoById(demoId);
-    if (!pDemo)
+void Gsc_Demo_AdvancePlayback()
+{
+    if ((Scr_GetNumParam() != 1) || (stackGetParamType(0) != STACK_INT))
     {
-        printf("Demo with id %d not found, can't complete..\n", demoId);
+        stackError("Expected 1 argument: nrFramesToSkip");
+        stackPushUndefined();
         return;
     }
 
-    pDemo->isComplete = true;
+    int nrFramesToSkip = 0;
+    stackGetParamInt(0, &nrFramesToSkip);
 
-    // TODO: keyframe branching?
-}
+    // Advances every player that has a demo selected and returns their frames in 1 call.
+    // Each entry is the array that readPlaybackFrame returns, with the player's clientNum appended.
+    // Players that share a playback are advanced together, so their frame is only decoded once
+    groupPlaybacks();
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        sDemoPlayback_t *pPlayback = &opencj_playback[i];
+        if (!pPlayback->pLeader && pPlayback->pDemo && (pPlayback->pDemo->size > 0))
+        {
+            skipPlaybackFrames(i, pPlayback, nrFramesToSkip, false);
+        }
+    }
 
-//==========================================================================
-// Functions related to playback & control                                        
-//==========================================================================
+    stackMakeArray();
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        sDemoPlayback_t *pPlayback = getSharedPlayback(i);
+        const sDemo_t *pDemo = pPlayback->pDemo;
+        if (!pDemo || (pDemo->size == 0))
+        {
+            continue;
+        }
 
-void Gsc_Demo_SelectPlaybackDemo(int playerId)
+        Base_Gsc_Demo_PushPlaybackFrame(pPlayback);
+        stackPushInt(i);
+        stackPushArrayNext();
+        stackPushArrayNext();
+    }
+}
+
+void Gsc_Demo_SeekPlaybackTime(int playerId)
 {
     if (Base_Gsc_IsValidClientNum(playerId)) return;
 
-    int demoId = -1;
-    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+    if ((Scr_GetNumParam() != 1) || ((stackGetParamType(0) != STACK_FLOAT) && (stackGetParamType(0) != STACK_INT)))
+    {
+        stackError("Expected 1 argument: timeMs");
+        stackPushUndefined();
+        return;
+    }
 
-    printf("[%d] requesting playback demoId %d\n", playerId, demoId);
+    float time = 0.0f;
+    stackGetParamFloat(0, &time);
 
-    // Clear the player's current playback state
-    sDemoPlayback_t *pPlayback = &opencj_playback[playerId];
-    pPlayback->selectedFrame = 0;
-    pPlayback->pDemo = findDemoById(demoId);
-    if (!pPlayback->pDemo)
+    // Time is relative to the start of the demo (or the final path), the new playback position is returned
+    sDemoPlayback_t *pPlayback = detachPlayback(playerId);
+    const sDemo_t *pDemo = pPlayback->pDemo;
+    if (!pDemo || (pDemo->size == 0))
     {
         stackPushUndefined();
     }
     else
     {
-        printf("[%d] requested playback demoId %d was found\n", playerId, demoId);
-        stackPushInt(1);
+        stackPushInt(seekPlaybackTime(pPlayback, time));
     }
 }
 
-void Gsc_Demo_ReadFrame_Origin(int playerId)
+void Gsc_Demo_GetPlaybackTime(int playerId)
 {
     if (Base_Gsc_IsValidClientNum(playerId)) return;
 
-    const sDemoPlayback_t *pPlayback = &opencj_playback[playerId];
+    sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
     const sDemo_t *pDemo = pPlayback->pDemo;
-    if (!pDemo)
+    if (!pDemo || (pDemo->size == 0))
     {
         stackPushUndefined();
     }
     else
     {
-        sDemoFrame_t *pDemoFrame = &pDemo->pDemoFrames[pPlayback->selectedFrame]; // CoD2 stock Scr_AddVector doesn't like const here
-        stackPushVector(pDemoFrame->origin);
+        stackPushFloat(pPlayback->time);
     }
 }
 
-void Gsc_Demo_ReadFrame_SaveNow(int playerId)
+void Gsc_Demo_GetPlaybackDuration(int playerId)
 {
     if (Base_Gsc_IsValidClientNum(playerId)) return;
 
-    const sDemoPlayback_t *pPlayback = &opencj_playback[playerId];
+    sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
     const sDemo_t *pDemo = pPlayback->pDemo;
-    if (!pDemo)
+    if (!pDemo || (pDemo->size == 0))
     {
         stackPushUndefined();
     }
     else
     {
-        sDemoFrame_t *pDemoFrame = &pDemo->pDemoFrames[pPlayback->selectedFrame];
-        stackPushInt(pDemoFrame->saveNow);
+        stackPushFloat(getPlaybackPosTime(pPlayback, getLastPlaybackPos(pPlayback)));
     }
 }
 
-void Gsc_Demo_ReadFrame_LoadNow(int playerId)
+void Gsc_Demo_ReadInterpolatedFrame(int playerId)
 {
     if (Base_Gsc_IsValidClientNum(playerId)) return;
 
-    const sDemoPlayback_t *pPlayback = &opencj_playback[playerId];
+    sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
     const sDemo_t *pDemo = pPlayback->pDemo;
-    if (!pDemo)
+    if (!pDemo || (pDemo->size == 0))
     {
         stackPushUndefined();
+        return;
     }
-    else
+
+    // [origin, angles] at the playback time, which can be in between frames after seekPlaybackTime
+    vec3_t origin;
+    vec3_t angles;
+    getInterpolatedPlaybackFrame(pPlayback, origin, angles);
+    stackMakeArray();
+    stackPushVector(origin);
+    stackPushArrayNext();
+    stackPushVector(angles);
+    stackPushArrayNext();
+}
+
+void Gsc_Demo_BindPlaybackEntity(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    if ((Scr_GetNumParam() != 1) || (stackGetParamType(0) != STACK_INT))
     {
-        const sDemoFrame_t *pDemoFrame = &pDemo->pDemoFrames[pPlayback->selectedFrame];
-        stackPushInt(pDemoFrame->loadNow);
+        stackError("Expected 1 argument: entityNumber");
+        return;
+    }
+
+    int entityNum = -1;
+    stackGetParamInt(0, &entityNum);
+    if ((entityNum < 0) || (entityNum >= MAX_GENTITIES))
+    {
+        stackError("Argument 1 (entityNumber) %d out of range", entityNum);
+        return;
+    }
+
+    // Players are moved by their own movement code, only other entities (i.e. a ghost model) can follow a demo
+    gentity_t *pEntity = &g_entities[entityNum];
+    if (pEntity->client)
+    {
+        stackError("Entity %d is a player, can't bind it to playback", entityNum);
+        return;
+    }
+    if (!pEntity->r.inuse)
+    {
+        stackError("Entity %d is not in use, can't bind it to playback", entityNum);
+        return;
     }
+
+    // Binding starts playback at normal speed. The entity should be unbound before it is deleted, it is unbound once it's freed otherwise
+    sDemoPlayback_t *pPlayback = detachPlayback(playerId);
+    pPlayback->pEntity = pEntity;
+    pPlayback->speed = 1.0f;
+    pPlayback->isPaused = false;
 }
 
-void Gsc_Demo_ReadFrame_FPS(int playerId)
+void Gsc_Demo_UnbindPlaybackEntity(int playerId)
 {
     if (Base_Gsc_IsValidClientNum(playerId)) return;
 
-    const sDemoPlayback_t *pPlayback = &opencj_playback[playerId];
-    const sDemo_t *pDemo = pPlayback->pDemo;
-    if (!pDemo)
+    detachPlayback(playerId)->pEntity = NULL;
+}
+
+void Gsc_Demo_SetPlaybackSpeed(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    if ((Scr_GetNumParam() != 1) || ((stackGetParamType(0) != STACK_FLOAT) && (stackGetParamType(0) != STACK_INT)))
     {
-        stackPushUndefined();
+        stackError("Expected 1 argument: speed");
+        return;
     }
-    else
+
+    // 1 is real time, fractions are slow motion and negative speeds play in reverse
+    float speed = 1.0f;
+    stackGetParamFloat(0, &speed);
+    detachPlayback(playerId)->speed = speed;
+}
+
+void Gsc_Demo_SetPlaybackPaused(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    if ((Scr_GetNumParam() != 1) || (stackGetParamType(0) != STACK_INT))
     {
-        const sDemoFrame_t *pDemoFrame = &pDemo->pDemoFrames[pPlayback->selectedFrame];
-        stackPushInt(pDemoFrame->fps);
+        stackError("Expected 1 argument: isPaused");
+        return;
     }
+
+    int isPaused = 0;
+    stackGetParamInt(0, &isPaused);
+    detachPlayback(playerId)->isPaused = (isPaused != 0);
 }
 
-void Gsc_Demo_ReadFrame_Flags(int playerId)
+void Gsc_Demo_StartComparison(int playerId)
 {
     if (Base_Gsc_IsValidClientNum(playerId)) return;
 
-    const sDemoPlayback_t *pPlayback = &opencj_playback[playerId];
-    const sDemo_t *pDemo = pPlayback->pDemo;
-    if (!pDemo)
+    // A complete run is compared as a whole, for playback of that run. Without it, script compares the player's live position
+    int nrArgs = Scr_GetNumParam();
+    if ((nrArgs < 1) || (nrArgs > 3))
     {
+        stackError("Expected 1 to 3 arguments: referenceDemoId, [runDemoId], [splitOnKeyFrames]");
         stackPushUndefined();
+        return;
     }
-    else
+
+    int referenceId = -1;
+    if (!Base_Gsc_GetValidDemoId(&referenceId, nrArgs)) return;
+
+    int runId = 0;
+    int splitOnKeyFrames = 0;
+    for (int i = 1; i < nrArgs; i++)
     {
-        const sDemoFrame_t *pDemoFrame = &pDemo->pDemoFrames[pPlayback->selectedFrame];
-        stackPushInt(pDemoFrame->flags);
+        if (stackGetParamType(i) != STACK_INT)
+        {
+            stackError("Argument %d (%s) is not an int", i + 1, (i == 1) ? "runDemoId" : "splitOnKeyFrames");
+            stackPushUndefined();
+            return;
+        }
+        int *pValue = (i == 1) ? &runId : &splitOnKeyFrames;
+        stackGetParamInt(i, pValue);
+    }
+
+    sDemoComparison_t *pComparison = &opencj_comparisons[playerId];
+    freeDemoComparison(pComparison);
+
+    // The reference path is copied before the run is looked up, which may spill the reference to stay within the memory budget
+    const sDemo_t *pReference = useDemoById(referenceId);
+    if (!pReference || (pReference->pathSize == 0) || !readDemoComparePath(pReference, (splitOnKeyFrames != 0), &pComparison->reference))
+    {
+        printf("[%d] can't compare with demo %d, it doesn't exist or has no final path\n", playerId, referenceId);
+        stackPushUndefined();
+        return;
+    }
+    pComparison->referenceId = referenceId;
+
+    if (runId > 0)
+    {
+        const sDemo_t *pRun = useDemoById(runId);
+        if (!pRun || (pRun->pathSize == 0) || !compareDemoRun(pComparison, pRun, (splitOnKeyFrames != 0)))
+        {
+            printf("[%d] can't compare demo %d with demo %d, it doesn't exist or has no final path\n", playerId, runId, referenceId);
+            freeDemoComparison(pComparison);
+            stackPushUndefined();
+            return;
+        }
     }
+
+    stackPushInt(pComparison->reference.nrSplits);
 }
 
-void Gsc_Demo_ReadFrame_RPGNow(int playerId)
+void Gsc_Demo_StopComparison(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    freeDemoComparison(&opencj_comparisons[playerId]);
+}
+
+void Gsc_Demo_GetComparisonDelta(int playerId)
 {
     if (Base_Gsc_IsValidClientNum(playerId)) return;
 
-    const sDemoPlayback_t *pPlayback = &opencj_playback[playerId];
+    // Time in ms the player is behind (positive) or ahead of the reference at the same position.
+    // Either live, from the player's position and run time, or at the playback position of the compared run
+    int nrArgs = Scr_GetNumParam();
+    if ((nrArgs != 0) && ((nrArgs != 2) || (stackGetParamType(0) != STACK_VECTOR)
+                          || ((stackGetParamType(1) != STACK_INT) && (stackGetParamType(1) != STACK_FLOAT))))
+    {
+        stackError("Expected no arguments, or 2 arguments: origin, runTimeMs");
+        stackPushUndefined();
+        return;
+    }
+
+    sDemoComparison_t *pComparison = &opencj_comparisons[playerId];
+    if (pComparison->referenceId == 0)
+    {
+        stackPushUndefined();
+        return;
+    }
+
+    if (nrArgs == 2)
+    {
+        vec3_t origin;
+        float runTime = 0.0f;
+        stackGetParamVector(0, origin);
+        stackGetParamFloat(1, &runTime);
+        stackPushFloat(runTime - alignWithReference(pComparison, origin));
+        return;
+    }
+
+    const sDemoPlayback_t *pPlayback = getSharedPlayback(playerId);
     const sDemo_t *pDemo = pPlayback->pDemo;
-    if (!pDemo)
+    int pos = -1;
+    if (pDemo && (pComparison->runId > 0) && (pDemo->id == pComparison->runId))
+    {
+        pos = pPlayback->isFinalPathOnly ? pPlayback->selectedPathPos : getFramePathPos(pDemo, pPlayback->selectedFrame);
+    }
+    if ((pos < 0) || (pos >= pComparison->nrDeltas))
     {
         stackPushUndefined();
+        return;
     }
-    else
+
+    float delta = pComparison->pDeltas[pos];
+    if ((pPlayback->lerpFraction > 0.0f) && ((pos + 1) < pComparison->nrDeltas))
     {
-        const sDemoFrame_t *pDemoFrame = &pDemo->pDemoFrames[pPlayback->selectedFrame];
-        stackPushInt(pDemoFrame->rpgNow);
+        delta += (pComparison->pDeltas[pos + 1] - delta) * pPlayback->lerpFraction;
     }
+    stackPushFloat(delta);
 }
 
-void Gsc_Demo_ReadFrame_Angles(int playerId)
+void Gsc_Demo_GetComparisonSplits(int playerId)
 {
     if (Base_Gsc_IsValidClientNum(playerId)) return;
 
-    const sDemoPlayback_t *pPlayback = &opencj_playback[playerId];
-    const sDemo_t *pDemo = pPlayback->pDemo;
-    if (!pDemo)
+    // Split times of the reference in ms, or with a compared run the time deltas of the splits that both runs have
+    int isRunDeltas = 0;
+    if (Scr_GetNumParam() > 0)
+    {
+        if ((Scr_GetNumParam() != 1) || (stackGetParamType(0) != STACK_INT))
+        {
+            stackError("Expected no arguments, or 1 argument: runDeltas");
+            stackPushUndefined();
+            return;
+        }
+        stackGetParamInt(0, &isRunDeltas);
+    }
+
+    const sDemoComparison_t *pComparison = &opencj_comparisons[playerId];
+    if ((pComparison->referenceId == 0) || (isRunDeltas && (pComparison->runId == 0)))
     {
         stackPushUndefined();
+        return;
     }
-    else
+
+    const sDemoComparePath_t *pReference = &pComparison->reference;
+    int nrSplits = isRunDeltas ? ((pComparison->nrRunSplits < pReference->nrSplits) ? pComparison->nrRunSplits : pReference->nrSplits) : pReference->nrSplits;
+    stackMakeArray();
+    for (int i = 0; i < nrSplits; i++)
     {
-        sDemoFrame_t *pDemoFrame = &pDemo->pDemoFrames[pPlayback->selectedFrame]; // CoD2 stock Scr_AddVector doesn't like const here
-        stackPushVector(pDemoFrame->angles);
+        stackPushFloat(isRunDeltas ? (pComparison->pRunSplitTimes[i] - pReference->pSplitTimes[i]) : pReference->pSplitTimes[i]);
+        stackPushArrayNext();
     }
 }
+
 void Gsc_Demo_SkipFrame(int playerId)
 {
     if (Scr_GetNumParam() != 1)
@@ -814,3 +5542,202 @@ void Gsc_Demo_ReadFrame_PrevKeyFrame(int playerId)
 {
     Base_Gsc_Demo_FrameSkip(playerId, -1, true);
 }
+
+//==========================================================================
+// Functions related to native recording
+//==========================================================================
+
+void Gsc_Demo_StartRecording(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    int demoId = -1;
+    if (!Base_Gsc_GetValidDemoId(&demoId, 1)) return;
+
+    sDemo_t *pDemo = useDemoById(demoId);
+    if (!pDemo || pDemo->isComplete)
+    {
+        stackPushUndefined();
+        return;
+    }
+
+    sDemoRecorder_t *pRecorder = &opencj_recorders[playerId];
+    memset(pRecorder, 0, sizeof(*pRecorder));
+    pRecorder->pDemo = pDemo;
+    stackPushInt(demoId);
+}
+
+void Gsc_Demo_StopRecording(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    memset(&opencj_recorders[playerId], 0, sizeof(opencj_recorders[playerId]));
+}
+
+void Gsc_Demo_RecordEvent(int playerId)
+{
+    if (Base_Gsc_IsValidClientNum(playerId)) return;
+
+    int nrArgs = Scr_GetNumParam();
+    if ((nrArgs < 1) || (nrArgs > 2) || (stackGetParamType(0) != STACK_STRING) || ((nrArgs > 1) && (stackGetParamType(1) != STACK_INT)))
+    {
+        stackError("Expected 1 or 2 arguments: \"save\" | \"load\" [loadBackwardsCount] | \"rpg\" | \"key\"");
+        return;
+    }
+
+    const char *event = NULL;
+    stackGetParamString(0, &event);
+
+    // Events are stored in the next recorded frame
+    sDemoRecorder_t *pRecorder = &opencj_recorders[playerId];
+    if (!strcmp(event, "save"))
+    {
+        pRecorder->saveNow = true;
+    }
+    else if (!strcmp(event, "load"))
+    {
+        pRecorder->loadNow = true;
+        pRecorder->loadBackwardsCount = 0;
+        if (nrArgs > 1)
+        {
+            stackGetParamInt(1, &pRecorder->loadBackwardsCount);
+        }
+    }
+    else if (!strcmp(event, "rpg"))
+    {
+        pRecorder->rpgNow = true;
+    }
+    else if (!strcmp(event, "key"))
+    {
+        pRecorder->isKeyFrame = true;
+    }
+    else
+    {
+        stackError("Unknown demo event %s", event);
+    }
+}
+
+/**************************************************************************
+ * API functions                                                          *
+ **************************************************************************/
+
+void opencj_recordDemoFrame(int clientNum, int time)
+{
+    if ((clientNum < 0) || (clientNum >= MAX_CLIENTS))
+    {
+        return;
+    }
+
+    sDemoRecorder_t *pRecorder = &opencj_recorders[clientNum];
+    if (!pRecorder->pDemo)
+    {
+        return;
+    }
+
+    playerState_t *ps = SV_GameClientNum(clientNum);
+    if (!ps)
+    {
+        return;
+    }
+
+    int avgFrameTimeMs = opencj_getPlayerAvgFrameTimeMs(clientNum);
+
+    sDemoFrame_t frame;
+    memcpy(frame.origin, ps->origin, sizeof(frame.origin));
+    memcpy(frame.angles, ps->viewangles, sizeof(frame.angles));
+    frame.flags = ps->pm_flags & 0xFFFF;
+    frame.fps = (avgFrameTimeMs > 0) ? (1000 / avgFrameTimeMs) : 0;
+    frame.isKeyFrame = pRecorder->isKeyFrame;
+    frame.saveNow = pRecorder->saveNow;
+    frame.loadNow = pRecorder->loadNow;
+    frame.rpgNow = pRecorder->rpgNow;
+    if (!addDemoFrame(pRecorder->pDemo, &frame, pRecorder->loadBackwardsCount, time))
+    {
+        pRecorder->pDemo = NULL;
+        return;
+    }
+
+    pRecorder->isKeyFrame = false;
+    pRecorder->saveNow = false;
+    pRecorder->loadNow = false;
+    pRecorder->rpgNow = false;
+}
+
+void opencj_stopDemoRecording(int clientNum)
+{
+    if ((clientNum >= 0) && (clientNum < MAX_CLIENTS))
+    {
+        memset(&opencj_recorders[clientNum], 0, sizeof(opencj_recorders[clientNum]));
+    }
+}
+
+void opencj_runDemoPlayback(int time)
+{
+    // Playback follows the server time, so it doesn't depend on the server frame rate the demo was recorded at
+    static bool hasPrevTime = false;
+    static int prevTime = 0;
+    int elapsedMs = (hasPrevTime && (time > prevTime)) ? (time - prevTime) : 0;
+    elapsedMs = (elapsedMs > 1000) ? 1000 : elapsedMs; // For example after a map change
+    bool isNewMap = hasPrevTime && (time < prevTime);
+    hasPrevTime = true;
+    prevTime = time;
+
+    // Entities don't survive a map change, and script can delete a bound entity. Its number can be in use by another entity after that
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        gentity_t *pEntity = opencj_playback[i].pEntity;
+        if (pEntity && (isNewMap || !pEntity->r.inuse))
+        {
+            printf("[%d] playback entity %d is gone, unbinding it\n", i, (int)(pEntity - g_entities));
+            detachPlayback(i)->pEntity = NULL;
+        }
+    }
+
+    // Every shared playback is advanced and interpolated once, the entities of all its viewers are moved to the result
+    groupPlaybacks();
+    vec3_t origins[MAX_CLIENTS];
+    vec3_t angles[MAX_CLIENTS];
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        sDemoPlayback_t *pPlayback = &opencj_playback[i];
+        const sDemo_t *pDemo = pPlayback->pDemo;
+        if (pPlayback->pLeader || !pPlayback->pEntity || !pDemo || (pDemo->size == 0))
+        {
+            continue;
+        }
+
+        // Playback stays at the first or last frame once it gets there
+        if (!pPlayback->isPaused)
+        {
+            seekPlaybackTime(pPlayback, pPlayback->time + (pPlayback->speed * elapsedMs));
+        }
+        getInterpolatedPlaybackFrame(pPlayback, origins[i], angles[i]);
+    }
+
+    // Viewers in a group are all bound to an entity or none are, so the leader has been advanced
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        gentity_t *pEntity = opencj_playback[i].pEntity;
+        const sDemoPlayback_t *pPlayback = getSharedPlayback(i);
+        if (!pEntity || !pPlayback->pDemo || (pPlayback->pDemo->size == 0))
+        {
+            continue;
+        }
+
+        int groupIdx = (int)(pPlayback - opencj_playback);
+        G_SetOrigin(pEntity, origins[groupIdx]);
+        G_SetAngle(pEntity, angles[groupIdx]);
+        SV_LinkEntity(pEntity);
+    }
+}
+
+void opencj_stopDemoPlayback(int clientNum)
+{
+    if ((clientNum >= 0) && (clientNum < MAX_CLIENTS))
+    {
+        sDemoPlayback_t *pPlayback = detachPlayback(clientNum);
+        pPlayback->pDemo = NULL;
+        pPlayback->pEntity = NULL;
+        freeDemoComparison(&opencj_comparisons[clientNum]);
+    }
+}
@@ -6,13 +6,30 @@
 //==========================================================================
 
 void Gsc_Demo_ClearAllDemos();
+void Gsc_Demo_SetMaxNumberOfDemos();
+void Gsc_Demo_SetMemoryBudget();
 void Gsc_Demo_HasKeyFrames();
 void Gsc_Demo_NumberOfFrames();
 void Gsc_Demo_NumberOfKeyFrames();
+void Gsc_Demo_NumberOfFinalPathFrames();
+void Gsc_Demo_FinalPathPosition();
+void Gsc_Demo_KeyFrameRank();
+void Gsc_Demo_KeyFrameByRank();
+void Gsc_Demo_NearestFrame();
+void Gsc_Demo_FindEvents();
+void Gsc_Demo_CountEvents();
+void Gsc_Demo_MaxSpeed();
+void Gsc_Demo_FpsHistogram();
+void Gsc_Demo_SimplifyRoute();
 void Gsc_Demo_CreateDemo();
 void Gsc_Demo_DestroyDemo();
 void Gsc_Demo_AddFrame();
+void Gsc_Demo_SetSparseRecording();
 void Gsc_Demo_CompleteDemo();
+void Gsc_Demo_GetPersistedDemos();
+void Gsc_Demo_SaveDemo();
+void Gsc_Demo_LoadDemo();
+void Gsc_Demo_Benchmark();
 
 //==========================================================================
 // Functions related to playback & control                                        
@@ -32,5 +49,41 @@ void Gsc_Demo_ReadFrame_NextKeyFrame(int playerId);
 void Gsc_Demo_ReadFrame_PrevKeyFrame(int playerId);
 void Gsc_Demo_ReadFrame_Flags(int playerId);
 void Gsc_Demo_ReadFrame_FPS(int playerId);
+void Gsc_Demo_ReadFrame(int playerId);
+void Gsc_Demo_AdvancePlayback();
+void Gsc_Demo_SeekPlaybackTime(int playerId);
+void Gsc_Demo_GetPlaybackTime(int playerId);
+void Gsc_Demo_GetPlaybackDuration(int playerId);
+void Gsc_Demo_ReadInterpolatedFrame(int playerId);
+void Gsc_Demo_BindPlaybackEntity(int playerId);
+void Gsc_Demo_UnbindPlaybackEntity(int playerId);
+void Gsc_Demo_SetPlaybackSpeed(int playerId);
+void Gsc_Demo_SetPlaybackPaused(int playerId);
+
+//==========================================================================
+// Functions related to comparing runs
+//==========================================================================
+
+void Gsc_Demo_StartComparison(int playerId);
+void Gsc_Demo_StopComparison(int playerId);
+void Gsc_Demo_GetComparisonDelta(int playerId);
+void Gsc_Demo_GetComparisonSplits(int playerId);
+
+//==========================================================================
+// Functions related to native recording
+//==========================================================================
+
+void Gsc_Demo_StartRecording(int playerId);
+void Gsc_Demo_StopRecording(int playerId);
+void Gsc_Demo_RecordEvent(int playerId);
+
+//==========================================================================
+// API functions, called by the server
+//==========================================================================
+
+void opencj_recordDemoFrame(int clientNum, int time); // Every server frame, after the client's frame has ended
+void opencj_stopDemoRecording(int clientNum);         // When the client disconnects
+void opencj_runDemoPlayback(int time);                // Every server frame, moves the entities that are bound to playback
+void opencj_stopDemoPlayback(int clientNum);          // When the client disconnects, also ends its comparison
 
 #endif // _OPENCJ_DEMO_HPP_
@@ -73,3 +73,8 @@ void opencj_clearPlayerFPS(int clientNum)
     opencj_prevClientFrameTimes[clientNum] = 0;
     opencj_avgFrameTimeMs[clientNum] = 0;
 }
+
+int opencj_getPlayerAvgFrameTimeMs(int clientNum)
+{
+    return opencj_avgFrameTimeMs[clientNum];
+}
@@ -3,5 +3,6 @@
 
 bool opencj_updatePlayerFPS(int, int, int *);
 void opencj_clearPlayerFPS(int);
+int opencj_getPlayerAvgFrameTimeMs(int);
 
 #endif // _OPENCJ_FPS_HPP_
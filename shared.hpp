@@ -68,6 +68,11 @@ extern "C" {
 #define stackGetParams      Scr_GetMultipleValues
 #define stackGetParamType   Scr_GetType
 
+// Keyed arrays: keys are interned script strings
+#define stackAllocString    Scr_AllocString
+#define stackFreeString     SL_RemoveRefToString
+#define stackPushArrayKey   Scr_AddArrayStringIndexed
+
 #define STACK_UNDEFINED           0x00
 #define STACK_BEGIN_REF           0x01
 #define STACK_POINTER             0x01